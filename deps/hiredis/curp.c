@@ -0,0 +1,584 @@
+/*
+ * Copyright (c) 2017 Stanford University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "curp.h"
+#include "sds.h"
+
+/* Layout of a witness record, see src/witnessProto.h. */
+#define CURP_RECORD_HDR_LEN 32
+
+/* Key spec of an update, from the reply to COMMAND. */
+typedef struct curpCommand {
+    sds name;
+    int firstkey, lastkey, keystep;
+} curpCommand;
+
+typedef struct redisCurpOp {
+    redisCurpContext *cc;
+    redisCurpCallbackFn *fn;
+    void *privdata;
+    sds cmd;                /* RESP encoded, without the RIFL ids. */
+    int selectdb;           /* Db a SELECT switches to, or -1. */
+    redisReply *reply;      /* Of the master, kept until the op is durable. */
+    int masterReplied;
+    int witnessPending;     /* Witness replies still to come. */
+    int witnessRejected;    /* Witnesses that didn't accept the records. */
+    int recorded;           /* Records sent to each witness, one per key. */
+    long long opNum;        /* From the CURP envelope of the reply. */
+    long long syncedOpNum;
+    struct redisCurpOp *next; /* In the queue of the context. */
+} redisCurpOp;
+
+/* The command table lives in 'commands' as a sorted array of curpCommand,
+ * with the number of entries in front. */
+typedef struct curpCommandTable {
+    size_t count;
+    curpCommand cmd[];
+} curpCommandTable;
+
+/* ------------------------------- Utilities -------------------------------- */
+
+static void curpStore32(char *p, uint32_t v) {
+    int j;
+    for (j = 0; j < 4; j++) p[j] = (char)(v >> (8*j));
+}
+
+static void curpStore64(char *p, uint64_t v) {
+    int j;
+    for (j = 0; j < 8; j++) p[j] = (char)(v >> (8*j));
+}
+
+static uint32_t rotl32(uint32_t x, int8_t r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+/* MurmurHash3_x86_32 (public domain, by Austin Appleby), the key hash the
+ * server uses for witness records (see trackUnsyncedRpc()). */
+static uint32_t curpKeyHash(const char *key, int len, uint32_t seed) {
+    const uint8_t *data = (const uint8_t*)key;
+    const int nblocks = len / 4;
+    const uint32_t c1 = 0xcc9e2d51, c2 = 0x1b873593;
+    const uint8_t *tail;
+    uint32_t h1 = seed, k1;
+    int i;
+
+    for (i = 0; i < nblocks; i++) {
+        k1 = (uint32_t)data[i*4] | (uint32_t)data[i*4+1] << 8 |
+             (uint32_t)data[i*4+2] << 16 | (uint32_t)data[i*4+3] << 24;
+        k1 *= c1; k1 = rotl32(k1,15); k1 *= c2;
+        h1 ^= k1; h1 = rotl32(h1,13); h1 = h1*5+0xe6546b64;
+    }
+    tail = data + nblocks*4;
+    k1 = 0;
+    switch (len & 3) {
+    case 3: k1 ^= (uint32_t)tail[2] << 16; /* fall through */
+    case 2: k1 ^= (uint32_t)tail[1] << 8;  /* fall through */
+    case 1: k1 ^= tail[0];
+            k1 *= c1; k1 = rotl32(k1,15); k1 *= c2; h1 ^= k1;
+    }
+    h1 ^= (uint32_t)len;
+    h1 ^= h1 >> 16; h1 *= 0x85ebca6b;
+    h1 ^= h1 >> 13; h1 *= 0xc2b2ae35;
+    h1 ^= h1 >> 16;
+    return h1;
+}
+
+/* RIFL ids are sent as base64 integers. */
+static sds curpCatId(sds s, long long id) {
+    static const char *digits =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char buf[12];
+    int j = sizeof(buf);
+
+    do {
+        buf[--j] = digits[id & 63];
+        id = (unsigned long long)id >> 6;
+    } while (id);
+    return sdscatprintf(s,"$%d\r\n%.*s\r\n",(int)sizeof(buf)-j,
+                        (int)sizeof(buf)-j,buf+j);
+}
+
+/* Return in '*arg' and '*len' the argument 'idx' of the RESP encoded
+ * command 'cmd', or return 0 if it has no such argument. */
+static int curpGetArg(const char *cmd, int idx, const char **arg, size_t *len) {
+    const char *p = strchr(cmd,'\n');
+    int argc = atoi(cmd+1), j;
+
+    if (idx >= argc) return 0;
+    for (j = 0; p; j++) {
+        size_t l = strtoul(p+2,NULL,10);
+        p = strchr(p+1,'\n')+1;
+        if (j == idx) {
+            *arg = p;
+            *len = l;
+            return 1;
+        }
+        p += l+1;
+    }
+    return 0;
+}
+
+static int curpCommandCompare(const void *a, const void *b) {
+    return strcasecmp(((const curpCommand*)a)->name,
+                      ((const curpCommand*)b)->name);
+}
+
+static curpCommand *curpLookupCommand(redisCurpContext *cc, const char *name, size_t len) {
+    curpCommandTable *table = cc->commands;
+    curpCommand key;
+    curpCommand *found;
+
+    key.name = sdsnewlen(name,len);
+    found = bsearch(&key,table->cmd,table->count,sizeof(curpCommand),
+                    curpCommandCompare);
+    sdsfree(key.name);
+    return found;
+}
+
+static void curpFreeOp(redisCurpOp *op) {
+    if (op->reply) freeReplyObject(op->reply);
+    sdsfree(op->cmd);
+    free(op);
+}
+
+/* ----------------------------- Op completion ------------------------------ */
+
+static void curpComplete(redisCurpOp *op) {
+    if (op->fn) op->fn(op->cc,op->reply,op->privdata);
+    curpFreeOp(op);
+}
+
+/* The master replies to CURPSYNC <opNum> once it synced the operations up
+ * to opNum, so the update is durable when this is called with a reply. */
+static void curpSyncCallback(redisAsyncContext *ac, void *r, void *privdata) {
+    redisCurpOp *op = privdata;
+    ((void) ac);
+
+    if (r == NULL) {
+        /* We don't know if the update is durable. */
+        freeReplyObject(op->reply);
+        op->reply = NULL;
+    } else {
+        freeReplyObject(r);
+        op->cc->syncCompletions++;
+    }
+    curpComplete(op);
+}
+
+static void curpCheckDone(redisCurpOp *op) {
+    redisCurpContext *cc = op->cc;
+
+    if (!op->masterReplied || op->witnessPending) return;
+    if (op->reply == NULL || op->opNum == -1 ||
+        op->opNum <= op->syncedOpNum ||
+        (op->recorded && op->witnessRejected == 0))
+    {
+        if (op->reply) cc->fastCompletions++;
+        curpComplete(op);
+        return;
+    }
+
+    if (cc->master == NULL ||
+        redisAsyncCommand(cc->master,curpSyncCallback,op,"CURPSYNC %lld",
+                          op->opNum) != REDIS_OK)
+    {
+        curpSyncCallback(NULL,NULL,op);
+    }
+}
+
+static void curpMasterCallback(redisAsyncContext *ac, void *r, void *privdata) {
+    redisCurpOp *op = privdata;
+
+    op->masterReplied = 1;
+    op->reply = r;
+    if (r) {
+        op->opNum = ac->c.reader->curpOpNum;
+        op->syncedOpNum = ac->c.reader->curpSyncedOpNum;
+    }
+    curpCheckDone(op);
+}
+
+/* WMRECORD replies with a bitmap of the accepted records. */
+static void curpWitnessCallback(redisAsyncContext *ac, void *r, void *privdata) {
+    redisCurpOp *op = privdata;
+    redisReply *reply = r;
+    int numkeys = op->recorded, k; /* One record per key. */
+    ((void) ac);
+
+    if (reply == NULL || reply->type != REDIS_REPLY_STRING ||
+        reply->len*8 < numkeys)
+    {
+        op->witnessRejected++;
+    } else {
+        for (k = 0; k < numkeys; k++) {
+            if (!(reply->str[k/8] & (1<<(k%8)))) {
+                op->witnessRejected++;
+                break;
+            }
+        }
+    }
+    op->witnessPending--;
+    curpCheckDone(op);
+}
+
+/* Replies to commands that are not updates are passed through. */
+static void curpPlainCallback(redisAsyncContext *ac, void *r, void *privdata) {
+    redisCurpOp *op = privdata;
+    redisReply *reply = r;
+    ((void) ac);
+
+    if (reply && op->selectdb != -1 && reply->type == REDIS_REPLY_STATUS)
+        op->cc->db = op->selectdb;
+    op->reply = reply;
+    curpComplete(op);
+}
+
+/* ------------------------------- Dispatching ------------------------------ */
+
+static int curpSend(redisCurpOp *op) {
+    redisCurpContext *cc = op->cc;
+    const char *cmdname = NULL, *key = NULL;
+    size_t cmdlen = 0, keylen = 0;
+    curpCommand *spec;
+    sds cmd, records;
+    int argc, j, k, numkeys = 0;
+
+    if (cc->master == NULL) return REDIS_ERR;
+    curpGetArg(op->cmd,0,&cmdname,&cmdlen);
+    spec = curpLookupCommand(cc,cmdname,cmdlen);
+    if (spec == NULL) {
+        if (cmdlen == 6 && !strncasecmp(cmdname,"select",6) &&
+            curpGetArg(op->cmd,1,&key,&keylen))
+            op->selectdb = atoi(key);
+        return redisAsyncFormattedCommand(cc->master,curpPlainCallback,op,
+                                          op->cmd,sdslen(op->cmd));
+    }
+
+    /* The same request, with the RIFL ids as two more arguments. */
+    argc = atoi(op->cmd+1);
+    cmd = sdscatprintf(sdsempty(),"*%d",argc+2);
+    cmd = sdscat(cmd,strchr(op->cmd,'\r'));
+    cmd = curpCatId(cmd,cc->clientId);
+    cmd = curpCatId(cmd,++cc->requestId);
+    if (redisAsyncFormattedCommand(cc->master,curpMasterCallback,op,
+                                   cmd,sdslen(cmd)) != REDIS_OK)
+    {
+        sdsfree(cmd);
+        return REDIS_ERR;
+    }
+
+    /* Record it at the witnesses, one record per key, unless we still
+     * miss what is needed to build the records. Then the update takes
+     * the sync path. */
+    if (cc->numwitnesses == 0 || cc->witnessesReady < cc->numwitnesses ||
+        cc->masterId < 0)
+    {
+        sdsfree(cmd);
+        return REDIS_OK;
+    }
+    records = sdsempty();
+    for (k = spec->firstkey; k <= (spec->lastkey < 0 ? argc+spec->lastkey :
+         spec->lastkey); k += spec->keystep)
+    {
+        char hdr[CURP_RECORD_HDR_LEN];
+        uint32_t keyHash;
+
+        if (!curpGetArg(op->cmd,k,&key,&keylen)) break;
+        keyHash = curpKeyHash(key,(int)keylen,(uint32_t)cc->db);
+        curpStore64(hdr,(uint64_t)cc->masterId);
+        curpStore32(hdr+8,keyHash);
+        curpStore32(hdr+12,keyHash & cc->hashMask);
+        curpStore64(hdr+16,(uint64_t)cc->clientId);
+        curpStore64(hdr+24,(uint64_t)cc->requestId);
+        records = sdscatprintf(records,"$%zu\r\n",sizeof(hdr)+sdslen(cmd));
+        records = sdscatlen(records,hdr,sizeof(hdr));
+        records = sdscatsds(records,cmd);
+        records = sdscatlen(records,"\r\n",2);
+        numkeys++;
+    }
+    sdsfree(cmd);
+    cmd = sdscatprintf(sdsempty(),"*%d\r\n$8\r\nWMRECORD\r\n",numkeys+1);
+    cmd = sdscatsds(cmd,records);
+    sdsfree(records);
+
+    op->recorded = numkeys;
+    for (j = 0; j < cc->numwitnesses; j++) {
+        op->witnessPending++;
+        if (cc->witness[j] == NULL ||
+            redisAsyncFormattedCommand(cc->witness[j],curpWitnessCallback,op,
+                                       cmd,sdslen(cmd)) != REDIS_OK)
+        {
+            op->witnessPending--;
+            op->witnessRejected++;
+        }
+    }
+    sdsfree(cmd);
+    return REDIS_OK;
+}
+
+/* Send the command, or queue it until we know which commands are updates. */
+static int curpSubmit(redisCurpContext *cc, redisCurpCallbackFn *fn, void *privdata, sds cmd) {
+    redisCurpOp *op;
+
+    if (cc->master == NULL) {
+        sdsfree(cmd);
+        return REDIS_ERR;
+    }
+    op = calloc(1,sizeof(*op));
+    if (op == NULL) {
+        sdsfree(cmd);
+        return REDIS_ERR;
+    }
+    op->cc = cc;
+    op->fn = fn;
+    op->privdata = privdata;
+    op->cmd = cmd;
+    op->selectdb = -1;
+    op->opNum = op->syncedOpNum = -1;
+
+    if (cc->commands == NULL) {
+        if (cc->queuedTail) cc->queuedTail->next = op;
+        else cc->queued = op;
+        cc->queuedTail = op;
+        return REDIS_OK;
+    }
+    if (curpSend(op) != REDIS_OK) {
+        curpFreeOp(op);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Complete the queued commands with a NULL reply, or send them. */
+static void curpFlushQueue(redisCurpContext *cc) {
+    redisCurpOp *op = cc->queued, *next;
+
+    cc->queued = cc->queuedTail = NULL;
+    while (op) {
+        next = op->next;
+        op->next = NULL;
+        if (cc->commands == NULL || curpSend(op) != REDIS_OK) {
+            op->reply = NULL;
+            curpComplete(op);
+        }
+        op = next;
+    }
+}
+
+/* -------------------------------- Startup --------------------------------- */
+
+/* Stop using a context that is going away. */
+static void curpForgetContext(redisCurpContext *cc, const redisAsyncContext *ac) {
+    int j;
+
+    if (cc->master == ac) {
+        cc->master = NULL;
+        curpFlushQueue(cc);
+    }
+    for (j = 0; j < cc->numwitnesses; j++)
+        if (cc->witness[j] == ac) cc->witness[j] = NULL;
+}
+
+/* A NULL reply to the first command means the connection failed, and
+ * hiredis frees the context without calling the disconnect callback. */
+static void curpDiscardCallback(redisAsyncContext *ac, void *r, void *privdata) {
+    if (r) freeReplyObject(r);
+    else curpForgetContext(privdata,ac);
+}
+
+static void curpMasterIdCallback(redisAsyncContext *ac, void *r, void *privdata) {
+    redisCurpContext *cc = privdata;
+    redisReply *reply = r;
+    ((void) ac);
+
+    if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 &&
+        reply->element[1]->type == REDIS_REPLY_STRING)
+        cc->masterId = strtoll(reply->element[1]->str,NULL,10);
+    if (reply) freeReplyObject(reply);
+}
+
+/* Keep the name and key spec of the at-most-once commands with keys. */
+static void curpCommandsCallback(redisAsyncContext *ac, void *r, void *privdata) {
+    redisCurpContext *cc = privdata;
+    redisReply *reply = r;
+    curpCommandTable *table;
+    size_t j, f;
+    ((void) ac);
+
+    if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+        if (reply) freeReplyObject(reply);
+        curpFlushQueue(cc);
+        return;
+    }
+    table = malloc(sizeof(*table)+sizeof(curpCommand)*reply->elements);
+    if (table == NULL) {
+        freeReplyObject(reply);
+        curpFlushQueue(cc);
+        return;
+    }
+    table->count = 0;
+    for (j = 0; j < reply->elements; j++) {
+        redisReply *info = reply->element[j];
+        int update = 0;
+
+        if (info->type != REDIS_REPLY_ARRAY || info->elements < 6) continue;
+        for (f = 0; f < info->element[2]->elements; f++) {
+            if (!strcmp(info->element[2]->element[f]->str,
+                        "execute_at_most_once"))
+                update = 1;
+        }
+        if (!update || info->element[3]->integer <= 0 ||
+            info->element[5]->integer <= 0) continue;
+        table->cmd[table->count].name = sdsnew(info->element[0]->str);
+        table->cmd[table->count].firstkey = (int)info->element[3]->integer;
+        table->cmd[table->count].lastkey = (int)info->element[4]->integer;
+        table->cmd[table->count].keystep = (int)info->element[5]->integer;
+        table->count++;
+    }
+    qsort(table->cmd,table->count,sizeof(curpCommand),curpCommandCompare);
+    cc->commands = table;
+    freeReplyObject(reply);
+    curpFlushQueue(cc);
+}
+
+static void curpWconfigCallback(redisAsyncContext *ac, void *r, void *privdata) {
+    redisCurpContext *cc = privdata;
+    redisReply *reply = r;
+
+    if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 &&
+        reply->element[0]->type == REDIS_REPLY_INTEGER)
+    {
+        /* Like the master, use the mask of the largest table. */
+        unsigned int mask = (unsigned int)(reply->element[0]->integer-1);
+        if (mask > cc->hashMask) cc->hashMask = mask;
+        cc->witnessesReady++;
+    } else if (reply == NULL) {
+        curpForgetContext(cc,ac);
+    }
+}
+
+static void curpDisconnectCallback(const redisAsyncContext *ac, int status) {
+    redisCurpContext *cc = ac->data;
+
+    curpForgetContext(cc,ac);
+    if (cc->onDisconnect) cc->onDisconnect(cc,ac,status);
+}
+
+redisCurpContext *redisCurpCreate(redisAsyncContext *master, redisAsyncContext **witnesses, int numwitnesses) {
+    redisCurpContext *cc;
+    int j;
+
+    if (numwitnesses < 0 || numwitnesses > REDIS_CURP_MAX_WITNESSES)
+        return NULL;
+    cc = calloc(1,sizeof(*cc));
+    if (cc == NULL) return NULL;
+
+    /* A random client id, that the master will GC once we stop using it. */
+    srandom((unsigned int)(time(NULL) ^ getpid() ^ (uintptr_t)cc));
+    cc->clientId = ((((long long)random() << 31) | random()) &
+                    0x3fffffffffffffffLL) + 1;
+    cc->masterId = -1;
+    cc->master = master;
+    master->data = cc;
+    master->c.flags |= REDIS_NO_AUTO_FREE;
+    redisAsyncSetDisconnectCallback(master,curpDisconnectCallback);
+    redisAsyncCommand(master,curpDiscardCallback,cc,"CLIENT RIFL ON");
+    redisAsyncCommand(master,curpMasterIdCallback,cc,
+                      "CONFIG GET witness-master-id");
+    redisAsyncCommand(master,curpCommandsCallback,cc,"COMMAND");
+
+    cc->numwitnesses = numwitnesses;
+    for (j = 0; j < numwitnesses; j++) {
+        cc->witness[j] = witnesses[j];
+        witnesses[j]->data = cc;
+        redisAsyncSetDisconnectCallback(witnesses[j],curpDisconnectCallback);
+        redisAsyncCommand(witnesses[j],curpWconfigCallback,cc,"WCONFIG");
+    }
+    return cc;
+}
+
+int redisCurpSetDisconnectCallback(redisCurpContext *cc, redisCurpDisconnectCallback *fn) {
+    cc->onDisconnect = fn;
+    return REDIS_OK;
+}
+
+void redisCurpFree(redisCurpContext *cc) {
+    curpCommandTable *table = cc->commands;
+    size_t j;
+
+    cc->commands = NULL;
+    curpFlushQueue(cc);
+    if (table) {
+        for (j = 0; j < table->count; j++) sdsfree(table->cmd[j].name);
+        free(table);
+    }
+    free(cc);
+}
+
+/* -------------------------------- Commands -------------------------------- */
+
+int redisvCurpCommand(redisCurpContext *cc, redisCurpCallbackFn *fn, void *privdata, const char *format, va_list ap) {
+    char *cmd;
+    int len;
+    sds s;
+
+    len = redisvFormatCommand(&cmd,format,ap);
+    if (len == -1) return REDIS_ERR;
+    s = sdsnewlen(cmd,len);
+    free(cmd);
+    return curpSubmit(cc,fn,privdata,s);
+}
+
+int redisCurpCommand(redisCurpContext *cc, redisCurpCallbackFn *fn, void *privdata, const char *format, ...) {
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = redisvCurpCommand(cc,fn,privdata,format,ap);
+    va_end(ap);
+    return status;
+}
+
+int redisCurpCommandArgv(redisCurpContext *cc, redisCurpCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen) {
+    char *cmd;
+    int len;
+    sds s;
+
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    if (len == -1) return REDIS_ERR;
+    s = sdsnewlen(cmd,len);
+    free(cmd);
+    return curpSubmit(cc,fn,privdata,s);
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2017 Stanford University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HIREDIS_CURP_H
+#define __HIREDIS_CURP_H
+#include "async.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A CURP client on top of the async API.
+ *
+ * Updates (the at-most-once commands of the server, see COMMAND) get RIFL
+ * ids, and are recorded to every witness while the master executes them.
+ * The callback is called as soon as the update is durable: right after the
+ * master reply if all the witnesses accepted it (1 RTT), or else once the
+ * master synced it. Other commands are sent to the master as they are.
+ *
+ * The master and witness contexts are created and attached to an event
+ * loop by the caller, as usual. The CURP context then uses their 'data'
+ * and disconnect callback, and the replies of the master context are not
+ * freed automatically anymore (REDIS_NO_AUTO_FREE). Free the async contexts
+ * before the CURP context. */
+
+#define REDIS_CURP_MAX_WITNESSES 16
+
+struct redisCurpContext;
+struct redisCurpOp;
+struct curpCommandTable;
+
+/* Called with the reply of the master, or NULL if the connection was lost
+ * before the command was known to be durable. The reply is freed when the
+ * callback returns. */
+typedef void (redisCurpCallbackFn)(struct redisCurpContext*, redisReply*, void*);
+typedef void (redisCurpDisconnectCallback)(struct redisCurpContext*, const redisAsyncContext*, int status);
+
+typedef struct redisCurpContext {
+    redisAsyncContext *master;  /* NULL once disconnected. */
+    redisAsyncContext *witness[REDIS_CURP_MAX_WITNESSES]; /* Same. */
+    int numwitnesses;
+    int witnessesReady;         /* Witnesses that replied to WCONFIG. */
+
+    long long clientId;         /* RIFL client id, random. */
+    long long requestId;        /* RIFL id of the last update. */
+    long long masterId;         /* witness-master-id of the master, or -1. */
+    unsigned int hashMask;      /* Index mask of the largest witness table. */
+    int db;                     /* Selected db, the seed of key hashes. */
+
+    /* Key specs of the updates, by command name. NULL until the reply to
+     * COMMAND: commands are queued meanwhile. */
+    struct curpCommandTable *commands;
+    struct redisCurpOp *queued, *queuedTail;
+
+    long long fastCompletions;  /* Updates durable in 1 RTT. */
+    long long syncCompletions;  /* Updates that waited for a sync. */
+
+    redisCurpDisconnectCallback *onDisconnect;
+
+    /* Not used by hiredis */
+    void *data;
+} redisCurpContext;
+
+redisCurpContext *redisCurpCreate(redisAsyncContext *master, redisAsyncContext **witnesses, int numwitnesses);
+void redisCurpFree(redisCurpContext *cc);
+int redisCurpSetDisconnectCallback(redisCurpContext *cc, redisCurpDisconnectCallback *fn);
+
+int redisvCurpCommand(redisCurpContext *cc, redisCurpCallbackFn *fn, void *privdata, const char *format, va_list ap);
+int redisCurpCommand(redisCurpContext *cc, redisCurpCallbackFn *fn, void *privdata, const char *format, ...);
+int redisCurpCommandArgv(redisCurpContext *cc, redisCurpCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -574,6 +574,7 @@ redisReader *redisReaderCreate(void) {
     }
 
     r->ridx = -1;
+    r->curpOpNum = r->curpSyncedOpNum = -1;
     return r;
 }
 
@@ -617,6 +618,45 @@ int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
     return REDIS_OK;
 }
 
+static long long curpDecodeInt(const char *p, const char *end) {
+    long long v = 0;
+
+    for (; p < end; p++) {
+        int d;
+        if (*p >= 'A' && *p <= 'Z') d = *p-'A';
+        else if (*p >= 'a' && *p <= 'z') d = *p-'a'+26;
+        else if (*p >= '0' && *p <= '9') d = *p-'0'+52;
+        else if (*p == '+') d = 62;
+        else if (*p == '/') d = 63;
+        else break;
+        v = (v << 6) | d;
+    }
+    return v;
+}
+
+/* Consume the CURP envelope in front of the next reply, if any. Returns
+ * REDIS_ERR when we can't tell yet, so that the envelope of the previous
+ * reply is kept until the next one starts. */
+static int readCurpEnvelope(redisReader *r) {
+    char *p, *nl, *sp;
+
+    if (r->pos >= r->len)
+        return REDIS_ERR;
+    r->curpOpNum = r->curpSyncedOpNum = -1;
+    if (r->buf[r->pos] != '@')
+        return REDIS_OK;
+    p = r->buf+r->pos+1;
+    nl = memchr(p,'\n',r->len-r->pos-1);
+    if (nl == NULL)
+        return REDIS_ERR;
+    sp = memchr(p,' ',nl-p);
+    r->curpOpNum = curpDecodeInt(p,sp ? sp : nl);
+    if (sp != NULL)
+        r->curpSyncedOpNum = curpDecodeInt(sp+1,nl);
+    r->pos = nl+1-r->buf;
+    return REDIS_OK;
+}
+
 int redisReaderGetReply(redisReader *r, void **reply) {
     /* Default target pointer to NULL. */
     if (reply != NULL)
@@ -632,6 +672,9 @@ int redisReaderGetReply(redisReader *r, void **reply) {
 
     /* Set first item to process when the stack is empty. */
     if (r->ridx == -1) {
+        if (readCurpEnvelope(r) != REDIS_OK)
+            return REDIS_OK;
+
         r->rstack[0].type = -1;
         r->rstack[0].elements = -1;
         r->rstack[0].idx = -1;
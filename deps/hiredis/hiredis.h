@@ -79,6 +79,10 @@
 /* Flag that is set when monitor mode is active */
 #define REDIS_MONITORING 0x40
 
+/* Flag specific to the async API which means that replies are not freed
+ * after their callback returns: the callback owns them. */
+#define REDIS_NO_AUTO_FREE 0x200
+
 #define REDIS_REPLY_STRING 1
 #define REDIS_REPLY_ARRAY 2
 #define REDIS_REPLY_INTEGER 3
@@ -137,6 +141,12 @@ typedef struct redisReader {
 
     redisReplyObjectFunctions *fn;
     void *privdata;
+
+    /* CURP envelope "@<opNum> <synced opNum>" (base64) that a server sends
+     * ahead of the replies of RIFL requests. The values describe the last
+     * reply returned, and are -1 if it had no envelope. */
+    long long curpOpNum;
+    long long curpSyncedOpNum;
 } redisReader;
 
 /* Public API for the protocol parser. */
@@ -31,6 +31,7 @@
 #include "bio.h"
 #include "rifl.h"
 #include "rio.h"
+#include "witnessTracker.h"
 
 #include <signal.h>
 #include <fcntl.h>
@@ -198,9 +199,159 @@ ssize_t aofRewriteBufferWrite(int fd) {
  * ------------------------------------------------------------------------- */
 
 /* Starts a background task that performs fsync() against the specified
- * file descriptor (the one of the AOF file) in another thread. */
+ * file descriptor (the one of the AOF file) in another thread. When the
+ * slaves sync operations (see curp-sync-replicas) the fsync does not move
+ * the synced watermark, so no opNum is passed. */
 void aof_background_fsync(int fd) {
-    bioCreateBackgroundJob(BIO_AOF_FSYNC,(void*)(long)fd,NULL,server.currentOpNum);
+    bioCreateBackgroundJob(BIO_AOF_FSYNC,(void*)(long)fd,NULL,
+                           curpSyncByReplicas() ? 0 : server.currentOpNum);
+}
+
+/* ----------------------------------------------------------------------------
+ * Group commit
+ *
+ * Everything that must wait for data to be on disk, a client that read an
+ * unsynced key or a witness GC batch, asks for an fsync up to an opNum with
+ * aofRequestFsync(). The requests are coalesced: at most one BIO_FSYNC_OPNUM
+ * job is queued at a time, and everything asked for while it runs is served
+ * by the next one, which covers all the AOF written by then.
+ *
+ * The bio thread advances aof_last_fsync_opNum and writes a byte to a pipe
+ * watched by the event loop, so aofFsyncDoneHandler() runs as soon as the
+ * watermark moves and releases every waiter it covers in one batch.
+ * ------------------------------------------------------------------------- */
+
+static int fsyncNotifyPipe[2] = {-1, -1};
+static long long fsyncWantedOpNum = 0;   /* Highest opNum a waiter asked for. */
+static long long fsyncInflightOpNum = 0; /* Target of the queued job, or 0. */
+
+/* Move aof_last_fsync_opNum forward to opNum, never backward: the
+ * everysec fsync and the group commit fsync can finish in any order.
+ * Called by the bio thread, and by the main thread for 'always' and when
+ * slaves acknowledge operations. With curp-sync-replicas only the slave
+ * acknowledgements move it: a local fsync says nothing about the replicas. */
+void aofFsyncDone(long long opNum) {
+    long long synced = server.aof_last_fsync_opNum;
+    while (opNum > synced &&
+           !atomic_compare_exchange_weak(&server.aof_last_fsync_opNum,
+                                         &synced, opNum));
+    if (fsyncNotifyPipe[1] != -1 && write(fsyncNotifyPipe[1],"!",1) != 1) {
+        /* The pipe is full, so the event loop is woken up anyway. */
+    }
+}
+
+/* Queue the next fsync if somebody waits for data that is written to the
+ * AOF already and no fsync is in flight. */
+static void aofStartFsyncIfNeeded(void) {
+    if (server.aof_fd == -1 || fsyncInflightOpNum != 0 ||
+        curpSyncByReplicas()) return;
+    if (fsyncWantedOpNum <= server.aof_last_fsync_opNum ||
+        server.aof_written_opNum <= server.aof_last_fsync_opNum) return;
+    fsyncInflightOpNum = server.aof_written_opNum;
+    bioCreateBackgroundJob(BIO_FSYNC_OPNUM,NULL,(void*)(long)server.aof_fd,
+                           fsyncInflightOpNum);
+    server.stat_group_fsyncs++;
+}
+
+/* Ask for everything up to opNum to be fsynced. What is still in the AOF
+ * buffer is covered once flushAppendOnlyFile() writes it. When the slaves
+ * sync operations instead, ask them for an ACK. With neither the AOF nor
+ * the slaves nothing is more durable than memory, so everything executed
+ * is synced already: this is what lets witness GCs go out in that case. */
+void aofRequestFsync(long long opNum) {
+    if (opNum > fsyncWantedOpNum) fsyncWantedOpNum = opNum;
+    if (curpSyncByReplicas()) {
+        if (opNum > server.aof_last_fsync_opNum)
+            replicationRequestAckFromSlaves();
+        return;
+    }
+    if (server.aof_state == AOF_OFF) {
+        aofFsyncDone(server.currentOpNum);
+        return;
+    }
+    aofStartFsyncIfNeeded();
+}
+
+/* Called when what moves the synced watermark changes at runtime: the
+ * clients already waiting must not wait for an fsync or an ACK that will
+ * never come, so ask again with the new mode. */
+void aofSyncModeChanged(void) {
+    aofRequestFsync(fsyncWantedOpNum);
+}
+
+static void aofFsyncDoneHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    char buf[64];
+    UNUSED(el);
+    UNUSED(privdata);
+    UNUSED(mask);
+
+    while (read(fd,buf,sizeof(buf)) > 0);
+    if (server.aof_last_fsync_opNum >= fsyncInflightOpNum)
+        fsyncInflightOpNum = 0;
+    pruneUnsyncedKeys();
+    if (listLength(server.clients_waiting_fsync))
+        processClientsWaitingFsync();
+    if (server.numWitness > 0) witnessClientSendDueGcs();
+    aofStartFsyncIfNeeded();
+}
+
+/* Create the pipe the bio thread uses to wake us up. Called by initServer(). */
+void aofInitGroupCommit(void) {
+    if (pipe(fsyncNotifyPipe) == -1 ||
+        anetNonBlock(NULL,fsyncNotifyPipe[0]) != ANET_OK ||
+        anetNonBlock(NULL,fsyncNotifyPipe[1]) != ANET_OK ||
+        aeCreateFileEvent(server.el,fsyncNotifyPipe[0],AE_READABLE,
+                          aofFsyncDoneHandler,NULL) == AE_ERR)
+    {
+        serverLog(LL_WARNING,"Can't create the AOF fsync notification pipe: %s",
+            strerror(errno));
+        exit(1);
+    }
+}
+
+/* ----------------------------------------------------------------------------
+ * Clients waiting for an fsync
+ *
+ * A command that reads data modified by an operation the AOF didn't fsync
+ * yet must not reply before that fsync: the client could otherwise observe
+ * a state the server can lose in a crash. Instead of fsyncing in the main
+ * thread, which stalls every client, processCommand() parks just that
+ * client in BLOCKED_FSYNC. Its reply stays in the output buffer, and it
+ * doesn't process further commands, until aof_last_fsync_opNum reaches
+ * c->bpop.fsyncopnum.
+ * ------------------------------------------------------------------------- */
+
+void blockClientForFsync(client *c, long long opNum) {
+    c->bpop.timeout = 0;
+    c->bpop.fsyncopnum = opNum;
+    blockClient(c,BLOCKED_FSYNC);
+    listAddNodeTail(server.clients_waiting_fsync,c);
+    server.stat_fsync_waits++;
+    aofRequestFsync(opNum);
+}
+
+/* Called by unblockClient(). The held output is queued for writing. */
+void unblockClientWaitingFsync(client *c) {
+    listNode *ln = listSearchKey(server.clients_waiting_fsync,c);
+    serverAssert(ln != NULL);
+    listDelNode(server.clients_waiting_fsync,ln);
+    if (!(c->flags & CLIENT_PENDING_WRITE) && clientHasPendingReplies(c)) {
+        c->flags |= CLIENT_PENDING_WRITE;
+        listAddNodeHead(server.clients_pending_write,c);
+    }
+}
+
+/* Unblock the clients whose data is on disk now. */
+void processClientsWaitingFsync(void) {
+    long long synced = server.aof_last_fsync_opNum;
+    listIter li;
+    listNode *ln;
+
+    listRewind(server.clients_waiting_fsync,&li);
+    while((ln = listNext(&li))) {
+        client *c = ln->value;
+        if (c->bpop.fsyncopnum <= synced) unblockClient(c);
+    }
 }
 
 /* Called when the user switches from "appendonly yes" to "appendonly no"
@@ -214,6 +365,8 @@ void stopAppendOnly(void) {
     server.aof_fd = -1;
     server.aof_selected_db = -1;
     server.aof_state = AOF_OFF;
+    pruneUnsyncedKeys();
+    aofSyncModeChanged();
     /* rewrite operation in progress? kill it, wait child exit */
     if (server.aof_child_pid != -1) {
         int statloc;
@@ -290,7 +443,12 @@ void flushAppendOnlyFile(int force) {
     int sync_in_progress = 0;
     mstime_t latency;
 
-    if (sdslen(server.aof_buf) == 0) return;
+    if (sdslen(server.aof_buf) == 0) {
+        /* Every operation so far is in the file. */
+        server.aof_written_opNum = server.currentOpNum;
+        aofStartFsyncIfNeeded();
+        return;
+    }
 
     if (server.aof_fsync == AOF_FSYNC_EVERYSEC)
         sync_in_progress = bioPendingJobsOfType(BIO_AOF_FSYNC) != 0;
@@ -415,6 +573,7 @@ void flushAppendOnlyFile(int force) {
         }
     }
     server.aof_current_size += nwritten;
+    server.aof_written_opNum = server.currentOpNum;
 
     /* Re-use AOF buffer when it is small enough. The maximum comes from the
      * arena size of 4k minus some overhead (but is otherwise arbitrary). */
@@ -425,6 +584,9 @@ void flushAppendOnlyFile(int force) {
         server.aof_buf = sdsempty();
     }
 
+    /* Serve the waiters of the group commit with what we just wrote. */
+    if (server.aof_fsync != AOF_FSYNC_ALWAYS) aofStartFsyncIfNeeded();
+
     /* Don't fsync if no-appendfsync-on-rewrite is set to yes and there are
      * children doing I/O in the background. */
     if (server.aof_no_fsync_on_rewrite &&
@@ -432,12 +594,12 @@ void flushAppendOnlyFile(int force) {
             return;
 
     /* Perform the fsync if needed. */
-    if (server.aof_fsync == AOF_FSYNC_ALWAYS || server.must_aof_fsync) {
+    if (server.aof_fsync == AOF_FSYNC_ALWAYS) {
         /* aof_fsync is defined as fdatasync() for Linux in order to avoid
          * flushing metadata. */
         latencyStartMonitor(latency);
         aof_fsync(server.aof_fd); /* Let's try to get this data on the disk */
-        server.aof_last_fsync_opNum = server.currentOpNum;
+        if (!curpSyncByReplicas()) aofFsyncDone(server.currentOpNum);
         latencyEndMonitor(latency);
         latencyAddSampleIfNeeded("aof-fsync-always",latency);
         server.aof_last_fsync = server.unixtime;
@@ -446,7 +608,6 @@ void flushAppendOnlyFile(int force) {
         if (!sync_in_progress) aof_background_fsync(server.aof_fd);
         server.aof_last_fsync = server.unixtime;
     }
-    server.must_aof_fsync = false;
 }
 
 sds catAppendOnlyGenericCommand(sds dst, int argc, robj **argv) {
@@ -588,6 +749,11 @@ struct client *createFakeClient(void) {
     c->obuf_soft_limit_reached_time = 0;
     c->watched_keys = listCreate();
     c->peerid = NULL;
+    c->isRecovery = false;
+    c->replayDone = false;
+    c->riflEnabled = false;
+    c->clientId = 0;
+    c->requestId = 0;
     listSetFreeMethod(c->reply,decrRefCountVoid);
     listSetDupMethod(c->reply,dupClientReplyValue);
     initClientMultiState(c);
@@ -698,17 +864,6 @@ int loadAppendOnlyFile(char *filename) {
             exit(1);
         }
 
-        // TODO(seojin): RIFL here?
-        if (cmd->flags & CMD_AT_MOST_ONCE) {
-            long long clientId, requestId;
-            getLongLongFromObjectInBase64(argv[argc-2], &clientId);
-            getLongLongFromObjectInBase64(argv[argc-1], &requestId);
-
-            fakeClient->clientId = clientId;
-            riflCheckClientIdOk(fakeClient);
-            riflCheckDuplicate(clientId, requestId);
-        }
-
         /* Run the command in the context of a fake client */
         cmd->proc(fakeClient);
 
@@ -1083,13 +1238,11 @@ int rewriteAppendOnlyFile(char *filename) {
             /* Save the key and associated value */
             if (o->type == OBJ_STRING) {
                 /* Emit a SET command */
-                char cmd[]="*5\r\n$3\r\nSET\r\n";
+                char cmd[]="*3\r\n$3\r\nSET\r\n";
                 if (rioWrite(&aof,cmd,sizeof(cmd)-1) == 0) goto werr;
                 /* Key and value */
                 if (rioWriteBulkObject(&aof,&key) == 0) goto werr;
                 if (rioWriteBulkObject(&aof,o) == 0) goto werr;
-                char rifl[]="$1\r\n0\r\n$1\r\n0\r\n"; // fill dummy now.
-                if (rioWrite(&aof,rifl,sizeof(rifl)-1) == 0) goto werr;
             } else if (o->type == OBJ_LIST) {
                 if (rewriteListObject(&aof,&key,o) == 0) goto werr;
             } else if (o->type == OBJ_SET) {
@@ -1118,17 +1271,19 @@ int rewriteAppendOnlyFile(char *filename) {
         di = NULL;
     }
 
-    /* Now, sweep RIFL table and write SET log accordingly. */
-    // TODO(seojin): Make new command. RIFLCR clientId rpcId
-    long long clientId;
-    for (clientId = riflGetNext(-1); clientId != -1; clientId = riflGetNext(clientId)) {
-        long long requestId = riflGetprocessedRpcId(clientId);
-        /* Emit a SET command */
-        char cmd[]="*5\r\n$3\r\nSET\r\n$5\r\n_rifl\r\n$1\r\n0\r\n";
+    /* Now, sweep RIFL table and emit a RIFL command for every client. */
+    long long clientId, requestId;
+    riflIterator ri;
+    riflRewind(&ri);
+    while (riflNext(&ri, &clientId, &requestId)) {
+        char cmd[]="*3\r\n$4\r\nRIFL\r\n";
+        char id[24];
+        int len;
         if (rioWrite(&aof,cmd,sizeof(cmd)-1) == 0) goto werr;
-        /* Key and value */
-        if (rioWriteBulkLongLong(&aof, clientId) == 0) goto werr;
-        if (rioWriteBulkLongLong(&aof, requestId) == 0) goto werr;
+        len = ulltoa64(id,sizeof(id),clientId);
+        if (rioWriteBulkString(&aof,id,len) == 0) goto werr;
+        len = ulltoa64(id,sizeof(id),requestId);
+        if (rioWriteBulkString(&aof,id,len) == 0) goto werr;
     }
 
 
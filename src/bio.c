@@ -60,6 +60,7 @@
 
 #include "server.h"
 #include "bio.h"
+#include "timeTrace.h"
 
 static pthread_t bio_threads[BIO_NUM_OPS];
 static pthread_mutex_t bio_mutex[BIO_NUM_OPS];
@@ -184,19 +185,18 @@ void *bioProcessBackgroundJobs(void *arg) {
             close((long)job->arg1);
         } else if (type == BIO_AOF_FSYNC) {
             aof_fsync((long)job->arg1);
-            server.aof_last_fsync_opNum = job->arg3;
-        } else if (type == BIO_FSYNC_AND_GC_WITNESS) {
-            sds gcCmd = (sds)job->arg1;
+            if (job->arg3) aofFsyncDone(job->arg3);
+        } else if (type == BIO_FSYNC_OPNUM) {
+            /* Group commit: see aofRequestFsync(). aofFsyncDone() wakes up
+             * the main thread, which releases the waiters. */
             long long lastOpNum = job->arg3;
             if (lastOpNum > server.aof_last_fsync_opNum) {
+                record("bio fsync started.", 0, 0, 0, 0);
+                debugCrashPoint(CRASH_POINT_FSYNC);
                 aof_fsync((long)job->arg2);
-                server.aof_last_fsync_opNum = lastOpNum;
-            }
-            for (int i = 0; i < server.numWitness; ++i) {
-                if (anetWrite(server.fdToWitness[i], gcCmd, sdslen(gcCmd)) == -1) {
-                    fprintf(stderr, "Error while sending witness GC. %s", strerror(errno));
-                }
+                record("bio fsync done.", 0, 0, 0, 0);
             }
+            aofFsyncDone(lastOpNum);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
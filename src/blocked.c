@@ -136,6 +136,8 @@ void unblockClient(client *c) {
         unblockClientWaitingData(c);
     } else if (c->btype == BLOCKED_WAIT) {
         unblockClientWaitingReplicas(c);
+    } else if (c->btype == BLOCKED_FSYNC) {
+        unblockClientWaitingFsync(c);
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
@@ -179,7 +181,9 @@ void disconnectAllBlockedClients(void) {
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
 
-        if (c->flags & CLIENT_BLOCKED) {
+        /* Clients waiting for an fsync have their reply already, and get
+         * it once the fsync is done regardless of our role. */
+        if (c->flags & CLIENT_BLOCKED && c->btype != BLOCKED_FSYNC) {
             addReplySds(c,sdsnew(
                 "-UNBLOCKED force unblock from blocking operation, "
                 "instance state changed (master -> slave?)\r\n"));
@@ -205,6 +205,11 @@ void loadServerConfigFromString(char *config) {
             if (server.port < 0 || server.port > 65535) {
                 err = "Invalid port"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"recovery-port") && argc == 2) {
+            server.portForRecovery = atoi(argv[1]);
+            if (server.portForRecovery < 0 || server.portForRecovery > 65535) {
+                err = "Invalid port"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"tcp-backlog") && argc == 2) {
             server.tcp_backlog = atoi(argv[1]);
             if (server.tcp_backlog < 0) {
@@ -237,6 +242,72 @@ void loadServerConfigFromString(char *config) {
                 server.addrToWitness[j] = zstrdup(argv[j+1]);
             server.numWitness = addresses;
             serverLog(LL_NOTICE,"%d Witness servers are found.", addresses);
+        } else if (!strcasecmp(argv[0],"witness-master-id") && argc == 2) {
+            server.witness_master_id = strtoll(argv[1], NULL, 10);
+            if (server.witness_master_id < 0) {
+                err = "Invalid witness-master-id"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"witness-table-entries") && argc == 2) {
+            server.witness_table_entries = strtoll(argv[1], NULL, 10);
+            if (server.witness_table_entries < 1 ||
+                server.witness_table_entries > CONFIG_WITNESS_MAX_TABLE_ENTRIES ||
+                (server.witness_table_entries &
+                 (server.witness_table_entries - 1)) != 0)
+            {
+                err = "witness-table-entries must be a power of two"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"witness-associativity") && argc == 2) {
+            server.witness_associativity = strtoll(argv[1], NULL, 10);
+            if (server.witness_associativity < 1 ||
+                server.witness_associativity > CONFIG_WITNESS_MAX_ASSOCIATIVITY)
+            {
+                err = "Invalid witness-associativity"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"witness-commutativity") && argc == 2) {
+            if ((server.witness_commutativity = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"sync-on-write-conflict") && argc == 2) {
+            if ((server.sync_on_write_conflict = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"curp-sync-replicas") && argc == 2) {
+            server.curp_sync_replicas = atoi(argv[1]);
+            if (server.curp_sync_replicas < 0) {
+                err = "Invalid curp-sync-replicas"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"witness-batch-max-age") && argc == 2) {
+            server.witness_batch_max_age = strtoll(argv[1], NULL, 10);
+            if (server.witness_batch_max_age < 0) {
+                err = "Invalid witness-batch-max-age"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"witness-fsync-rate") && argc == 2) {
+            server.witness_fsync_rate = atoi(argv[1]);
+            if (server.witness_fsync_rate < 0) {
+                err = "Invalid witness-fsync-rate"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"witness-batch-max-occupancy") && argc == 2) {
+            server.witness_batch_max_occupancy = atoi(argv[1]);
+            if (server.witness_batch_max_occupancy < 1 ||
+                server.witness_batch_max_occupancy > 100)
+            {
+                err = "witness-batch-max-occupancy must be between 1 and 100";
+                goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"replay-quorum") && argc == 2) {
+            server.replay_quorum = atoi(argv[1]);
+            if (server.replay_quorum < 0) {
+                err = "Invalid replay-quorum"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"rifl-lease-time") && argc == 2) {
+            server.rifl_lease_time = strtoll(argv[1], NULL, 10);
+            if (server.rifl_lease_time < 0) {
+                err = "Invalid rifl-lease-time"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"witness-binary-protocol") && argc == 2) {
+            if ((server.witness_binary_protocol = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"save")) {
             if (argc == 3) {
                 int seconds = atoi(argv[1]);
@@ -750,6 +821,21 @@ void configSetCommand(client *c) {
     } config_set_special_field("masterauth") {
         zfree(server.masterauth);
         server.masterauth = ((char*)o->ptr)[0] ? zstrdup(o->ptr) : NULL;
+    } config_set_special_field("witness-table-entries") {
+        if (getLongLongFromObject(o,&ll) == C_ERR || ll < 1 ||
+            ll > CONFIG_WITNESS_MAX_TABLE_ENTRIES || (ll & (ll-1)) != 0)
+            goto badfmt;
+        if (witnessResizeTables(ll,server.witness_associativity) == C_ERR) {
+            addReplyError(c,"Recorded requests don't fit the new witness geometry");
+            return;
+        }
+    } config_set_special_field("witness-associativity") {
+        if (getLongLongFromObject(o,&ll) == C_ERR || ll < 1 ||
+            ll > CONFIG_WITNESS_MAX_ASSOCIATIVITY) goto badfmt;
+        if (witnessResizeTables(server.witness_table_entries,ll) == C_ERR) {
+            addReplyError(c,"Recorded requests don't fit the new witness geometry");
+            return;
+        }
     } config_set_special_field("maxclients") {
         int orig_value = server.maxclients;
 
@@ -897,6 +983,12 @@ void configSetCommand(client *c) {
       "aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync) {
     } config_set_bool_field(
       "aof-load-truncated",server.aof_load_truncated) {
+    } config_set_bool_field(
+      "witness-binary-protocol",server.witness_binary_protocol) {
+    } config_set_bool_field(
+      "witness-commutativity",server.witness_commutativity) {
+    } config_set_bool_field(
+      "sync-on-write-conflict",server.sync_on_write_conflict) {
     } config_set_bool_field(
       "slave-serve-stale-data",server.repl_serve_stale_data) {
     } config_set_bool_field(
@@ -948,6 +1040,21 @@ void configSetCommand(client *c) {
         server.slowlog_max_len = (unsigned)ll;
     } config_set_numerical_field(
       "latency-monitor-threshold",server.latency_monitor_threshold,0,LLONG_MAX){
+    } config_set_numerical_field(
+      "witness-batch-max-age",server.witness_batch_max_age,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "witness-fsync-rate",server.witness_fsync_rate,0,INT_MAX) {
+    } config_set_numerical_field(
+      "curp-sync-replicas",server.curp_sync_replicas,0,INT_MAX) {
+        replicationCurpAcksUpdated();
+        pruneUnsyncedKeys();
+        aofSyncModeChanged();
+    } config_set_numerical_field(
+      "replay-quorum",server.replay_quorum,0,INT_MAX) {
+    } config_set_numerical_field(
+      "rifl-lease-time",server.rifl_lease_time,0,LLONG_MAX) {
+    } config_set_numerical_field(
+      "witness-batch-max-occupancy",server.witness_batch_max_occupancy,1,100) {
     } config_set_numerical_field(
       "repl-ping-slave-period",server.repl_ping_slave_period,1,LLONG_MAX) {
     } config_set_numerical_field(
@@ -1109,6 +1216,7 @@ void configGetCommand(client *c) {
     config_get_numerical_field("slowlog-max-len",
             server.slowlog_max_len);
     config_get_numerical_field("port",server.port);
+    config_get_numerical_field("recovery-port",server.portForRecovery);
     config_get_numerical_field("tcp-backlog",server.tcp_backlog);
     config_get_numerical_field("databases",server.dbnum);
     config_get_numerical_field("repl-ping-slave-period",server.repl_ping_slave_period);
@@ -1127,6 +1235,15 @@ void configGetCommand(client *c) {
     config_get_numerical_field("cluster-slave-validity-factor",server.cluster_slave_validity_factor);
     config_get_numerical_field("repl-diskless-sync-delay",server.repl_diskless_sync_delay);
     config_get_numerical_field("tcp-keepalive",server.tcpkeepalive);
+    config_get_numerical_field("witness-master-id",server.witness_master_id);
+    config_get_numerical_field("witness-table-entries",server.witness_table_entries);
+    config_get_numerical_field("witness-associativity",server.witness_associativity);
+    config_get_numerical_field("witness-batch-max-age",server.witness_batch_max_age);
+    config_get_numerical_field("witness-fsync-rate",server.witness_fsync_rate);
+    config_get_numerical_field("curp-sync-replicas",server.curp_sync_replicas);
+    config_get_numerical_field("replay-quorum",server.replay_quorum);
+    config_get_numerical_field("rifl-lease-time",server.rifl_lease_time);
+    config_get_numerical_field("witness-batch-max-occupancy",server.witness_batch_max_occupancy);
 
     /* Bool (yes/no) values */
     config_get_bool_field("cluster-require-full-coverage",
@@ -1152,6 +1269,12 @@ void configGetCommand(client *c) {
             server.aof_rewrite_incremental_fsync);
     config_get_bool_field("aof-load-truncated",
             server.aof_load_truncated);
+    config_get_bool_field("witness-binary-protocol",
+            server.witness_binary_protocol);
+    config_get_bool_field("witness-commutativity",
+            server.witness_commutativity);
+    config_get_bool_field("sync-on-write-conflict",
+            server.sync_on_write_conflict);
 
     /* Enum values */
     config_get_enum_field("maxmemory-policy",
@@ -1791,6 +1914,7 @@ int rewriteConfig(char *path) {
     rewriteConfigYesNoOption(state,"daemonize",server.daemonize,0);
     rewriteConfigStringOption(state,"pidfile",server.pidfile,CONFIG_DEFAULT_PID_FILE);
     rewriteConfigNumericalOption(state,"port",server.port,CONFIG_DEFAULT_SERVER_PORT);
+    rewriteConfigNumericalOption(state,"recovery-port",server.portForRecovery,CONFIG_DEFAULT_RECOVERY_PORT);
     rewriteConfigNumericalOption(state,"tcp-backlog",server.tcp_backlog,CONFIG_DEFAULT_TCP_BACKLOG);
     rewriteConfigBindOption(state);
     rewriteConfigStringOption(state,"unixsocket",server.unixsocket,NULL);
@@ -1827,6 +1951,17 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"min-slaves-max-lag",server.repl_min_slaves_max_lag,CONFIG_DEFAULT_MIN_SLAVES_MAX_LAG);
     rewriteConfigStringOption(state,"requirepass",server.requirepass,NULL);
     rewriteConfigNumericalOption(state,"maxclients",server.maxclients,CONFIG_DEFAULT_MAX_CLIENTS);
+    rewriteConfigNumericalOption(state,"witness-master-id",server.witness_master_id,CONFIG_DEFAULT_WITNESS_MASTER_ID);
+    rewriteConfigNumericalOption(state,"witness-table-entries",server.witness_table_entries,CONFIG_DEFAULT_WITNESS_TABLE_ENTRIES);
+    rewriteConfigNumericalOption(state,"witness-associativity",server.witness_associativity,CONFIG_DEFAULT_WITNESS_ASSOCIATIVITY);
+    rewriteConfigYesNoOption(state,"witness-commutativity",server.witness_commutativity,CONFIG_DEFAULT_WITNESS_COMMUTATIVITY);
+    rewriteConfigYesNoOption(state,"sync-on-write-conflict",server.sync_on_write_conflict,CONFIG_DEFAULT_SYNC_ON_WRITE_CONFLICT);
+    rewriteConfigNumericalOption(state,"witness-batch-max-age",server.witness_batch_max_age,CONFIG_DEFAULT_WITNESS_BATCH_MAX_AGE);
+    rewriteConfigNumericalOption(state,"witness-fsync-rate",server.witness_fsync_rate,CONFIG_DEFAULT_WITNESS_FSYNC_RATE);
+    rewriteConfigNumericalOption(state,"curp-sync-replicas",server.curp_sync_replicas,CONFIG_DEFAULT_CURP_SYNC_REPLICAS);
+    rewriteConfigNumericalOption(state,"replay-quorum",server.replay_quorum,CONFIG_DEFAULT_REPLAY_QUORUM);
+    rewriteConfigNumericalOption(state,"rifl-lease-time",server.rifl_lease_time,CONFIG_DEFAULT_RIFL_LEASE_TIME);
+    rewriteConfigNumericalOption(state,"witness-batch-max-occupancy",server.witness_batch_max_occupancy,CONFIG_DEFAULT_WITNESS_BATCH_MAX_OCCUPANCY);
     rewriteConfigBytesOption(state,"maxmemory",server.maxmemory,CONFIG_DEFAULT_MAXMEMORY);
     rewriteConfigEnumOption(state,"maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum,CONFIG_DEFAULT_MAXMEMORY_POLICY);
     rewriteConfigNumericalOption(state,"maxmemory-samples",server.maxmemory_samples,CONFIG_DEFAULT_MAXMEMORY_SAMPLES);
@@ -1861,6 +1996,7 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"hz",server.hz,CONFIG_DEFAULT_HZ);
     rewriteConfigYesNoOption(state,"aof-rewrite-incremental-fsync",server.aof_rewrite_incremental_fsync,CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC);
     rewriteConfigYesNoOption(state,"aof-load-truncated",server.aof_load_truncated,CONFIG_DEFAULT_AOF_LOAD_TRUNCATED);
+    rewriteConfigYesNoOption(state,"witness-binary-protocol",server.witness_binary_protocol,CONFIG_DEFAULT_WITNESS_BINARY_PROTOCOL);
     rewriteConfigEnumOption(state,"supervised",server.supervised_mode,supervised_mode_enum,SUPERVISED_NONE);
 
     /* Rewrite Sentinel config if in Sentinel mode. */
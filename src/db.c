@@ -30,6 +30,7 @@
 #include "server.h"
 #include "cluster.h"
 #include "witnessTracker.h"
+#include "MurmurHash3.h"
 
 #include <signal.h>
 #include <ctype.h>
@@ -47,6 +48,16 @@ void slotToKeyFlush(void);
  * lookupKeyWrite() and lookupKeyReadWithFlags(). */
 robj *lookupKey(redisDb *db, robj *key, int flags) {
     dictEntry *de = dictFind(db->dict,key->ptr);
+
+    /* Remember we are reading non-durable data: processCommand() holds
+     * the reply of the client until the AOF is fsynced past it. A missing
+     * key may have been deleted by an unsynced operation, so it counts as
+     * well. Writes are checked by checkUnsyncedWriteConflict() instead. */
+    if (!(flags & LOOKUP_NOTOUCH) &&
+        !(server.current_client && server.current_client->cmd &&
+          server.current_client->cmd->flags & CMD_WRITE))
+        trackUnsyncedRead(db,key);
+
     if (de) {
         robj *val = dictGetVal(de);
 
@@ -59,19 +70,6 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
         {
             val->lru = LRU_CLOCK();
         }
-        // TODO(seojin): verify every path needs this...
-        if (!(flags & LOOKUP_NOTOUCH) && de->lastModOpNum > server.aof_last_fsync_opNum) {
-            server.must_aof_fsync = true;
-//            serverLog(LL_NOTICE, "Redis read is reading non-durable data. "
-//                    "It is blocked by fsync. ModifiedBy: %lld, Synced: %lld, CurrentOp: %lld",
-//                    de->lastModOpNum, server.aof_last_fsync_opNum, server.currentOpNum);
-//            flushAppendOnlyFile(1);
-//            aof_fsync(server.aof_fd);
-//            server.aof_last_fsync_opNum = server.currentOpNum - 1;
-            //scheduleFsyncAndWitnessGc();
-            // TODO(seojin): move these into after handling all clients.
-            // so that we only fsync once per loop.
-        }
         return val;
     } else {
         return NULL;
@@ -318,10 +316,223 @@ int selectDb(client *c, int id) {
 
 void signalModifiedKey(redisDb *db, robj *key) {
     touchWatchedKey(db,key);
+    trackUnsyncedKey(db,key);
 }
 
 void signalFlushedDb(int dbid) {
     touchWatchedKeysOnFlush(dbid);
+    trackUnsyncedFlush(dbid);
+}
+
+/*-----------------------------------------------------------------------------
+ * Unsynced keys
+ *
+ * Keys modified by operations the AOF didn't fsync yet, with the opNum of
+ * their last modification: reading them must wait for the fsync (see
+ * lookupKey()), and so must writing them (checkUnsyncedWriteConflict()).
+ *
+ * They live in small per DB dicts instead of the keyspace entries, in two
+ * generations. Modifications go to the current generation. Once the fsync
+ * watermark passes the newest opNum of the other one, that one is emptied
+ * and becomes the current generation. So a key is forgotten at most two
+ * fsyncs after its last modification, and the dicts only hold what was
+ * modified in between. Deleted keys are tracked like any other, and a
+ * FLUSHDB or FLUSHALL covers all the keys of a DB.
+ *
+ * Each key also remembers the witness operation class of its unsynced
+ * modifications, so that a write that commutes with all of them, and that
+ * the witnesses accepted next to their records, is not a conflict.
+ *----------------------------------------------------------------------------*/
+
+typedef struct unsyncedKey {
+    long long opNum;        /* Last unsynced modification. */
+    uint64_t fieldMask;     /* Union of the hash fields they wrote. */
+    uint8_t opClass;        /* WITNESS_OP_* they all share, or OTHER. */
+} unsyncedKey;
+
+static int unsyncedGen = 0;                   /* Current generation. */
+static long long unsyncedGenMaxOpNum[2] = {0, 0};
+
+/* Fill 'uk' with what is unsynced about 'key', merging both generations
+ * and the last flush of the DB. Returns 0 if everything is synced. */
+static int lookupUnsyncedKey(redisDb *db, robj *key, unsyncedKey *uk) {
+    long long synced = server.aof_last_fsync_opNum;
+    int j;
+
+    uk->opNum = 0;
+    uk->fieldMask = 0;
+    uk->opClass = WITNESS_OP_OTHER;
+    if (server.currentOpNum <= synced) return 0;
+    if (db->unsynced_flush_opNum > synced) uk->opNum = db->unsynced_flush_opNum;
+    for (j = 0; j < 2; j++) {
+        dictEntry *de;
+        unsyncedKey *cur;
+
+        if (dictSize(db->unsynced_keys[j]) == 0) continue;
+        de = dictFind(db->unsynced_keys[j],key->ptr);
+        if (de == NULL) continue;
+        cur = dictGetVal(de);
+        if (cur->opNum <= synced) continue;
+        if (uk->opNum == 0) {
+            *uk = *cur;
+        } else {
+            if (cur->opClass != uk->opClass) uk->opClass = WITNESS_OP_OTHER;
+            uk->fieldMask |= cur->fieldMask;
+            if (cur->opNum > uk->opNum) uk->opNum = cur->opNum;
+        }
+    }
+    return uk->opNum != 0;
+}
+
+/* Witness operation class of the current command for 'key'. Writes we
+ * can't attribute to a client command (expires, evictions, scripts) are
+ * WITNESS_OP_OTHER. */
+static void unsyncedKeyCommandClass(client *c, redisDb *db, robj *key,
+                                    uint8_t *opClass, uint64_t *fieldMask) {
+    uint32_t keyHash;
+
+    *opClass = WITNESS_OP_OTHER;
+    *fieldMask = 0;
+    if (!server.witness_commutativity || c == NULL || c->cmd == NULL ||
+        c->db != db) return;
+    MurmurHash3_x86_32(key->ptr,sdslen(key->ptr),db->id,&keyHash);
+    witnessClassifyCommand(c->argv,c->argc,keyHash,opClass,fieldMask);
+}
+
+void trackUnsyncedKey(redisDb *db, robj *key) {
+    dict *d = db->unsynced_keys[unsyncedGen];
+    dictEntry *de;
+    unsyncedKey prev, *uk;
+    uint8_t opClass;
+    uint64_t fieldMask;
+
+    /* Nothing would move the watermark and empty the dicts. */
+    if ((server.aof_state == AOF_OFF && !curpSyncByReplicas()) ||
+        server.currentOpNum <= server.aof_last_fsync_opNum) return;
+
+    /* The witnesses may still hold the records of every unsynced
+     * modification of the key, so the class covers all of them. */
+    unsyncedKeyCommandClass(server.current_client,db,key,&opClass,&fieldMask);
+    if (lookupUnsyncedKey(db,key,&prev) && opClass != WITNESS_OP_OTHER) {
+        if (!witnessOpsCommute(prev.opClass,prev.fieldMask,opClass,fieldMask))
+            opClass = WITNESS_OP_OTHER;
+        else if (prev.opClass != opClass)
+            opClass = WITNESS_OP_HASH_WRITE; /* Mixed hash updates. */
+        fieldMask |= prev.fieldMask;
+    }
+
+    de = dictFind(d,key->ptr);
+    if (de == NULL) {
+        de = dictAddRaw(d,sdsdup(key->ptr));
+        dictSetVal(d,de,zmalloc(sizeof(unsyncedKey)));
+    }
+    uk = dictGetVal(de);
+    uk->opNum = server.currentOpNum;
+    uk->opClass = opClass;
+    uk->fieldMask = fieldMask;
+    unsyncedGenMaxOpNum[unsyncedGen] = server.currentOpNum;
+}
+
+void trackUnsyncedFlush(int dbid) {
+    int j;
+
+    if ((server.aof_state == AOF_OFF && !curpSyncByReplicas()) ||
+        server.currentOpNum <= server.aof_last_fsync_opNum) return;
+
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+
+        if (dbid != -1 && dbid != j) continue;
+        db->unsynced_flush_opNum = server.currentOpNum;
+        dictEmpty(db->unsynced_keys[0],NULL);
+        dictEmpty(db->unsynced_keys[1],NULL);
+    }
+    unsyncedGenMaxOpNum[unsyncedGen] = server.currentOpNum;
+}
+
+/* Return the opNum of the last operation that modified the key, or 0 if
+ * it is fsynced already. */
+long long unsyncedKeyOpNum(redisDb *db, robj *key) {
+    unsyncedKey uk;
+
+    lookupUnsyncedKey(db,key,&uk);
+    return uk.opNum;
+}
+
+/* Record that the current command read 'key', so that its reply waits
+ * until the last operation that modified the key is fsynced. */
+void trackUnsyncedRead(redisDb *db, robj *key) {
+    long long opNum = unsyncedKeyOpNum(db,key);
+
+    if (opNum > server.unsynced_read_opNum)
+        server.unsynced_read_opNum = opNum;
+}
+
+/* Flag the current command if it writes a key that an operation not fsynced
+ * yet modified or deleted, unless it commutes with all those operations.
+ * Its record may have been rejected by the witnesses, so the reply must
+ * wait for the fsync. Called by call() before the command runs. */
+void checkUnsyncedWriteConflict(client *c) {
+    int numkeys, j;
+    int *keys;
+
+    /* Don't look for the keys when nothing is tracked. */
+    if (unsyncedGenMaxOpNum[0] == 0 && unsyncedGenMaxOpNum[1] == 0) return;
+
+    keys = getKeysFromCommand(c->cmd,c->argv,c->argc,&numkeys);
+    for (j = 0; j < numkeys; j++) {
+        robj *key = c->argv[keys[j]];
+        unsyncedKey uk;
+        uint8_t opClass;
+        uint64_t fieldMask;
+
+        if (!lookupUnsyncedKey(c->db,key,&uk)) continue;
+        unsyncedKeyCommandClass(c,c->db,key,&opClass,&fieldMask);
+        if (opClass == WITNESS_OP_OTHER ||
+            !witnessOpsCommute(uk.opClass,uk.fieldMask,opClass,fieldMask)) {
+            server.unsynced_write_conflict = 1;
+            break;
+        }
+    }
+    getKeysFreeResult(keys);
+}
+
+static void emptyUnsyncedGeneration(int gen) {
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        if (dictSize(server.db[j].unsynced_keys[gen]))
+            dictEmpty(server.db[j].unsynced_keys[gen],NULL);
+    }
+    unsyncedGenMaxOpNum[gen] = 0;
+}
+
+/* Forget what is synced. Called each time the fsync watermark moves, and
+ * when the AOF is turned off. */
+void pruneUnsyncedKeys(void) {
+    long long synced = server.aof_last_fsync_opNum;
+    int other = !unsyncedGen;
+
+    if ((server.aof_state == AOF_OFF && !curpSyncByReplicas()) ||
+        synced >= unsyncedGenMaxOpNum[unsyncedGen]) {
+        emptyUnsyncedGeneration(0);
+        emptyUnsyncedGeneration(1);
+    } else if (synced >= unsyncedGenMaxOpNum[other]) {
+        emptyUnsyncedGeneration(other);
+        unsyncedGen = other;
+    }
+}
+
+/* Number of entries in the dicts, for INFO. A key may be in both. */
+unsigned long unsyncedKeyCount(void) {
+    unsigned long count = 0;
+    int j;
+
+    for (j = 0; j < server.dbnum; j++) {
+        count += dictSize(server.db[j].unsynced_keys[0]) +
+                 dictSize(server.db[j].unsynced_keys[1]);
+    }
+    return count;
 }
 
 /*-----------------------------------------------------------------------------
@@ -379,6 +590,9 @@ void existsCommand(client *c) {
 
     for (j = 1; j < c->argc; j++) {
         expireIfNeeded(c->db,c->argv[j]);
+        /* dbExists() doesn't go through lookupKey(), but an unsynced key
+         * must hold the reply until the fsync as for any other read. */
+        trackUnsyncedRead(c->db,c->argv[j]);
         if (dbExists(c->db,c->argv[j])) count++;
     }
     addReplyLongLong(c,count);
@@ -39,6 +39,7 @@
 #include <ucontext.h>
 #include <fcntl.h>
 #include "bio.h"
+#include "rifl.h"
 #include <unistd.h>
 #include <dlfcn.h>
 #endif /* HAVE_BACKTRACE */
@@ -262,6 +263,31 @@ void inputCatSds(void *result, const char *str) {
 }
 #endif
 
+/* ============================= Crash points ================================
+ * DEBUG CRASH-AT arms a crash point: the server kills itself with SIGKILL
+ * (no AOF flush, no reply written) the Nth time the code reaches it. This is
+ * used by utils/curp-recovery.tcl to crash a master at a given step of the
+ * CURP pipeline:
+ *
+ *  batch: an update was executed and tracked for witness GC, but neither
+ *         replied nor written to the AOF yet.
+ *  gc:    a WGC was sent to a witness, and maybe not to the others.
+ *  fsync: the AOF was written, and the group commit fsync is in progress
+ *         (called from the bio thread).
+ *
+ * Each point is only reached by one thread, so plain counters are enough. */
+
+static char *crashPointNames[CRASH_POINTS] = {"batch", "gc", "fsync"};
+static volatile long long crashPointCountdown[CRASH_POINTS];
+
+void debugCrashPoint(int point) {
+    if (crashPointCountdown[point] == 0 || --crashPointCountdown[point] > 0)
+        return;
+    serverLog(LL_WARNING,"Crash point '%s' reached, killing the server.",
+        crashPointNames[point]);
+    kill(getpid(),SIGKILL);
+}
+
 void debugCommand(client *c) {
     if (c->argc == 1) {
         addReplyError(c,"You must specify a subcommand for DEBUG. Try DEBUG HELP for info.");
@@ -306,6 +332,10 @@ void debugCommand(client *c) {
         blen++; addReplyStatus(c,
         "htstats <dbid> -- Return hash table statistics of the specified Redis database.");
         blen++; addReplyStatus(c,
+        "rifl [log] -- Return the clientId and last requestId of every RIFL client, or log them.");
+        blen++; addReplyStatus(c,
+        "crash-at <batch|gc|fsync> <count> -- SIGKILL the server the <count>th time it reaches the crash point, 0 disarms it.");
+        blen++; addReplyStatus(c,
         "jemalloc info  -- Show internal jemalloc statistics.");
         blen++; addReplyStatus(c,
         "jemalloc purge -- Force jemalloc to release unused memory.");
@@ -339,6 +369,7 @@ void debugCommand(client *c) {
             return;
         }
         emptyDb(NULL);
+        riflEmpty();
         if (rdbLoad(server.rdb_filename) != C_OK) {
             addReplyError(c,"Error trying to load the RDB dump");
             return;
@@ -348,6 +379,7 @@ void debugCommand(client *c) {
     } else if (!strcasecmp(c->argv[1]->ptr,"loadaof")) {
         if (server.aof_state == AOF_ON) flushAppendOnlyFile(1);
         emptyDb(NULL);
+        riflEmpty();
         if (loadAppendOnlyFile(server.aof_filename) != C_OK) {
             addReply(c,shared.err);
             return;
@@ -522,6 +554,26 @@ void debugCommand(client *c) {
         stats = sdscat(stats,buf);
 
         addReplyBulkSds(c,stats);
+    } else if (!strcasecmp(c->argv[1]->ptr,"rifl")) {
+        riflDebugCommand(c);
+    } else if (!strcasecmp(c->argv[1]->ptr,"crash-at") && c->argc == 4) {
+        long long count;
+        int point;
+
+        for (point = 0; point < CRASH_POINTS; point++)
+            if (!strcasecmp(c->argv[2]->ptr,crashPointNames[point])) break;
+        if (point == CRASH_POINTS) {
+            addReplyError(c,"Unknown crash point, try batch, gc or fsync");
+            return;
+        }
+        if (getLongLongFromObjectOrReply(c,c->argv[3],&count,NULL) != C_OK)
+            return;
+        if (count < 0) {
+            addReplyError(c,"The count can't be negative");
+            return;
+        }
+        crashPointCountdown[point] = count;
+        addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"jemalloc") && c->argc == 3) {
 #if defined(USE_JEMALLOC)
         if (!strcasecmp(c->argv[2]->ptr, "info")) {
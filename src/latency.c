@@ -34,6 +34,9 @@
  */
 
 #include "server.h"
+#include "timeTrace.h"
+
+#include <math.h>
 
 /* Dictionary type for latency events. */
 int dictStringKeyCompare(void *privdata, const void *key1, const void *key2) {
@@ -84,11 +87,15 @@ int THPGetAnonHugePagesSize(void) {
 
 /* ---------------------------- Latency API --------------------------------- */
 
+static double nsPerCycle = 0;
+
 /* Latency monitor initialization. We just need to create the dictionary
  * of time series, each time serie is craeted on demand in order to avoid
  * having a fixed list to maintain. */
 void latencyMonitorInit(void) {
     server.latency_events = dictCreate(&latencyTimeSeriesDictType,NULL);
+    /* Calibrate the TSC once here rather than on the first command. */
+    nsPerCycle = toSeconds(1)*1e9;
 }
 
 /* Add the specified sample to the specified time series "event".
@@ -149,6 +156,66 @@ int latencyResetEvent(char *event_to_reset) {
     return resets;
 }
 
+/* ---------------------- Command latency histograms ------------------------ */
+
+static inline int latencyHistogramIndex(uint64_t v) {
+    int msb, sub;
+
+    if (v < LATENCY_HIST_SUB_COUNT) return v;
+    msb = 63-__builtin_clzll(v);
+    sub = (v >> (msb-LATENCY_HIST_SUB_BITS)) & (LATENCY_HIST_SUB_COUNT-1);
+    return (msb-LATENCY_HIST_SUB_BITS+1)*LATENCY_HIST_SUB_COUNT+sub;
+}
+
+/* Return the highest value that falls in the bucket at 'idx'. */
+static uint64_t latencyHistogramBucketMax(int idx) {
+    int msb, sub;
+    uint64_t low;
+
+    if (idx < LATENCY_HIST_SUB_COUNT) return idx;
+    msb = idx/LATENCY_HIST_SUB_COUNT+LATENCY_HIST_SUB_BITS-1;
+    sub = idx%LATENCY_HIST_SUB_COUNT;
+    low = (1ULL << msb) | ((uint64_t)sub << (msb-LATENCY_HIST_SUB_BITS));
+    return low+((1ULL << (msb-LATENCY_HIST_SUB_BITS))-1);
+}
+
+/* Add a sample of 'cycles' TSC cycles to the histogram at '*hp', creating
+ * it on first use: most commands are never called, and a histogram is a
+ * few KB. */
+void latencyHistogramAddCycles(struct latencyHistogram **hp, uint64_t cycles) {
+    struct latencyHistogram *h = *hp;
+    uint64_t ns = (uint64_t)(cycles*nsPerCycle);
+
+    if (h == NULL) h = *hp = zcalloc(sizeof(*h));
+    h->buckets[latencyHistogramIndex(ns)]++;
+    h->count++;
+    if (ns > h->max) h->max = ns;
+}
+
+/* Return the value, in nanoseconds, below which 'p' percent of the samples
+ * fall. Like HdrHistogram we report the top of the bucket, capped to the
+ * max actually observed. */
+uint64_t latencyHistogramPercentile(struct latencyHistogram *h, double p) {
+    uint64_t target, seen = 0;
+    int j;
+
+    if (h == NULL || h->count == 0) return 0;
+    target = (uint64_t)ceil(p/100*h->count);
+    if (target == 0) target = 1;
+    for (j = 0; j < LATENCY_HIST_BUCKETS; j++) {
+        seen += h->buckets[j];
+        if (seen >= target) {
+            uint64_t v = latencyHistogramBucketMax(j);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+void latencyHistogramReset(struct latencyHistogram *h) {
+    if (h) memset(h,0,sizeof(*h));
+}
+
 /* ------------------------ Latency reporting (doctor) ---------------------- */
 
 /* Analyze the samples avaialble for a given event and return a structure
@@ -557,12 +624,43 @@ sds latencyCommandGenSparkeline(char *event, struct latencyTimeSeries *ts) {
     return graph;
 }
 
+/* latencyCommand() helper for the HISTOGRAM subcommand: the number of
+ * calls, the max and main percentiles, then every non empty bucket as
+ * a pair of its highest value and its count. Times are in nanoseconds. */
+void latencyCommandReplyWithHistogram(client *c, struct latencyHistogram *h) {
+    void *replylen;
+    int buckets = 0, j;
+
+    addReplyMultiBulkLen(c,12);
+    addReplyBulkCString(c,"calls");
+    addReplyLongLong(c,h ? h->count : 0);
+    addReplyBulkCString(c,"max");
+    addReplyLongLong(c,h ? h->max : 0);
+    addReplyBulkCString(c,"p50");
+    addReplyLongLong(c,latencyHistogramPercentile(h,50));
+    addReplyBulkCString(c,"p99");
+    addReplyLongLong(c,latencyHistogramPercentile(h,99));
+    addReplyBulkCString(c,"p99.9");
+    addReplyLongLong(c,latencyHistogramPercentile(h,99.9));
+    addReplyBulkCString(c,"buckets");
+    replylen = addDeferredMultiBulkLength(c);
+    for (j = 0; h && j < LATENCY_HIST_BUCKETS; j++) {
+        if (h->buckets[j] == 0) continue;
+        addReplyMultiBulkLen(c,2);
+        addReplyLongLong(c,latencyHistogramBucketMax(j));
+        addReplyLongLong(c,h->buckets[j]);
+        buckets++;
+    }
+    setDeferredMultiBulkLength(c,replylen,buckets);
+}
+
 /* LATENCY command implementations.
  *
  * LATENCY SAMPLES: return time-latency samples for the specified event.
  * LATENCY LATEST: return the latest latency for all the events classes.
  * LATENCY DOCTOR: returns an human readable analysis of instance latency.
  * LATENCY GRAPH: provide an ASCII graph of the latency of the specified event.
+ * LATENCY HISTOGRAM: execution time histogram of a command, or reset it.
  */
 void latencyCommand(client *c) {
     struct latencyTimeSeries *ts;
@@ -598,6 +696,23 @@ void latencyCommand(client *c) {
 
         addReplyBulkCBuffer(c,report,sdslen(report));
         sdsfree(report);
+    } else if (!strcasecmp(c->argv[1]->ptr,"histogram") &&
+               (c->argc == 3 || c->argc == 4))
+    {
+        /* LATENCY HISTOGRAM <command> [RESET] */
+        struct redisCommand *cmd = lookupCommand(c->argv[2]->ptr);
+
+        if (cmd == NULL) {
+            addReplyErrorFormat(c,"Unknown command '%s'",
+                (char*)c->argv[2]->ptr);
+        } else if (c->argc == 3) {
+            latencyCommandReplyWithHistogram(c,cmd->latency_histogram);
+        } else if (!strcasecmp(c->argv[3]->ptr,"reset")) {
+            latencyHistogramReset(cmd->latency_histogram);
+            addReply(c,shared.ok);
+        } else {
+            addReply(c,shared.syntaxerr);
+        }
     } else if (!strcasecmp(c->argv[1]->ptr,"reset") && c->argc >= 2) {
         /* LATENCY RESET */
         if (c->argc == 2) {
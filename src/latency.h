@@ -61,9 +61,27 @@ struct latencyStats {
     time_t period;          /* Number of seconds since first event and now. */
 };
 
+/* Per command execution time histogram, in nanoseconds. Buckets are
+ * logarithmic like in HdrHistogram: every power of two is split into
+ * 2^LATENCY_HIST_SUB_BITS linear sub buckets, so that any value is reported
+ * with a relative error under 1/2^LATENCY_HIST_SUB_BITS (6.25%). Values
+ * smaller than 2^LATENCY_HIST_SUB_BITS get a bucket each. */
+#define LATENCY_HIST_SUB_BITS 4
+#define LATENCY_HIST_SUB_COUNT (1<<LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_BUCKETS ((64-LATENCY_HIST_SUB_BITS+1)*LATENCY_HIST_SUB_COUNT)
+
+struct latencyHistogram {
+    uint64_t count;     /* Number of recorded samples. */
+    uint64_t max;       /* Max recorded sample, exact. */
+    uint64_t buckets[LATENCY_HIST_BUCKETS];
+};
+
 void latencyMonitorInit(void);
 void latencyAddSample(char *event, mstime_t latency);
 int THPIsEnabled(void);
+void latencyHistogramAddCycles(struct latencyHistogram **hp, uint64_t cycles);
+uint64_t latencyHistogramPercentile(struct latencyHistogram *h, double p);
+void latencyHistogramReset(struct latencyHistogram *h);
 
 /* Latency monitoring macros. */
 
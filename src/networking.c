@@ -125,6 +125,11 @@ client *createClient(int fd) {
     c->pubsub_channels = dictCreate(&setDictType,NULL);
     c->pubsub_patterns = listCreate();
     c->peerid = NULL;
+    c->isRecovery = false;
+    c->replayDone = false;
+    c->riflEnabled = false;
+    c->clientId = 0;
+    c->requestId = 0;
     listSetFreeMethod(c->pubsub_patterns,decrRefCountVoid);
     listSetMatchMethod(c->pubsub_patterns,listMatchObjects);
     if (fd != -1) listAddNodeTail(server.clients,c);
@@ -384,30 +389,55 @@ void addReplyString(client *c, const char *s, size_t len) {
         _addReplyStringToList(c,s,len);
 }
 
-void addReplyOkCgar(client *c) {//, long long arg1, long long arg2) {
-    char reply[31]; // "@OK " + two 64-bit ints encoded in 64-base + "\r\n\0".
-    bzero(reply, 31);
-    memcpy(reply, shared.unsyncedOk->ptr, 4);
-    int offset = 4;
-    int appended = ulltoa64(reply + offset, 28 - offset, server.currentOpNum);
-    if (appended == 0) {
-        serverLog(LL_WARNING,"Error encoding currentOpNum (%lld) to ASCII."
-                " Exiting.",server.currentOpNum);
-            exit(1);
-    }
-    offset += appended;
-    reply[offset++] = ' ';
-    appended = ulltoa64(reply + offset, 28 - offset, server.aof_last_fsync_opNum);
-    if (appended == 0) {
-        serverLog(LL_WARNING,"Error encoding currentOpNum (%lld) to ASCII."
-                " Exiting.",server.currentOpNum);
-            exit(1);
+/* Prefix the reply of a command that carried RIFL ids with the CURP
+ * envelope "@<opNum> <syncedOpNum>\r\n", both numbers in base64: the
+ * operation number the command executed as, and the last operation number
+ * the AOF has fsynced. The actual reply, of any type, follows. Once
+ * syncedOpNum reaches opNum the client knows its update is durable, and
+ * can skip waiting for the witnesses or a sync. Returns the number of bytes
+ * queued, to be given to discardReplyTail() if the command blocks. */
+size_t addReplyCurpHeader(client *c, long long opNum) {
+    char reply[2+2*12+2]; /* '@', two base64 64-bit ints, ' ', "\r\n". */
+    size_t len = 0;
+
+    if (prepareClientToWrite(c) != C_OK) return 0;
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return 0;
+
+    reply[len++] = '@';
+    len += ulltoa64(reply + len, sizeof(reply) - len, opNum);
+    reply[len++] = ' ';
+    len += ulltoa64(reply + len, sizeof(reply) - len,
+                    server.aof_last_fsync_opNum);
+    reply[len++] = '\r';
+    reply[len++] = '\n';
+    if (_addReplyToBuffer(c,reply,len) != C_OK)
+        _addReplyStringToList(c,reply,len);
+    return len;
+}
+
+/* Remove the last 'len' bytes of the reply of 'c', which the caller added
+ * itself and nothing followed. Used to take back the CURP envelope of a
+ * command that blocked instead of replying. */
+void discardReplyTail(client *c, size_t len) {
+    if (len == 0) return;
+    if (listLength(c->reply) == 0) {
+        serverAssert(c->bufpos >= (int)len);
+        c->bufpos -= len;
+        return;
     }
-    offset += appended;
-    memcpy(reply + offset, "\r\n", 2);
 
-//    record("Constructed reply string with two longs", 0, 0, 0, 0);
-    addReplyString(c, reply, offset + 2);
+    listNode *ln = listLast(c->reply);
+    robj *tail = listNodeValue(ln);
+    serverAssert(sdsEncodedObject(tail) && sdslen(tail->ptr) >= len);
+    if (sdslen(tail->ptr) == len) {
+        c->reply_bytes -= getStringObjectSdsUsedMemory(tail);
+        listDelNode(c->reply,ln);
+    } else {
+        c->reply_bytes -= sdsZmallocSize(tail->ptr);
+        tail = dupLastObjectIfNeeded(c->reply);
+        sdsIncrLen(tail->ptr,-(int)len);
+        c->reply_bytes += sdsZmallocSize(tail->ptr);
+    }
 }
 
 void addReplyErrorLength(client *c, const char *s, size_t len) {
@@ -651,6 +681,8 @@ static void acceptCommonHandler(int fd, int flags, char *ip, bool isRecovery) {
         return;
     }
     c->isRecovery = isRecovery;
+    /* Replayed requests always carry their RIFL ids. */
+    c->riflEnabled = isRecovery;
 
     if (isRecovery && server.serverState >= SERVER_STATE_NORMAL) {
         // Trial of recovery was too late. Server already served normal requests.
@@ -673,6 +705,7 @@ static void acceptCommonHandler(int fd, int flags, char *ip, bool isRecovery) {
         freeClient(c);
         return;
     }
+    if (isRecovery) server.replay_clients_pending++;
 
     /* If maxclient directive is set and this is one client more... close the
      * connection. Note that we create the client instead to check before
@@ -891,6 +924,14 @@ void unlinkClient(client *c) {
 void freeClient(client *c) {
     listNode *ln;
 
+    /* A recovering client that goes away without REPLAYDONE won't replay
+     * anything else: don't wait for it. */
+    if (c->isRecovery && !c->replayDone &&
+        server.serverState == SERVER_STATE_ACCEPTING_REPLAY) {
+        server.replay_clients_pending--;
+        checkReplayComplete();
+    }
+
     /* If it is our master that's beging disconnected we should make sure
      * to cache the state to try a partial resynchronization later.
      *
@@ -1092,9 +1133,17 @@ int writeToClient(int fd, client *c, int handler_installed) {
 
 /* Write event handler. Just send data to the client. */
 void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    client *c = privdata;
     UNUSED(el);
     UNUSED(mask);
-    writeToClient(fd,privdata,1);
+
+    /* The output of a client waiting for an fsync is held back: it is
+     * queued for writing again once the fsync is done. */
+    if (c->flags & CLIENT_BLOCKED && c->btype == BLOCKED_FSYNC) {
+        aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
+        return;
+    }
+    writeToClient(fd,c,1);
 }
 
 /* This function is called just before entering the event loop, in the hope
@@ -1112,6 +1161,9 @@ int handleClientsWithPendingWrites(void) {
         c->flags &= ~CLIENT_PENDING_WRITE;
         listDelNode(server.clients_pending_write,ln);
 
+        /* Hold the output of clients waiting for an fsync. */
+        if (c->flags & CLIENT_BLOCKED && c->btype == BLOCKED_FSYNC) continue;
+
         /* Try to write buffers to the client socket. */
         if (writeToClient(c->fd,c,0) == C_ERR) continue;
 
@@ -1479,6 +1531,8 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
         return;
     }
 
+    if (c->isRecovery) server.last_client_replay = server.unixtime;
+
     if (!c->isRecovery && server.serverState <= SERVER_STATE_ACCEPTING_REPLAY) {
         serverLog(LL_WARNING,"Non-recovery connection was accepted while recovery. Dying..");
         char *err = "-RETRY server is not ready.\r\n";
@@ -1766,8 +1820,22 @@ void clientCommand(client *c) {
                                         != C_OK) return;
         pauseClients(duration);
         addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"rifl") && c->argc == 3) {
+        /* CLIENT RIFL ON|OFF
+         * In RIFL mode every at most once command must end with the
+         * clientId and requestId of the request, in base64, and its reply
+         * comes in the CURP envelope (see addReplyCurpHeader()). */
+        if (!strcasecmp(c->argv[2]->ptr,"on")) {
+            c->riflEnabled = true;
+        } else if (!strcasecmp(c->argv[2]->ptr,"off")) {
+            c->riflEnabled = false;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+        addReply(c,shared.ok);
     } else {
-        addReplyError(c, "Syntax error, try CLIENT (LIST | KILL | GETNAME | SETNAME | PAUSE | REPLY)");
+        addReplyError(c, "Syntax error, try CLIENT (LIST | KILL | GETNAME | SETNAME | PAUSE | REPLY | RIFL)");
     }
 }
 
@@ -2083,17 +2151,3 @@ int processEventsWhileBlocked(void) {
     }
     return count;
 }
-
-void connectToWitness() {
-    for (int i = 0; i < server.numWitness; ++i) {
-        if (server.fdToWitness[i] > 0) {
-            continue;
-        }
-        char err[ANET_ERR_LEN];
-        server.fdToWitness[i] = anetTcpConnect(err, server.addrToWitness[i], server.port);
-        if (server.fdToWitness[i] == ANET_ERR) {
-            serverLog(LL_WARNING, "Error connecting to witness:%s", server.addrToWitness[i]);
-            continue;
-        }
-    }
-}
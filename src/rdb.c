@@ -31,6 +31,7 @@
 #include "lzf.h"    /* LZF compression library */
 #include "zipmap.h"
 #include "endianconv.h"
+#include "rifl.h"
 
 #include <math.h>
 #include <sys/types.h>
@@ -751,6 +752,54 @@ int rdbSaveInfoAuxFields(rio *rdb) {
     return 1;
 }
 
+/* Save the RIFL table, the last request executed by every client, so that a
+ * retried request is still detected as a duplicate after a restart from the
+ * RDB, or on a slave after a full resync. It is an AUX field, so that RDB
+ * readers that don't know about RIFL just skip it. Its value is the clientId
+ * and requestId of every client, as little endian 64 bit integers. Nothing
+ * is saved if the table is empty. */
+int rdbSaveRifl(rio *rdb) {
+    unsigned long count = riflClientCount();
+    long long clientId, requestId;
+    riflIterator it;
+    int64_t *ids, *p;
+    int retval;
+
+    if (count == 0) return 1;
+    p = ids = zmalloc(count*2*sizeof(int64_t));
+    riflRewind(&it);
+    while (riflNext(&it,&clientId,&requestId)) {
+        p[0] = clientId;
+        p[1] = requestId;
+        memrev64ifbe(p);
+        memrev64ifbe(p+1);
+        p += 2;
+    }
+    retval = rdbSaveAuxField(rdb,"rifl-table",10,ids,count*2*sizeof(int64_t));
+    zfree(ids);
+    return retval;
+}
+
+/* Load the value of the AUX field saved by rdbSaveRifl(). */
+void rdbLoadRifl(sds ids) {
+    size_t len = sdslen(ids);
+    int64_t clientId, requestId;
+    char *p;
+
+    if (len % 16) rdbExitReportCorruptRDB("Invalid RIFL table length: %zu", len);
+    for (p = ids; p < ids+len; p += 16) {
+        memcpy(&clientId,p,8);
+        memcpy(&requestId,p+8,8);
+        memrev64ifbe(&clientId);
+        memrev64ifbe(&requestId);
+        if (clientId <= 0 || requestId < 0) {
+            rdbExitReportCorruptRDB("Invalid RIFL record: %lld %lld",
+                (long long)clientId, (long long)requestId);
+        }
+        riflLoadRecord(clientId,requestId);
+    }
+}
+
 /* Produces a dump of the database in RDB format sending it to the specified
  * Redis I/O channel. On success C_OK is returned, otherwise C_ERR
  * is returned and part of the output, or all the output, can be
@@ -813,6 +862,8 @@ int rdbSaveRio(rio *rdb, int *error) {
     }
     di = NULL; /* So that we don't release it again on error. */
 
+    if (rdbSaveRifl(rdb) == -1) goto werr;
+
     /* EOF opcode */
     if (rdbSaveType(rdb,RDB_OPCODE_EOF) == -1) goto werr;
 
@@ -1371,6 +1422,8 @@ int rdbLoad(char *filename) {
                 serverLog(LL_NOTICE,"RDB '%s': %s",
                     (char*)auxkey->ptr,
                     (char*)auxval->ptr);
+            } else if (!strcasecmp(auxkey->ptr,"rifl-table")) {
+                rdbLoadRifl(auxval->ptr);
             } else {
                 /* We ignore fields we don't understand, as by AUX field
                  * contract. */
@@ -97,6 +97,8 @@
 #define RDB_OPCODE_EOF        255
 
 int rdbSaveType(rio *rdb, unsigned char type);
+int rdbSaveRifl(rio *rdb);
+void rdbLoadRifl(sds ids);
 int rdbLoadType(rio *rdb);
 int rdbSaveTime(rio *rdb, time_t t);
 time_t rdbLoadTime(rio *rdb);
@@ -39,16 +39,31 @@
 #include <sys/time.h>
 #include <signal.h>
 #include <assert.h>
+#include <math.h>
 
 #include <sds.h> /* Use hiredis sds. */
 #include "ae.h"
 #include "hiredis.h"
 #include "adlist.h"
 #include "zmalloc.h"
+#include "MurmurHash3.h"
+#include "witnessProto.h"
 
 #define UNUSED(V) ((void) V)
 #define RANDPTR_INITIAL_SIZE 8
 
+/* CURP mode. The RIFL ids are appended to at-most-once commands as two
+ * fixed width base64 arguments, so they can be patched in place. */
+#define CURP_MAX_WITNESSES 16
+#define CURP_ID_LEN 11 /* Base64 digits of a 64 bit id. */
+#define CURP_IDS_TAIL_LEN (2*(5+CURP_ID_LEN+2)) /* "$11\r\n<id>\r\n" x 2 */
+
+/* How a CURP request completed. */
+#define CURP_1RTT 0     /* Master reply, plus all witnesses accepting it. */
+#define CURP_REJECT 1   /* A witness rejected it: we waited for a sync. */
+#define CURP_SYNC 2     /* No witnesses to record it: we waited for a sync. */
+#define CURP_CLASSES 3
+
 static struct config {
     aeEventLoop *el;
     const char *hostip;
@@ -79,6 +94,20 @@ static struct config {
     sds dbnumstr;
     char *tests;
     char *auth;
+    double zipf_theta;  /* Zipfian key distribution if non zero. */
+    double zipf_zetan;
+    double zipf_eta;
+    int curp;
+    redisContext *curp_context; /* Blocking connection to the master. */
+    int numwitnesses;
+    char *witness_ip[CURP_MAX_WITNESSES];
+    int witness_port[CURP_MAX_WITNESSES];
+    long long master_id;
+    uint32_t witness_hash_mask;
+    int curp_update;    /* The benchmarked command carries RIFL ids. */
+    int curp_firstkey, curp_lastkey, curp_keystep, curp_numkeys;
+    long long *curp_latency[CURP_CLASSES];
+    int curp_finished[CURP_CLASSES];
 } config;
 
 typedef struct _client {
@@ -95,11 +124,25 @@ typedef struct _client {
                                such as auth and select are prefixed to the pipeline of
                                benchmark commands and discarded after the first send. */
     int prefixlen;          /* Size in bytes of the pending prefix commands */
+    /* CURP mode only. */
+    long long clientId;     /* RIFL client id, random */
+    long long requestId;    /* RIFL id of the request in flight */
+    redisContext **witness; /* One connection per witness */
+    int witness_pending;    /* Witness replies still to receive */
+    int witness_rejected;   /* Witnesses that didn't accept the request */
+    int master_replied;     /* The reply of the master was received */
+    long long opnum;        /* From the CURP envelope of the reply, or -1 */
+    long long synced_opnum; /* Same */
+    int syncing;            /* Waiting for the reply to our sync request */
+    int curp_class;         /* CURP_* completion class */
 } *client;
 
 /* Prototypes */
 static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 static void createMissingClients(client c);
+static void curpSendRecords(client c);
+static void curpMasterReplied(client c);
+static void curpWitnessReadHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 
 /* Implementation */
 static long long ustime(void) {
@@ -124,9 +167,17 @@ static long long mstime(void) {
 
 static void freeClient(client c) {
     listNode *ln;
+    int j;
+
     aeDeleteFileEvent(config.el,c->context->fd,AE_WRITABLE);
     aeDeleteFileEvent(config.el,c->context->fd,AE_READABLE);
     redisFree(c->context);
+    for (j = 0; c->witness && j < config.numwitnesses; j++) {
+        aeDeleteFileEvent(config.el,c->witness[j]->fd,AE_WRITABLE);
+        aeDeleteFileEvent(config.el,c->witness[j]->fd,AE_READABLE);
+        redisFree(c->witness[j]);
+    }
+    zfree(c->witness);
     sdsfree(c->obuf);
     zfree(c->randptr);
     zfree(c);
@@ -154,12 +205,45 @@ static void resetClient(client c) {
     c->pending = config.pipeline;
 }
 
+/* Zipfian distribution over [0,keyspacelen), with the method of Gray et al.
+ * "Quickly generating billion-record synthetic databases" (as YCSB does):
+ * O(keyspacelen) setup, then O(1) per key. 0 is the most popular key. */
+static double zeta(long n, double theta) {
+    double sum = 0;
+    long i;
+
+    for (i = 1; i <= n; i++) sum += 1/pow((double)i,theta);
+    return sum;
+}
+
+static void zipfInit(void) {
+    long n = config.randomkeys_keyspacelen;
+    double theta = config.zipf_theta;
+
+    config.zipf_zetan = zeta(n,theta);
+    config.zipf_eta = (1-pow(2.0/n,1-theta))/(1-zeta(2,theta)/config.zipf_zetan);
+}
+
+static size_t zipfNext(void) {
+    long n = config.randomkeys_keyspacelen;
+    double theta = config.zipf_theta;
+    double u = (double)random()/((double)RAND_MAX+1);
+    double uz = u*config.zipf_zetan;
+    size_t r;
+
+    if (uz < 1) return 0;
+    if (uz < 1+pow(0.5,theta)) return 1;
+    r = n*pow(config.zipf_eta*u-config.zipf_eta+1,1/(1-theta));
+    return r < (size_t)n ? r : (size_t)n-1;
+}
+
 static void randomizeClientKey(client c) {
     size_t i;
 
     for (i = 0; i < c->randlen; i++) {
         char *p = c->randptr[i]+11;
-        size_t r = random() % config.randomkeys_keyspacelen;
+        size_t r = config.zipf_theta ? zipfNext() :
+                   (size_t)random() % config.randomkeys_keyspacelen;
         size_t j;
 
         for (j = 0; j < 12; j++) {
@@ -241,6 +325,12 @@ static void readHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
                     continue;
                 }
 
+                /* One request in flight: the client may be freed there. */
+                if (config.curp) {
+                    curpMasterReplied(c);
+                    return;
+                }
+
                 if (config.requests_finished < config.requests)
                     config.latency[config.requests_finished++] = c->latency;
                 c->pending--;
@@ -273,6 +363,7 @@ static void writeHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
         if (config.randomkeys) randomizeClientKey(c);
         c->start = ustime();
         c->latency = -1;
+        if (config.curp) curpSendRecords(c);
     }
 
     if (sdslen(c->obuf) > c->written) {
@@ -349,6 +440,15 @@ static client createClient(char *cmd, size_t len, client from) {
         c->prefix_pending++;
     }
 
+    /* In CURP mode replies come in the CURP envelope, and every client
+     * uses its own RIFL client id. */
+    if (config.curp) {
+        c->obuf = sdscat(c->obuf,"*3\r\n$6\r\nCLIENT\r\n$4\r\nRIFL\r\n$2\r\nON\r\n");
+        c->prefix_pending++;
+        c->clientId = ((((long long)random() << 31) | random()) & 0x3fffffffffffffffLL)+1;
+        c->requestId = 0;
+    }
+
     /* If a DB number different than zero is selected, prefix our request
      * buffer with the SELECT command, that will be discarded the first
      * time the replies are received, so if the client is reused the
@@ -373,6 +473,8 @@ static client createClient(char *cmd, size_t len, client from) {
     c->pending = config.pipeline+c->prefix_pending;
     c->randptr = NULL;
     c->randlen = 0;
+    c->witness = NULL;
+    c->syncing = 0;
 
     /* Find substrings in the output buffer that need to be randomized. */
     if (config.randomkeys) {
@@ -403,6 +505,22 @@ static client createClient(char *cmd, size_t len, client from) {
             }
         }
     }
+    if (config.curp && config.numwitnesses) {
+        c->witness = zmalloc(sizeof(redisContext*)*config.numwitnesses);
+        for (j = 0; j < config.numwitnesses; j++) {
+            c->witness[j] = redisConnectNonBlock(config.witness_ip[j],
+                                                 config.witness_port[j]);
+            if (c->witness[j]->err) {
+                fprintf(stderr,"Could not connect to witness at %s:%d: %s\n",
+                    config.witness_ip[j],config.witness_port[j],
+                    c->witness[j]->errstr);
+                exit(1);
+            }
+            c->witness[j]->reader->maxbuf = 0;
+            aeCreateFileEvent(config.el,c->witness[j]->fd,AE_READABLE,
+                              curpWitnessReadHandler,c);
+        }
+    }
     if (config.idlemode == 0)
         aeCreateFileEvent(config.el,c->context->fd,AE_WRITABLE,writeHandler,c);
     listAddNodeTail(config.clients,c);
@@ -428,6 +546,353 @@ static int compareLatency(const void *a, const void *b) {
     return (*(long long*)a)-(*(long long*)b);
 }
 
+/* ------------------------------- CURP mode ---------------------------------
+ *
+ * Every at-most-once command with keys is sent with RIFL ids, and at the
+ * same time recorded to all the witnesses with WMRECORD, one record per key,
+ * like a CURP client does. A request completes in one round trip if the
+ * master reply says it is synced already, or if all the witnesses accepted
+ * it. Otherwise we must wait for the master to sync it: CURPSYNC with the
+ * opNum of the request replies once the master synced that far.
+ * Only one request per client is in flight (no pipelining). */
+
+static void curpEncodeId(char *p, long long id) {
+    static const char *digits =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int j;
+
+    for (j = CURP_ID_LEN-1; j >= 0; j--) {
+        p[j] = digits[id & 63];
+        id = (unsigned long long)id >> 6;
+    }
+}
+
+/* Return in '*arg' and '*len' the argument 'idx' of the RESP encoded
+ * request 'req'. */
+static void curpGetArg(const char *req, int idx, const char **arg, size_t *len) {
+    const char *p = strchr(req,'\n')+1;
+    int j;
+
+    for (j = 0; ; j++) {
+        size_t l = strtoul(p+1,NULL,10);
+        p = strchr(p,'\n')+1;
+        if (j == idx) {
+            *arg = p;
+            *len = l;
+            return;
+        }
+        p += l+2;
+    }
+}
+
+/* The command in flight starts after the prefix commands not yet sent. */
+static const char *curpRequest(client c, size_t *len) {
+    *len = sdslen(c->obuf)-c->prefixlen;
+    return c->obuf+c->prefixlen;
+}
+
+static void curpWriteWitness(client c, int j) {
+    int done;
+
+    if (redisBufferWrite(c->witness[j],&done) == REDIS_ERR) {
+        fprintf(stderr,"Error writing to witness: %s\n",c->witness[j]->errstr);
+        exit(1);
+    }
+    if (done) aeDeleteFileEvent(config.el,c->witness[j]->fd,AE_WRITABLE);
+}
+
+static void curpWitnessWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    client c = privdata;
+    int j;
+    UNUSED(el);
+    UNUSED(mask);
+
+    for (j = 0; j < config.numwitnesses; j++)
+        if (c->witness[j]->fd == fd) curpWriteWitness(c,j);
+}
+
+/* Give the next request its RIFL request id and record it to the
+ * witnesses. Called when the request is about to be written. */
+static void curpSendRecords(client c) {
+    const char *req, *key;
+    size_t reqlen, keylen;
+    sds records, cmd;
+    int j, k, numkeys = 0;
+
+    c->master_replied = 0;
+    c->witness_pending = 0;
+    c->witness_rejected = 0;
+    c->opnum = c->synced_opnum = -1;
+    if (!config.curp_update) return;
+
+    c->requestId++;
+    curpEncodeId(c->obuf+sdslen(c->obuf)-CURP_IDS_TAIL_LEN+5,c->clientId);
+    curpEncodeId(c->obuf+sdslen(c->obuf)-CURP_ID_LEN-2,c->requestId);
+    if (config.numwitnesses == 0) return;
+
+    req = curpRequest(c,&reqlen);
+    records = sdsempty();
+    for (k = config.curp_firstkey; k <= config.curp_lastkey;
+         k += config.curp_keystep)
+    {
+        char hdr[WITNESS_RECORD_HDR_LEN];
+        uint32_t keyHash;
+
+        curpGetArg(req,k,&key,&keylen);
+        MurmurHash3_x86_32(key,keylen,config.dbnum,&keyHash);
+        witnessStore64(hdr,config.master_id);
+        witnessStore32(hdr+8,keyHash);
+        witnessStore32(hdr+12,keyHash & config.witness_hash_mask);
+        witnessStore64(hdr+16,c->clientId);
+        witnessStore64(hdr+24,c->requestId);
+        records = sdscatprintf(records,"$%zu\r\n",sizeof(hdr)+reqlen);
+        records = sdscatlen(records,hdr,sizeof(hdr));
+        records = sdscatlen(records,req,reqlen);
+        records = sdscatlen(records,"\r\n",2);
+        numkeys++;
+    }
+    cmd = sdscatprintf(sdsempty(),"*%d\r\n$8\r\nWMRECORD\r\n",numkeys+1);
+    cmd = sdscatsds(cmd,records);
+    for (j = 0; j < config.numwitnesses; j++) {
+        redisAppendFormattedCommand(c->witness[j],cmd,sdslen(cmd));
+        curpWriteWitness(c,j);
+        if (sdslen(c->witness[j]->obuf))
+            aeCreateFileEvent(config.el,c->witness[j]->fd,AE_WRITABLE,
+                              curpWitnessWriteHandler,c);
+        c->witness_pending++;
+    }
+    sdsfree(records);
+    sdsfree(cmd);
+}
+
+static void curpDone(client c) {
+    long long latency = ustime()-c->start;
+
+    if (config.requests_finished < config.requests) {
+        config.latency[config.requests_finished++] = latency;
+        config.curp_latency[c->curp_class]
+            [config.curp_finished[c->curp_class]++] = latency;
+    }
+    c->pending--;
+    clientDone(c);
+}
+
+static void curpSyncWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    client c = privdata;
+    int done;
+    UNUSED(el);
+    UNUSED(mask);
+
+    if (redisBufferWrite(c->context,&done) == REDIS_ERR) {
+        fprintf(stderr,"Error: %s\n",c->context->errstr);
+        exit(1);
+    }
+    if (done) aeDeleteFileEvent(config.el,fd,AE_WRITABLE);
+}
+
+/* Complete the request once the master and all the witnesses replied, or
+ * ask the master to sync it first. */
+static void curpCheckDone(client c) {
+    if (!c->master_replied || c->witness_pending) return;
+    if (c->opnum == -1 || c->opnum <= c->synced_opnum ||
+        (config.numwitnesses && !c->witness_rejected))
+    {
+        c->curp_class = CURP_1RTT;
+        curpDone(c);
+        return;
+    }
+    c->curp_class = config.numwitnesses ? CURP_REJECT : CURP_SYNC;
+    c->syncing = 1;
+    redisAppendCommand(c->context,"CURPSYNC %lld",c->opnum);
+    curpSyncWriteHandler(config.el,c->context->fd,c,AE_WRITABLE);
+    if (sdslen(c->context->obuf))
+        aeCreateFileEvent(config.el,c->context->fd,AE_WRITABLE,
+                          curpSyncWriteHandler,c);
+}
+
+static void curpMasterReplied(client c) {
+    if (c->syncing) {
+        c->syncing = 0;
+        curpDone(c);
+    } else {
+        c->master_replied = 1;
+        c->opnum = c->context->reader->curpOpNum;
+        c->synced_opnum = c->context->reader->curpSyncedOpNum;
+        curpCheckDone(c);
+    }
+}
+
+/* WMRECORD replies with a bitmap of the accepted records. */
+static void curpWitnessReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    client c = privdata;
+    redisContext *w = NULL;
+    redisReply *reply;
+    int j;
+    UNUSED(el);
+    UNUSED(mask);
+
+    for (j = 0; j < config.numwitnesses; j++)
+        if (c->witness[j]->fd == fd) w = c->witness[j];
+    if (redisBufferRead(w) != REDIS_OK) {
+        fprintf(stderr,"Error reading from witness: %s\n",w->errstr);
+        exit(1);
+    }
+    while (c->witness_pending) {
+        int accepted = 1, k;
+
+        if (redisGetReply(w,(void**)&reply) != REDIS_OK) {
+            fprintf(stderr,"Error reading from witness: %s\n",w->errstr);
+            exit(1);
+        }
+        if (reply == NULL) return;
+        if (reply->type != REDIS_REPLY_STRING ||
+            reply->len*8 < config.curp_numkeys)
+        {
+            accepted = 0;
+            if (config.showerrors && reply->type == REDIS_REPLY_ERROR)
+                printf("Error from witness: %s\n",reply->str);
+        }
+        for (k = 0; accepted && k < config.curp_numkeys; k++) {
+            if (!(reply->str[k/8] & (1<<(k%8)))) accepted = 0;
+        }
+        freeReplyObject(reply);
+        if (!accepted) c->witness_rejected++;
+        if (--c->witness_pending == 0) {
+            curpCheckDone(c); /* May free the client. */
+            return;
+        }
+    }
+}
+
+/* If the command to benchmark is an at-most-once command with keys, return
+ * a copy of it with room for the RIFL ids, and set config.curp_update.
+ * Otherwise return NULL: the command is sent as it is. */
+static sds curpPrepareCommand(char *cmd, int len) {
+    redisReply *reply, *info;
+    const char *name;
+    size_t namelen, j;
+    sds newcmd = NULL;
+    int argc;
+
+    config.curp_update = 0;
+    if (cmd[0] != '*') return NULL; /* Inline. */
+    argc = atoi(cmd+1);
+    curpGetArg(cmd,0,&name,&namelen);
+    reply = redisCommand(config.curp_context,"COMMAND INFO %b",name,namelen);
+    if (reply == NULL) {
+        fprintf(stderr,"Error: %s\n",config.curp_context->errstr);
+        exit(1);
+    }
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 1 ||
+        reply->element[0]->type != REDIS_REPLY_ARRAY ||
+        reply->element[0]->elements < 6)
+    {
+        freeReplyObject(reply);
+        return NULL;
+    }
+    info = reply->element[0];
+    for (j = 0; j < info->element[2]->elements; j++) {
+        if (!strcmp(info->element[2]->element[j]->str,"execute_at_most_once"))
+            config.curp_update = 1;
+    }
+    config.curp_firstkey = info->element[3]->integer;
+    config.curp_lastkey = info->element[4]->integer;
+    config.curp_keystep = info->element[5]->integer;
+    if (config.curp_lastkey < 0) config.curp_lastkey += argc;
+    if (config.curp_firstkey <= 0 || config.curp_keystep <= 0)
+        config.curp_update = 0;
+    else
+        config.curp_numkeys = (config.curp_lastkey-config.curp_firstkey)/
+                              config.curp_keystep+1;
+    freeReplyObject(reply);
+
+    if (config.curp_update) {
+        char *ids = "$11\r\nAAAAAAAAAAA\r\n$11\r\nAAAAAAAAAAA\r\n";
+        newcmd = sdscatprintf(sdsempty(),"*%d",argc+2);
+        newcmd = sdscatlen(newcmd,strchr(cmd,'\r'),len-(strchr(cmd,'\r')-cmd));
+        newcmd = sdscat(newcmd,ids);
+    }
+    return newcmd;
+}
+
+/* Read from the master and the witnesses what CURP mode needs. */
+static void curpInit(void) {
+    redisReply *reply;
+    int j;
+
+    if (config.hostsocket == NULL)
+        config.curp_context = redisConnect(config.hostip,config.hostport);
+    else
+        config.curp_context = redisConnectUnix(config.hostsocket);
+    if (config.curp_context->err) {
+        fprintf(stderr,"Could not connect to Redis: %s\n",
+            config.curp_context->errstr);
+        exit(1);
+    }
+    if (config.auth) {
+        reply = redisCommand(config.curp_context,"AUTH %s",config.auth);
+        if (reply) freeReplyObject(reply);
+    }
+    reply = redisCommand(config.curp_context,"CONFIG GET witness-master-id");
+    if (reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+        reply->elements != 2)
+    {
+        fprintf(stderr,"Could not read the witness-master-id of the master.\n");
+        exit(1);
+    }
+    config.master_id = strtoll(reply->element[1]->str,NULL,10);
+    freeReplyObject(reply);
+
+    /* Use the hash mask of the largest table, like the master does. */
+    config.witness_hash_mask = 0;
+    for (j = 0; j < config.numwitnesses; j++) {
+        redisContext *w = redisConnect(config.witness_ip[j],
+                                       config.witness_port[j]);
+
+        if (w->err) {
+            fprintf(stderr,"Could not connect to witness at %s:%d: %s\n",
+                config.witness_ip[j],config.witness_port[j],w->errstr);
+            exit(1);
+        }
+        reply = redisCommand(w,"WCONFIG");
+        if (reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+            reply->elements != 2)
+        {
+            fprintf(stderr,"Witness at %s:%d did not reply to WCONFIG.\n",
+                config.witness_ip[j],config.witness_port[j]);
+            exit(1);
+        }
+        if ((uint32_t)(reply->element[0]->integer-1) > config.witness_hash_mask)
+            config.witness_hash_mask = reply->element[0]->integer-1;
+        freeReplyObject(reply);
+        redisFree(w);
+    }
+    for (j = 0; j < CURP_CLASSES; j++)
+        config.curp_latency[j] = zmalloc(sizeof(long long)*config.requests);
+}
+
+static void showCurpLatencyReport(void) {
+    static const char *names[CURP_CLASSES] =
+        {"1-RTT","REJECT-fallback","sync-wait"};
+    static const double percentiles[] = {50, 99, 99.9};
+    int j, i;
+
+    for (j = 0; j < CURP_CLASSES; j++) {
+        int n = config.curp_finished[j];
+        long long *lat = config.curp_latency[j];
+
+        if (n == 0) continue;
+        qsort(lat,n,sizeof(long long),compareLatency);
+        printf("  %-16s %6.2f%%", names[j],
+            (float)n*100/config.requests_finished);
+        for (i = 0; i < (int)(sizeof(percentiles)/sizeof(double)); i++) {
+            int idx = (int)ceil(percentiles[i]/100*n)-1;
+            printf("  p%g %lld", percentiles[i], lat[idx < 0 ? 0 : idx]);
+        }
+        printf("  max %lld usec\n", lat[n-1]);
+    }
+}
+
 static void showLatencyReport(void) {
     int i, curlat = 0;
     float perc, reqpersec;
@@ -450,6 +915,7 @@ static void showLatencyReport(void) {
                 printf("%.2f%% <= %d milliseconds\n", perc, curlat);
             }
         }
+        if (config.curp) showCurpLatencyReport();
         printf("%.2f requests per second\n\n", reqpersec);
     } else if (config.csv) {
         printf("\"%s\",\"%.2f\"\n", config.title, reqpersec);
@@ -460,12 +926,20 @@ static void showLatencyReport(void) {
 
 static void benchmark(char *title, char *cmd, int len) {
     client c;
+    sds curpcmd = NULL;
+    int j;
 
     config.title = title;
     config.requests_issued = 0;
     config.requests_finished = 0;
-
-    c = createClient(cmd,len,NULL);
+    for (j = 0; j < CURP_CLASSES; j++) config.curp_finished[j] = 0;
+
+    if (config.curp) curpcmd = curpPrepareCommand(cmd,len);
+    if (curpcmd)
+        c = createClient(curpcmd,sdslen(curpcmd),NULL);
+    else
+        c = createClient(cmd,len,NULL);
+    sdsfree(curpcmd);
     createMissingClients(c);
 
     config.start = mstime();
@@ -546,6 +1020,29 @@ int parseOptions(int argc, const char **argv) {
             if (lastarg) goto invalid;
             config.dbnum = atoi(argv[++i]);
             config.dbnumstr = sdsfromlonglong(config.dbnum);
+        } else if (!strcmp(argv[i],"--zipf")) {
+            if (lastarg) goto invalid;
+            config.zipf_theta = atof(argv[++i]);
+            if (config.zipf_theta <= 0 || config.zipf_theta >= 1) {
+                fprintf(stderr,"--zipf needs a theta between 0 and 1.\n");
+                exit(1);
+            }
+        } else if (!strcmp(argv[i],"--curp")) {
+            config.curp = 1;
+        } else if (!strcmp(argv[i],"--witness")) {
+            char *colon;
+
+            if (lastarg) goto invalid;
+            if (config.numwitnesses == CURP_MAX_WITNESSES) {
+                fprintf(stderr,"Too many witnesses.\n");
+                exit(1);
+            }
+            config.witness_ip[config.numwitnesses] = strdup(argv[++i]);
+            colon = strrchr(config.witness_ip[config.numwitnesses],':');
+            if (colon == NULL) goto invalid;
+            *colon = '\0';
+            config.witness_port[config.numwitnesses++] = atoi(colon+1);
+            config.curp = 1;
         } else if (!strcmp(argv[i],"--help")) {
             exit_status = 0;
             goto usage;
@@ -589,7 +1086,15 @@ usage:
 " -l                 Loop. Run the tests forever\n"
 " -t <tests>         Only run the comma separated list of tests. The test\n"
 "                    names are the same as the ones produced as output.\n"
-" -I                 Idle mode. Just open N idle connections and wait.\n\n"
+" -I                 Idle mode. Just open N idle connections and wait.\n"
+" --zipf <theta>     With -r, pick keys with a zipfian distribution instead\n"
+"                    of a uniform one. 0 < theta < 1, 0.99 is very skewed.\n"
+" --curp             CURP mode: at-most-once commands carry RIFL ids and are\n"
+"                    recorded to the witnesses. Latencies are also reported\n"
+"                    by completion: 1-RTT, after a witness REJECT, or after\n"
+"                    waiting for a sync (no witnesses). No pipelining.\n"
+" --witness <ip:port> Witness of the master, implies --curp. Repeat it for\n"
+"                    every witness.\n\n"
 "Examples:\n\n"
 " Run the benchmark with the default configuration against 127.0.0.1:6379:\n"
 "   $ redis-benchmark\n\n"
@@ -603,6 +1108,8 @@ usage:
 "   $ redis-benchmark -r 10000 -n 10000 eval 'return redis.call(\"ping\")' 0\n\n"
 " Fill a list with 10000 random elements:\n"
 "   $ redis-benchmark -r 10000 -n 10000 lpush mylist __rand_int__\n\n"
+" Benchmark SET with CURP and two witnesses, on skewed keys:\n"
+"   $ redis-benchmark -t set -r 100000 --zipf 0.99 --witness 10.0.0.2:6379 --witness 10.0.0.3:6379\n\n"
 " On user specified command lines __rand_int__ is replaced with a random integer\n"
 " with a range of values selected by the -r option.\n"
     );
@@ -679,6 +1186,9 @@ int main(int argc, const char **argv) {
     config.tests = NULL;
     config.dbnum = 0;
     config.auth = NULL;
+    config.zipf_theta = 0;
+    config.curp = 0;
+    config.numwitnesses = 0;
 
     i = parseOptions(argc,argv);
     argc -= i;
@@ -686,6 +1196,21 @@ int main(int argc, const char **argv) {
 
     config.latency = zmalloc(sizeof(long long)*config.requests);
 
+    if (config.zipf_theta) {
+        if (config.randomkeys_keyspacelen < 2) {
+            fprintf(stderr,"--zipf needs -r with a keyspace of 2 keys or more.\n");
+            exit(1);
+        }
+        zipfInit();
+    }
+    if (config.curp) {
+        if (config.pipeline > 1) {
+            fprintf(stderr,"--curp does not support pipelining.\n");
+            exit(1);
+        }
+        curpInit();
+    }
+
     if (config.keepalive == 0) {
         printf("WARNING: keepalive disabled, you probably need 'echo 1 > /proc/sys/net/ipv4/tcp_tw_reuse' for Linux and 'sudo sysctl -w net.inet.tcp.msl=1000' for Mac OS X in order to use a lot of clients/requests\n");
     }
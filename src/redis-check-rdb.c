@@ -259,8 +259,14 @@ int redis_check_rdb(char *rdbfilename) {
             if ((auxkey = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
             if ((auxval = rdbLoadStringObject(&rdb)) == NULL) goto eoferr;
 
-            rdbCheckInfo("AUX FIELD %s = '%s'",
-                (char*)auxkey->ptr, (char*)auxval->ptr);
+            if (!strcasecmp(auxkey->ptr,"rifl-table")) {
+                /* Binary, see rdbSaveRifl(). */
+                rdbCheckInfo("RIFL table with %zu clients",
+                    sdslen(auxval->ptr)/16);
+            } else {
+                rdbCheckInfo("AUX FIELD %s = '%s'",
+                    (char*)auxkey->ptr, (char*)auxval->ptr);
+            }
             decrRefCount(auxkey);
             decrRefCount(auxval);
             continue; /* Read type again. */
@@ -0,0 +1,390 @@
+/* CURP load driver for the crash recovery harness (utils/curp-recovery.tcl).
+ *
+ * Every client sends INCR <prefix>:<client id>:<seq> for seq = 0, 1, 2, ...
+ * through a CURP context (deps/hiredis/curp.h), keeping up to -P updates in
+ * flight, until -n updates were sent or the master went away. Keys are never
+ * updated twice, so the witnesses can accept every update. If the master went
+ * away, we then wait for it to take normal requests again, and read the keys
+ * back:
+ *
+ *  - an update that was acknowledged must be applied (else it is lost);
+ *  - no key may be above 1 (else the update is duplicated);
+ *  - updates that were in flight may or may not be applied.
+ *
+ * The report goes to stdout as "field:value" lines, like INFO. The exit code
+ * is 0 if nothing was lost or duplicated, 1 otherwise, 2 on other errors.
+ *
+ * Copyright (c) 2017 Stanford University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "ae.h"
+#include "hiredis.h"
+#include "async.h"
+#include "curp.h"
+#include "adapters/ae.h"
+#include "zmalloc.h"
+
+#define UNUSED(V) ((void) V)
+#define CURP_LOAD_MAX_WITNESSES 16
+
+/* State of an update. */
+#define OP_NOT_SENT 0
+#define OP_IN_FLIGHT 1  /* Or lost with the connection: we don't know. */
+#define OP_ACKED 2
+
+static struct config {
+    aeEventLoop *el;
+    const char *hostip;
+    int hostport;
+    const char *witnessip[CURP_LOAD_MAX_WITNESSES];
+    int witnessport[CURP_LOAD_MAX_WITNESSES];
+    int numwitnesses;
+    int numclients;
+    int requests;       /* Total, split evenly among the clients. */
+    int window;         /* Updates in flight per client. */
+    const char *prefix;
+    int recoverytimeout; /* Seconds to wait for the master to come back. */
+    int busyclients;    /* Clients with updates in flight. */
+    long long start;
+    long long crashtime; /* When the first client lost the master. */
+    long long acked, errors, fast, synced;
+} config;
+
+typedef struct _client {
+    int id;
+    redisCurpContext *cc;
+    redisAsyncContext *master;
+    redisAsyncContext *witness[CURP_LOAD_MAX_WITNESSES];
+    int quota;          /* Updates this client sends at most. */
+    int next;           /* Sequence number of the next update. */
+    int inflight;
+    int dead;           /* The master went away. */
+    unsigned char *state; /* OP_* of every update. */
+} client;
+
+static client *clients;
+
+static long long ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* ------------------------------- Load phase ------------------------------- */
+
+static void sendUpdates(client *c);
+
+static void clientIdle(client *c) {
+    if (c->inflight == 0 && (c->dead || c->next == c->quota)) {
+        config.busyclients--;
+        if (config.busyclients == 0) aeStop(config.el);
+    }
+}
+
+static void updateCallback(redisCurpContext *cc, redisReply *reply, void *privdata) {
+    client *c = cc->data;
+    int seq = (int)(long)privdata;
+
+    c->inflight--;
+    if (reply == NULL) {
+        /* The master is gone: the update may or may not be applied. */
+        if (!c->dead && config.crashtime == 0) config.crashtime = ustime();
+        c->dead = 1;
+    } else if (reply->type == REDIS_REPLY_INTEGER) {
+        c->state[seq] = OP_ACKED;
+        config.acked++;
+    } else {
+        config.errors++;
+    }
+    if (!c->dead) sendUpdates(c);
+    clientIdle(c);
+}
+
+static void sendUpdates(client *c) {
+    while (!c->dead && c->inflight < config.window && c->next < c->quota) {
+        int seq = c->next;
+
+        if (redisCurpCommand(c->cc,updateCallback,(void*)(long)seq,
+                             "INCR %s:%d:%d",config.prefix,c->id,seq)
+            != REDIS_OK)
+        {
+            c->dead = 1;
+            break;
+        }
+        c->state[seq] = OP_IN_FLIGHT;
+        c->next++;
+        c->inflight++;
+    }
+}
+
+static void disconnectCallback(redisCurpContext *cc, const redisAsyncContext *ac, int status) {
+    client *c = cc->data;
+    UNUSED(status);
+
+    if (ac == c->master && !c->dead) {
+        c->master = NULL;
+        if (config.crashtime == 0) config.crashtime = ustime();
+        c->dead = 1;
+    }
+}
+
+static redisAsyncContext *connectTo(const char *ip, int port) {
+    redisAsyncContext *ac = redisAsyncConnect(ip,port);
+
+    if (ac->err) {
+        fprintf(stderr,"Could not connect to %s:%d: %s\n",ip,port,ac->errstr);
+        exit(2);
+    }
+    redisAeAttach(config.el,ac);
+    return ac;
+}
+
+static void createClients(void) {
+    int j, k;
+
+    clients = zcalloc(sizeof(client)*config.numclients);
+    for (j = 0; j < config.numclients; j++) {
+        client *c = &clients[j];
+
+        c->id = j;
+        c->quota = config.requests / config.numclients;
+        if (j < config.requests % config.numclients) c->quota++;
+        c->state = zcalloc(c->quota+1);
+        c->master = connectTo(config.hostip,config.hostport);
+        for (k = 0; k < config.numwitnesses; k++)
+            c->witness[k] = connectTo(config.witnessip[k],
+                                      config.witnessport[k]);
+        c->cc = redisCurpCreate(c->master,c->witness,config.numwitnesses);
+        c->cc->data = c;
+        redisCurpSetDisconnectCallback(c->cc,disconnectCallback);
+    }
+}
+
+static void freeClients(void) {
+    int j, k;
+
+    for (j = 0; j < config.numclients; j++) {
+        client *c = &clients[j];
+
+        c->dead = 1;
+        if (c->cc->master) redisAsyncFree(c->cc->master);
+        for (k = 0; k < config.numwitnesses; k++)
+            if (c->cc->witness[k]) redisAsyncFree(c->cc->witness[k]);
+        config.fast += c->cc->fastCompletions;
+        config.synced += c->cc->syncCompletions;
+        redisCurpFree(c->cc);
+    }
+}
+
+/* ------------------------------ Check phase ------------------------------- */
+
+/* Wait until the master takes normal requests again: while it replays,
+ * connections to its normal port are closed right away. */
+static redisContext *waitForMaster(void) {
+    long long deadline = ustime() + (long long)config.recoverytimeout*1000000;
+    struct timeval tv = {1, 0};
+
+    while (ustime() < deadline) {
+        redisContext *ctx = redisConnectWithTimeout(config.hostip,
+                                                    config.hostport,tv);
+        if (!ctx->err) {
+            redisReply *reply = redisCommand(ctx,"PING");
+            if (reply && reply->type == REDIS_REPLY_STATUS) {
+                freeReplyObject(reply);
+                return ctx;
+            }
+            if (reply) freeReplyObject(reply);
+        }
+        redisFree(ctx);
+        usleep(10000);
+    }
+    return NULL;
+}
+
+/* Read the keys back, CHECK_BATCH at a time. */
+#define CHECK_BATCH 1000
+
+static int checkClients(redisContext *ctx) {
+    long long lost = 0, duplicated = 0, unacked = 0, recovered = 0;
+    const char *argv[CHECK_BATCH+1];
+    size_t argvlen[CHECK_BATCH+1];
+    char keys[CHECK_BATCH][128];
+    int j, seq, k, n;
+
+    argv[0] = "MGET";
+    argvlen[0] = 4;
+    for (j = 0; j < config.numclients; j++) {
+        client *c = &clients[j];
+
+        for (seq = 0; seq < c->next; seq += n) {
+            redisReply *reply;
+
+            n = c->next-seq < CHECK_BATCH ? c->next-seq : CHECK_BATCH;
+            for (k = 0; k < n; k++) {
+                argvlen[k+1] = snprintf(keys[k],sizeof(keys[k]),"%s:%d:%d",
+                    config.prefix,c->id,seq+k);
+                argv[k+1] = keys[k];
+            }
+            reply = redisCommandArgv(ctx,n+1,argv,argvlen);
+            if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+                fprintf(stderr,"MGET failed: %s\n",
+                    reply ? reply->str : ctx->errstr);
+                exit(2);
+            }
+            for (k = 0; k < n; k++) {
+                redisReply *r = reply->element[k];
+                int applied = r->type == REDIS_REPLY_STRING ? atoi(r->str) : 0;
+
+                if (applied > 1) duplicated++;
+                if (c->state[seq+k] == OP_ACKED) {
+                    if (applied == 0) lost++;
+                } else {
+                    unacked++;
+                    if (applied) recovered++;
+                }
+            }
+            freeReplyObject(reply);
+        }
+    }
+    printf("lost:%lld\r\n",lost);
+    printf("duplicated:%lld\r\n",duplicated);
+    printf("unacked:%lld\r\n",unacked);
+    printf("unacked_applied:%lld\r\n",recovered);
+    return (lost || duplicated) ? 1 : 0;
+}
+
+/* --------------------------------- Main ----------------------------------- */
+
+static void usage(void) {
+    printf(
+"Usage: redis-curp-load [-h <host>] [-p <port>] [--witness <ip:port>]...\n"
+"                       [-c <clients>] [-n <requests>] [-P <window>]\n"
+"                       [--prefix <key prefix>] [--recovery-timeout <sec>]\n\n"
+" -h <hostname>      Master hostname (default 127.0.0.1)\n"
+" -p <port>          Master port (default 6379)\n"
+" --witness <ip:port> Witness of the master. Repeat it for every witness.\n"
+" -c <clients>       Number of CURP clients (default 10)\n"
+" -n <requests>      Total number of updates (default 100000)\n"
+" -P <window>        Updates in flight per client (default 1)\n"
+" --prefix <prefix>  Clients update the keys <prefix>:<client id>:<seq>\n"
+"                    (default curp-load)\n"
+" --recovery-timeout <sec> How long to wait for the master to come back\n"
+"                    after it went away (default 60)\n");
+    exit(2);
+}
+
+static void parseOptions(int argc, const char **argv) {
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        int lastarg = (i == argc-1);
+
+        if (!strcmp(argv[i],"-h") && !lastarg) {
+            config.hostip = argv[++i];
+        } else if (!strcmp(argv[i],"-p") && !lastarg) {
+            config.hostport = atoi(argv[++i]);
+        } else if (!strcmp(argv[i],"--witness") && !lastarg) {
+            const char *addr = argv[++i];
+            char *colon = strrchr(addr,':');
+            if (colon == NULL ||
+                config.numwitnesses == CURP_LOAD_MAX_WITNESSES) usage();
+            config.witnessip[config.numwitnesses] =
+                strndup(addr,colon-addr);
+            config.witnessport[config.numwitnesses] = atoi(colon+1);
+            config.numwitnesses++;
+        } else if (!strcmp(argv[i],"-c") && !lastarg) {
+            config.numclients = atoi(argv[++i]);
+        } else if (!strcmp(argv[i],"-n") && !lastarg) {
+            config.requests = atoi(argv[++i]);
+        } else if (!strcmp(argv[i],"-P") && !lastarg) {
+            config.window = atoi(argv[++i]);
+        } else if (!strcmp(argv[i],"--prefix") && !lastarg) {
+            config.prefix = argv[++i];
+        } else if (!strcmp(argv[i],"--recovery-timeout") && !lastarg) {
+            config.recoverytimeout = atoi(argv[++i]);
+        } else {
+            usage();
+        }
+    }
+    if (config.numclients < 1 || config.requests < config.numclients ||
+        config.window < 1) usage();
+}
+
+int main(int argc, const char **argv) {
+    redisContext *ctx;
+    long long loadtime;
+    int j, status;
+
+    config.hostip = "127.0.0.1";
+    config.hostport = 6379;
+    config.numclients = 10;
+    config.requests = 100000;
+    config.window = 1;
+    config.prefix = "curp-load";
+    config.recoverytimeout = 60;
+    parseOptions(argc,argv);
+
+    config.el = aeCreateEventLoop(1024*10);
+    createClients();
+    config.busyclients = config.numclients;
+    config.start = ustime();
+    for (j = 0; j < config.numclients; j++) {
+        sendUpdates(&clients[j]);
+        clientIdle(&clients[j]);
+    }
+    if (config.busyclients) aeMain(config.el);
+    loadtime = (config.crashtime ? config.crashtime : ustime())-config.start;
+    freeClients();
+
+    printf("crashed:%d\r\n",config.crashtime != 0);
+    printf("acked:%lld\r\n",config.acked);
+    printf("acked_1rtt:%lld\r\n",config.fast);
+    printf("acked_after_sync:%lld\r\n",config.synced);
+    printf("errors:%lld\r\n",config.errors);
+    printf("load_ms:%lld\r\n",loadtime/1000);
+    fflush(stdout);
+
+    if ((ctx = waitForMaster()) == NULL) {
+        fprintf(stderr,"The master did not come back in %d seconds\n",
+            config.recoverytimeout);
+        return 2;
+    }
+    if (config.crashtime)
+        printf("unavailable_ms:%lld\r\n",(ustime()-config.crashtime)/1000);
+    status = checkClients(ctx);
+    redisFree(ctx);
+    return status;
+}
@@ -0,0 +1,3 @@
+#define REDIS_GIT_SHA1 "fc548070"
+#define REDIS_GIT_DIRTY "62"
+#define REDIS_BUILD_ID "vm-1792210462"
@@ -30,6 +30,7 @@
 
 
 #include "server.h"
+#include "rifl.h"
 
 #include <sys/time.h>
 #include <unistd.h>
@@ -752,6 +753,7 @@ void replconfCommand(client *c) {
              * confirms slave is online and ready to get more data). */
             if (c->repl_put_online_on_ack && c->replstate == SLAVE_STATE_ONLINE)
                 putSlaveOnline(c);
+            replicationCurpAcksUpdated();
             /* Note: this command does not reply anything! */
             return;
         } else if (!strcasecmp(c->argv[j]->ptr,"getack")) {
@@ -1128,6 +1130,7 @@ void readSyncBulkPayload(aeEventLoop *el, int fd, void *privdata, int mask) {
         serverLog(LL_NOTICE, "MASTER <-> SLAVE sync: Flushing old data");
         signalFlushedDb(-1);
         emptyDb(replicationEmptyDbCallback);
+        riflEmpty();
         /* Before loading the DB into memory we need to delete the readable
          * handler, otherwise it will get called recursively since
          * rdbLoad() will call the event loop to process events from time to
@@ -2230,6 +2233,87 @@ long long replicationGetSlaveOffset(void) {
     return offset;
 }
 
+/* ------------------------- CURP SYNC BY REPLICAS --------------------------
+ * With curp-sync-replicas set to K > 0, an operation counts as synced once K
+ * slaves acknowledged it, instead of once the AOF is fsynced: replies held
+ * for a sync, witness GC and the synced opNum of CURP envelopes all follow
+ * the replicas, and there is no disk in the critical path.
+ *
+ * Slaves acknowledge replication offsets, so beforeSleep() remembers the
+ * replication offset at which each new opNum ended, and every REPLCONF ACK
+ * moves aof_last_fsync_opNum to the newest opNum that K slaves acknowledged
+ * (see aofFsyncDone()). A sync is requested with a REPLCONF GETACK, as WAIT
+ * does, rather than with an fsync. If fewer than K slaves are online the
+ * watermark stops, and so do the clients that need a sync.
+ *
+ * The queue holds at most CURP_ACK_QUEUE_MAX entries: past that, new
+ * operations are merged into the newest entry, whose operations are then
+ * synced together once its (later) offset is acknowledged.
+ * ------------------------------------------------------------------------- */
+
+#define CURP_ACK_QUEUE_MAX 1024
+
+static struct {
+    long long opNum;
+    long long offset;
+} *curpAckQueue = NULL;
+static long curpAckHead = 0, curpAckTail = 0, curpAckCapacity = 0;
+
+/* Return true if replica acknowledgements move the synced watermark. */
+int curpSyncByReplicas(void) {
+    return server.curp_sync_replicas > 0 && server.masterhost == NULL;
+}
+
+/* Remember the replication offset of the operations executed since the last
+ * call. Called by beforeSleep() before a GETACK is added to the stream, so
+ * that an ack of the offset covers the operations. */
+void replicationTrackCurpOpNum(void) {
+    long long last = curpAckHead < curpAckTail ?
+            curpAckQueue[curpAckTail-1].opNum : server.aof_last_fsync_opNum;
+
+    if (!curpSyncByReplicas() || server.currentOpNum <= last) return;
+    if (curpAckTail - curpAckHead == CURP_ACK_QUEUE_MAX) {
+        curpAckQueue[curpAckTail-1].opNum = server.currentOpNum;
+        curpAckQueue[curpAckTail-1].offset = server.master_repl_offset;
+        return;
+    }
+    if (curpAckTail == curpAckCapacity) {
+        if (curpAckHead > 0) {
+            memmove(curpAckQueue,curpAckQueue+curpAckHead,
+                    sizeof(*curpAckQueue)*(curpAckTail-curpAckHead));
+            curpAckTail -= curpAckHead;
+            curpAckHead = 0;
+        } else {
+            curpAckCapacity = curpAckCapacity ? curpAckCapacity*2 : 64;
+            curpAckQueue = zrealloc(curpAckQueue,
+                    sizeof(*curpAckQueue)*curpAckCapacity);
+        }
+    }
+    curpAckQueue[curpAckTail].opNum = server.currentOpNum;
+    curpAckQueue[curpAckTail].offset = server.master_repl_offset;
+    curpAckTail++;
+}
+
+/* Move the synced watermark past what curp-sync-replicas slaves already
+ * acknowledged. Called when an ACK arrives or the option changes. */
+void replicationCurpAcksUpdated(void) {
+    long long opNum = 0;
+
+    if (!curpSyncByReplicas()) {
+        curpAckHead = curpAckTail = 0;
+        return;
+    }
+    while (curpAckHead < curpAckTail &&
+           replicationCountAcksByOffset(curpAckQueue[curpAckHead].offset) >=
+           server.curp_sync_replicas)
+    {
+        opNum = curpAckQueue[curpAckHead].opNum;
+        curpAckHead++;
+    }
+    if (curpAckHead == curpAckTail) curpAckHead = curpAckTail = 0;
+    if (opNum) aofFsyncDone(opNum);
+}
+
 /* --------------------------- REPLICATION CRON  ---------------------------- */
 
 /* Replication cron function, called 1 time per second. */
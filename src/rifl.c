@@ -15,25 +15,102 @@
 
 #include "server.h"
 #include "redisassert.h"
+#include "rifl.h"
 
 /*================================= Globals ================================= */
 
-/* Global vars */
-#define RIFL_TABLE_SIZE 1048576 /* 1024*1024. This must be power of two. */
+/* Completion record of a client. A client holds a lease on its record that
+ * each of its requests renews. Once it lapses the record is dropped, so the
+ * table only grows with the clients seen in the last rifl-lease-time
+ * seconds. */
+struct riflClient {
+    long long clientId;         /* Dict key. */
+    long long processedRpcId;   /* Highest requestId executed. */
+    time_t leaseExpire;         /* Renewed by every request of the client. */
+    time_t listedAt;            /* When it was (re)queued in riflLeases. */
+};
 
-/* 0th index is not used. */
-long long processedRpcIds[RIFL_TABLE_SIZE] = {0, };
-long long clientIds[RIFL_TABLE_SIZE] = {0, };
-int bitmask = RIFL_TABLE_SIZE - 1;
+static dict *riflClients = NULL;  /* clientId -> struct riflClient. */
+/* Every record, in the order it was queued. As leases have the same length,
+ * the records at the head are the first ones to expire. A renewed record is
+ * moved to the tail when the GC finds it at the head. */
+static list *riflLeases = NULL;
 bool witnessRecoveryMode = false; /* Don't bump processedRpcId while recovery */
 
+static unsigned int dictRiflHash(const void *key) {
+    return dictGenHashFunction(key, sizeof(long long));
+}
+
+static int dictRiflCompare(void *privdata, const void *key1, const void *key2) {
+    UNUSED(privdata);
+    return *(const long long *)key1 == *(const long long *)key2;
+}
+
+/* Records are freed by the GC, which owns riflLeases. */
+static dictType riflDictType = {
+    dictRiflHash,               /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictRiflCompare,            /* key compare */
+    NULL,                       /* key destructor */
+    NULL                        /* val destructor */
+};
+
 /*================================= Functions =============================== */
-bool riflCheckClientIdOk(client *c) {
-    if (clientIds[c->clientId & bitmask]) {
-        return clientIds[c->clientId & bitmask] == c->clientId;
+
+void riflInit(void) {
+    riflClients = dictCreate(&riflDictType, NULL);
+    riflLeases = listCreate();
+}
+
+static time_t riflLeaseEnd(void) {
+    return server.rifl_lease_time ? server.unixtime + server.rifl_lease_time : 0;
+}
+
+static struct riflClient *riflLookup(long long clientId) {
+    return dictFetchValue(riflClients, &clientId);
+}
+
+static struct riflClient *riflLookupOrCreate(long long clientId) {
+    struct riflClient *rc = riflLookup(clientId);
+    if (rc == NULL) {
+        rc = zmalloc(sizeof(*rc));
+        rc->clientId = clientId;
+        rc->processedRpcId = 0;
+        rc->listedAt = server.unixtime;
+        dictAdd(riflClients, &rc->clientId, rc);
+        listAddNodeTail(riflLeases, rc);
     }
-    clientIds[c->clientId & bitmask] = c->clientId;
-    return true;
+    rc->leaseExpire = riflLeaseEnd();
+    return rc;
+}
+
+/* Record that processedRpcId of clientId executed, as read from an RDB. */
+void riflLoadRecord(long long clientId, long long processedRpcId) {
+    struct riflClient *rc = riflLookupOrCreate(clientId);
+    if (processedRpcId > rc->processedRpcId)
+        rc->processedRpcId = processedRpcId;
+}
+
+/* Drop every record, before the table is loaded again from an RDB or AOF
+ * that replaces the dataset, so that it holds what the file holds. */
+void riflEmpty(void) {
+    listNode *ln;
+
+    while ((ln = listFirst(riflLeases)) != NULL) {
+        zfree(listNodeValue(ln));
+        listDelNode(riflLeases, ln);
+    }
+    dictEmpty(riflClients, NULL);
+}
+
+/* Return false if we don't know the client and requestId is not its first
+ * request. Its lease expired and its record was dropped, so we can't tell
+ * whether the request executed already: it must start over with a new
+ * clientId. */
+bool riflCheckLease(long long clientId, long long requestId) {
+    return requestId <= 1 || server.rifl_lease_time == 0 ||
+           riflLookup(clientId) != NULL;
 }
 
 bool riflCheckDuplicate(long long clientId, long long requestId) {
@@ -42,49 +119,162 @@ bool riflCheckDuplicate(long long clientId, long long requestId) {
         return false;
     }
 
-    int index = clientId & bitmask;
-    if (processedRpcIds[index] >= requestId) {
-//        serverLog(LL_NOTICE,"RIFL found duplicate. ClientId: %lld, requestId: %lld, lastRpcId: %lld", clientIds[index], requestId, processedRpcIds[index]);
+    struct riflClient *rc = riflLookupOrCreate(clientId);
+    if (rc->processedRpcId >= requestId) {
         return true;
     }
     if (!witnessRecoveryMode) {
-        processedRpcIds[index] = requestId;
+        rc->processedRpcId = requestId;
     }
     return false;
 }
 
-void riflPrintData() {
-    serverLog(LL_NOTICE,"RIFL Table dump after recovery.");
-    for (int i = 0; i < RIFL_TABLE_SIZE; ++i) {
-        if (clientIds[i] != 0) {
-            serverLog(LL_NOTICE,"ClientId: %lld, lastRpcId: %lld", clientIds[i], processedRpcIds[i]);
+/* Drop the records whose lease expired. Called by serverCron(): it visits
+ * at most RIFL_GC_MAX_VISITS records per call, and each record is moved to
+ * the tail at most once per lease period, so the work is proportional to
+ * the number of clients that come and go. */
+void riflCron(void) {
+    listNode *ln;
+    int visits = 0;
+
+    /* Recovery relies on the records of clients that may be idle. */
+    if (server.rifl_lease_time == 0 || witnessRecoveryMode || server.loading)
+        return;
+    while ((ln = listFirst(riflLeases)) != NULL && visits++ < RIFL_GC_MAX_VISITS) {
+        struct riflClient *rc = listNodeValue(ln);
+
+        /* Anything queued after this one was renewed later. */
+        if (rc->listedAt + server.rifl_lease_time > server.unixtime) break;
+        listDelNode(riflLeases, ln);
+        if (rc->leaseExpire > server.unixtime) {
+            rc->listedAt = server.unixtime;
+            listAddNodeTail(riflLeases, rc);
+        } else {
+            dictDelete(riflClients, &rc->clientId);
+            zfree(rc);
+            server.stat_rifl_expired_clients++;
         }
     }
 }
 
+unsigned long riflClientCount(void) {
+    return dictSize(riflClients);
+}
+
+/* Iterate the records, in no particular order. Each step is O(1), and the
+ * table must not change meanwhile (the AOF rewrite child iterates its own
+ * copy). */
+void riflRewind(riflIterator *it) {
+    listRewind(riflLeases, &it->li);
+}
+
+bool riflNext(riflIterator *it, long long *clientId, long long *processedRpcId) {
+    listNode *ln = listNext(&it->li);
+    if (ln == NULL) return false;
+    struct riflClient *rc = listNodeValue(ln);
+    *clientId = rc->clientId;
+    *processedRpcId = rc->processedRpcId;
+    return true;
+}
+
 void riflStartRecoveryByWitness() {
     witnessRecoveryMode = true;
-    riflPrintData();
+    serverLog(LL_NOTICE,"RIFL table holds %lu clients before recovery.",
+        riflClientCount());
 }
 
 void riflEndRecoveryByWitness() {
     witnessRecoveryMode = false;
-    riflPrintData();
+    serverLog(LL_NOTICE,"RIFL table holds %lu clients after recovery.",
+        riflClientCount());
+}
+
+/* Read-only version of riflCheckDuplicate(). */
+bool riflIsProcessed(long long clientId, long long requestId) {
+    struct riflClient *rc = clientId != 0 ? riflLookup(clientId) : NULL;
+    return rc != NULL && rc->processedRpcId >= requestId;
 }
 
-long long riflGetNext(long long clientId) {
-    int index = (clientId + 1) & bitmask;
-    while (index < RIFL_TABLE_SIZE) {
-        if (clientIds[index]) {
-            return clientIds[index];
+/* DEBUG RIFL [LOG]
+ * Reply with the clientId and last executed requestId of every RIFL client,
+ * or with LOG write them to the server log instead. */
+void riflDebugCommand(client *c) {
+    int log = c->argc > 2 && !strcasecmp(c->argv[2]->ptr,"log");
+    long long clientId, processedRpcId;
+    riflIterator it;
+
+    if (c->argc > 3 || (c->argc == 3 && !log)) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    if (!log) addReplyMultiBulkLen(c,riflClientCount()*2);
+    riflRewind(&it);
+    while (riflNext(&it, &clientId, &processedRpcId)) {
+        if (log) {
+            serverLog(LL_NOTICE,"ClientId: %lld, lastRpcId: %lld",
+                clientId, processedRpcId);
+        } else {
+            addReplyLongLong(c,clientId);
+            addReplyLongLong(c,processedRpcId);
         }
-        ++index;
     }
-    return -1; // End of table.
+    if (log) addReply(c,shared.ok);
 }
 
-long long riflGetprocessedRpcId(long long clientId) {
-    int index = clientId & bitmask;
-    assert(clientIds[index] == clientId);
-    return processedRpcIds[index];
-}
\ No newline at end of file
+/* A client in RIFL mode appends its clientId and the requestId, both in
+ * base64, to every at most once command. Parse them into c->clientId and
+ * c->requestId and remove them from argv, so that command implementations
+ * and key lookups only see the command itself. Returns false if they are
+ * missing or malformed. */
+bool riflStripRequestIds(client *c) {
+    long long clientId, requestId;
+
+    if (c->argc < 3 ||
+        getLongLongFromObjectInBase64(c->argv[c->argc-2], &clientId) != C_OK ||
+        getLongLongFromObjectInBase64(c->argv[c->argc-1], &requestId) != C_OK ||
+        clientId < 0 || requestId < 0 || (clientId == 0 && requestId != 0))
+        return false;
+
+    decrRefCount(c->argv[c->argc-1]);
+    decrRefCount(c->argv[c->argc-2]);
+    c->argc -= 2;
+    c->clientId = clientId;
+    c->requestId = requestId;
+    return true;
+}
+
+/* Feed "RIFL <clientId> <requestId>" to the AOF and / or the slaves, ahead
+ * of the command that carried these ids. */
+void riflPropagate(int dbid, long long clientId, long long requestId, int target) {
+    char buf[2][24];
+    int len[2];
+    robj *argv[3];
+
+    len[0] = ulltoa64(buf[0], sizeof(buf[0]), clientId);
+    len[1] = ulltoa64(buf[1], sizeof(buf[1]), requestId);
+    argv[0] = createStringObject("RIFL",4);
+    argv[1] = createStringObject(buf[0],len[0]);
+    argv[2] = createStringObject(buf[1],len[1]);
+    propagate(server.riflCommand,dbid,argv,3,target);
+    decrRefCount(argv[0]);
+    decrRefCount(argv[1]);
+    decrRefCount(argv[2]);
+}
+
+/* RIFL <clientId> <requestId>
+ * Mark the request as processed. This is how the AOF and the replication
+ * stream carry the RIFL table: the command a request executed is logged
+ * without its ids, right after one of these. */
+void riflCommand(client *c) {
+    long long clientId, requestId;
+
+    if (getLongLongFromObjectInBase64OrReply(c, c->argv[1], &clientId, NULL) != C_OK ||
+        getLongLongFromObjectInBase64OrReply(c, c->argv[2], &requestId, NULL) != C_OK)
+        return;
+    if (clientId <= 0) {
+        addReplyError(c,"invalid RIFL clientId");
+        return;
+    }
+    if (!riflCheckDuplicate(clientId, requestId)) server.dirty++;
+    addReply(c, shared.ok);
+}
@@ -15,13 +15,27 @@
  * Assumption: client only sends RPCs in order.
  * We can assume this since Redis uses TCP socket.
  */
-bool riflCheckClientIdOk(client *c);
+void riflInit(void);
+void riflCron(void);
+unsigned long riflClientCount(void);
+bool riflCheckLease(long long clientId, long long requestId);
 bool riflCheckDuplicate(long long clientId, long long requestId);
+bool riflStripRequestIds(client *c);
+void riflPropagate(int dbid, long long clientId, long long requestId, int target);
+bool riflIsProcessed(long long clientId, long long requestId);
 void riflStartRecoveryByWitness();
 void riflEndRecoveryByWitness();
 
+void riflDebugCommand(client *c);
+void riflLoadRecord(long long clientId, long long processedRpcId);
+void riflEmpty(void);
+
 /* Used for AOF rewrite. */
-long long riflGetNext(long long clientId);
-long long riflGetprocessedRpcId(long long clientId);
+typedef struct riflIterator {
+    listIter li;
+} riflIterator;
+
+void riflRewind(riflIterator *it);
+bool riflNext(riflIterator *it, long long *clientId, long long *processedRpcId);
 
 #endif
@@ -91,9 +91,10 @@ struct redisServer server; /* server global state */
  *           in MSET the step is two since arguments are key,val,key,val,...
  * microseconds: microseconds of total execution time for this command.
  * calls: total number of calls of this command.
+ * latency_histogram: execution time histogram, see LATENCY HISTOGRAM.
  *
  * The flags, microseconds and calls fields are computed by Redis and should
- * always be set to zero.
+ * always be set to zero, and latency_histogram to NULL.
  *
  * Command flags are expressed using strings where every character represents
  * a flag. Later the populateCommandTable() function will take care of
@@ -122,12 +123,15 @@ struct redisServer server; /* server global state */
  *    accepted in cluster mode if the slot is marked as 'importing'.
  * F: Fast command: O(1) or O(log(N)) command that should never delay
  *    its execution as long as the kernel scheduler is giving us time.
+ * O: At most once command: clients in RIFL mode append a clientId and a
+ *    requestId to it (see CLIENT RIFL). populateCommandTable() sets it on
+ *    every write command that has keys.
  *    Note that commands that may trigger a DEL as a side effect (like SET)
  *    are not fast commands.
  */
 struct redisCommand redisCommandTable[] = {
     {"get",getCommand,2,"rF",0,NULL,1,1,1,0,0},
-    {"set",setCommand,-5,"wmO",0,NULL,1,1,1,0,0},
+    {"set",setCommand,-3,"wm",0,NULL,1,1,1,0,0},
     {"setnx",setnxCommand,3,"wmF",0,NULL,1,1,1,0,0},
     {"setex",setexCommand,4,"wm",0,NULL,1,1,1,0,0},
     {"psetex",psetexCommand,4,"wm",0,NULL,1,1,1,0,0},
@@ -141,11 +145,11 @@ struct redisCommand redisCommandTable[] = {
     {"setrange",setrangeCommand,4,"wm",0,NULL,1,1,1,0,0},
     {"getrange",getrangeCommand,4,"r",0,NULL,1,1,1,0,0},
     {"substr",getrangeCommand,4,"r",0,NULL,1,1,1,0,0},
-    {"incr",incrCommand,4,"wmFO",0,NULL,1,1,1,0,0},
+    {"incr",incrCommand,2,"wmF",0,NULL,1,1,1,0,0},
     {"decr",decrCommand,2,"wmF",0,NULL,1,1,1,0,0},
     {"mget",mgetCommand,-2,"r",0,NULL,1,-1,1,0,0},
     {"rpush",rpushCommand,-3,"wmF",0,NULL,1,1,1,0,0},
-    {"lpush",lpushCommand,-5,"wmFO",0,NULL,1,1,1,0,0},
+    {"lpush",lpushCommand,-3,"wmF",0,NULL,1,1,1,0,0},
     {"rpushx",rpushxCommand,3,"wmF",0,NULL,1,1,1,0,0},
     {"lpushx",lpushxCommand,3,"wmF",0,NULL,1,1,1,0,0},
     {"linsert",linsertCommand,5,"wm",0,NULL,1,1,1,0,0},
@@ -200,7 +204,7 @@ struct redisCommand redisCommandTable[] = {
     {"hset",hsetCommand,4,"wmF",0,NULL,1,1,1,0,0},
     {"hsetnx",hsetnxCommand,4,"wmF",0,NULL,1,1,1,0,0},
     {"hget",hgetCommand,3,"rF",0,NULL,1,1,1,0,0},
-    {"hmset",hmsetCommand,-6,"wmO",0,NULL,1,1,1,0,0},
+    {"hmset",hmsetCommand,-4,"wm",0,NULL,1,1,1,0,0},
     {"hmget",hmgetCommand,-3,"r",0,NULL,1,1,1,0,0},
     {"hincrby",hincrbyCommand,4,"wmF",0,NULL,1,1,1,0,0},
     {"hincrbyfloat",hincrbyfloatCommand,4,"wmF",0,NULL,1,1,1,0,0},
@@ -300,9 +304,16 @@ struct redisCommand redisCommandTable[] = {
     {"post",securityWarningCommand,-1,"lt",0,NULL,0,0,0,0,0},
     {"host:",securityWarningCommand,-1,"lt",0,NULL,0,0,0,0,0},
     {"latency",latencyCommand,-2,"aslt",0,NULL,0,0,0,0,0},
-    {"wrecord",wrecordCommand,7,"wm",0,NULL,0,0,0,0,0},
-    {"wgc",witnessGcCommand,-5,"wm",0,NULL,0,0,0,0,0},
-    {"wgetrecoverydata",witnessGetRecoveryDataCommand,2,"wm",0,NULL,0,0,0,0,0}
+    {"timetrace",timetraceCommand,2,"aslt",0,NULL,0,0,0,0,0},
+    {"wrecord",wrecordCommand,-2,"wm",0,NULL,0,0,0,0,0},
+    {"replaydone",replaydoneCommand,1,"F",0,NULL,0,0,0,0,0},
+    {"curpsync",curpsyncCommand,2,"F",0,NULL,0,0,0,0,0},
+    {"rifl",riflCommand,3,"wlF",0,NULL,0,0,0,0,0},
+    {"wmrecord",wmrecordCommand,-2,"wm",0,NULL,0,0,0,0,0},
+    {"wgc",witnessGcCommand,-2,"wm",0,NULL,0,0,0,0,0},
+    {"wgetrecoverydata",witnessGetRecoveryDataCommand,2,"wm",0,NULL,0,0,0,0,0},
+    {"wconfig",wconfigCommand,1,"F",0,NULL,0,0,0,0,0},
+    {"wregister",wregisterCommand,2,"wmF",0,NULL,0,0,0,0,0}
 };
 
 struct evictionPoolEntry *evictionPoolAlloc(void);
@@ -655,6 +666,17 @@ dictType migrateCacheDictType = {
     NULL                        /* val destructor */
 };
 
+/* Keys modified by operations the AOF didn't fsync yet (see db.c). Values
+ * are zmalloc'ed unsyncedKey structures. */
+dictType unsyncedKeysDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictVanillaFree             /* val destructor */
+};
+
 /* Replication cached script dict (server.repl_scriptcache_dict).
  * Keys are sds SHA1 strings, while values are not used at all in the current
  * implementation. */
@@ -1176,6 +1198,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Handle background operations on Redis databases. */
     databasesCron();
 
+    /* Forget the RIFL clients whose lease expired. */
+    riflCron();
+
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
     if (server.rdb_child_pid == -1 && server.aof_child_pid == -1 &&
@@ -1294,20 +1319,19 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
         migrateCloseTimedoutSockets();
     }
 
+    /* Adapt the witness GC batch size to the current load. */
+    run_with_period(100) {
+        if (server.numWitness > 0) witnessBatchCron();
+    }
+
+    /* Reconnect to the witnesses we lost. */
     run_with_period(1000) {
-        /* If server haven't received client's replay request for a while,
-         * assume completion of recover and start normal processing. */
-        // TODO(seojin): check recovered by witness. And don't wait if
-        // recovered by witness.
-        if (server.serverState == SERVER_STATE_ACCEPTING_REPLAY &&
-                server.unixtime - server.last_client_replay > SECONDS_WAITING_REPLAY) {
-            server.serverState = SERVER_STATE_NORMAL;
-            riflEndRecoveryByWitness();
-            serverLog(LL_NOTICE,"Recovery finished (recovered %lld operations). "
-                    "Started to take normal requests.", server.currentOpNum);
-        }
+        if (server.numWitness > 0) witnessClientCron();
     }
 
+    /* Replay timeouts. */
+    checkReplayComplete();
+
     /* Start a scheduled BGSAVE if the corresponding flag is set. This is
      * useful when we are forced to postpone a BGSAVE because an AOF
      * rewrite is in progress.
@@ -1328,6 +1352,79 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     return 1000/server.hz;
 }
 
+/* Leave SERVER_STATE_ACCEPTING_REPLAY as soon as every completed operation
+ * is known to be back:
+ *  - if a witness gave us its records, it holds every completed unsynced
+ *    operation, so we only wait for the recovering clients already connected
+ *    to send REPLAYDONE;
+ *  - otherwise we wait for replay-quorum clients to send REPLAYDONE;
+ *  - without a recovery port nobody can replay, so there is nothing to wait;
+ *  - and in any case we stop waiting SECONDS_WAITING_REPLAY seconds after the
+ *    last replayed request (plus some slack at boot). */
+void checkReplayComplete(void) {
+    char *reason = NULL;
+
+    if (server.serverState != SERVER_STATE_ACCEPTING_REPLAY ||
+        !server.witness_recovery_done) return;
+
+    if (server.portForRecovery == 0) {
+        reason = "no recovery port";
+    } else if (server.recovered_by_witness && server.replay_clients_pending == 0) {
+        reason = "witness";
+    } else if (server.replay_quorum > 0 && server.replay_clients_pending == 0 &&
+               server.replay_clients_done >= server.replay_quorum) {
+        reason = "replay quorum";
+    } else if (server.unixtime - server.last_client_replay > SECONDS_WAITING_REPLAY) {
+        reason = "replay timeout";
+    }
+    if (reason == NULL) return;
+
+    server.serverState = SERVER_STATE_NORMAL;
+    server.recovery_end_time = ustime();
+    server.recovery_end_reason = reason;
+    riflEndRecoveryByWitness();
+    serverLog(LL_NOTICE,"Recovery finished (recovered %lld operations, "
+            "%d clients replayed, ended by %s). Started to take normal "
+            "requests.", server.currentOpNum, server.replay_clients_done, reason);
+    serverLog(LL_NOTICE,"Recovery phases: load %lld ms, witness %lld ms, "
+            "client replay %lld ms, total %lld ms.",
+            (server.recovery_loaded_time - server.recovery_start_time) / 1000,
+            (server.recovery_witness_time - server.recovery_loaded_time) / 1000,
+            (server.recovery_end_time - server.recovery_witness_time) / 1000,
+            (server.recovery_end_time - server.recovery_start_time) / 1000);
+}
+
+/* REPLAYDONE
+ * Sent by a recovering client on the recovery port once it replayed all the
+ * requests it had in flight. */
+void replaydoneCommand(client *c) {
+    if (!c->isRecovery) {
+        addReplyError(c,"REPLAYDONE is only valid on a recovery connection");
+        return;
+    }
+    if (!c->replayDone && server.serverState == SERVER_STATE_ACCEPTING_REPLAY) {
+        c->replayDone = true;
+        server.replay_clients_pending--;
+        server.replay_clients_done++;
+        checkReplayComplete();
+    }
+    addReply(c,shared.ok);
+}
+
+/* CURPSYNC <opNum>
+ * Sent by a CURP client whose update was rejected by a witness: replies +OK
+ * once the operations up to opNum (as in the CURP envelope) are synced.
+ * processCommand() holds the reply as for a read of unsynced data. */
+void curpsyncCommand(client *c) {
+    long long opNum;
+
+    if (getLongLongFromObjectOrReply(c,c->argv[1],&opNum,NULL) != C_OK)
+        return;
+    if (opNum > server.currentOpNum) opNum = server.currentOpNum;
+    if (opNum > server.unsynced_read_opNum) server.unsynced_read_opNum = opNum;
+    addReply(c,shared.ok);
+}
+
 /* This function gets called every time Redis is entering the
  * main loop of the event driven library, that is, before to sleep
  * for ready file descriptors. */
@@ -1345,6 +1442,10 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     if (server.active_expire_enabled && server.masterhost == NULL)
         activeExpireCycle(ACTIVE_EXPIRE_CYCLE_FAST);
 
+    /* Remember where the operations of this iteration end in the
+     * replication stream, before the GETACK below. */
+    replicationTrackCurpOpNum();
+
     /* Send all the slaves an ACK request if at least one client blocked
      * during the previous event loop iteration. */
     if (server.get_ack_from_slaves) {
@@ -1372,6 +1473,12 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     /* Write the AOF buffer on disk */
     flushAppendOnlyFile(0);
 
+    /* GC witnesses for the RPCs written above, if the batch is due. */
+    if (server.numWitness > 0) {
+        flushUnsyncedRpcsIfNeeded();
+        witnessClientSendDueGcs();
+    }
+
     /* Handle writes with pending output buffers. */
     handleClientsWithPendingWrites();
 }
@@ -1467,8 +1574,7 @@ void createSharedObjects(void) {
     shared.minstring = createStringObject("minstring",9);
     shared.maxstring = createStringObject("maxstring",9);
     shared.riflDuplicate = createObject(OBJ_STRING,sdsnew("+OK (RIFL duplicate)\r\n"));
-    shared.riflClientIdCollision = createObject(OBJ_STRING,sdsnew("-ERR (RIFL clientId collision)\r\n"));
-    shared.unsyncedOk = createObject(OBJ_STRING,sdsnew("@OK "));
+    shared.riflLeaseExpired = createObject(OBJ_STRING,sdsnew("-RIFLEXPIRED the lease of this RIFL clientId expired, use a new clientId\r\n"));
     shared.witnessReject = createObject(OBJ_STRING,sdsnew("+REJECT\r\n"));
     shared.witnessAccept = createObject(OBJ_STRING,sdsnew("+ACCEPT\r\n"));
 }
@@ -1485,6 +1591,8 @@ void initServerConfig(void) {
     server.currentOpNum = 0;
     server.port = CONFIG_DEFAULT_SERVER_PORT;
     server.portForRecovery = CONFIG_DEFAULT_RECOVERY_PORT;
+    server.replay_quorum = CONFIG_DEFAULT_REPLAY_QUORUM;
+    server.rifl_lease_time = CONFIG_DEFAULT_RIFL_LEASE_TIME;
     server.last_client_connected_usec = 0;
     server.last_client_connected_opNum = 0;
     server.tcp_backlog = CONFIG_DEFAULT_TCP_BACKLOG;
@@ -1511,7 +1619,8 @@ void initServerConfig(void) {
     server.supervised_mode = SUPERVISED_NONE;
     server.aof_state = AOF_OFF;
     server.aof_fsync = CONFIG_DEFAULT_AOF_FSYNC;
-    server.must_aof_fsync = false;
+    server.unsynced_read_opNum = 0;
+    server.unsynced_write_conflict = 0;
     server.aof_no_fsync_on_rewrite = CONFIG_DEFAULT_AOF_NO_FSYNC_ON_REWRITE;
     server.aof_rewrite_perc = AOF_REWRITE_PERC;
     server.aof_rewrite_min_size = AOF_REWRITE_MIN_SIZE;
@@ -1528,6 +1637,17 @@ void initServerConfig(void) {
     server.aof_rewrite_incremental_fsync = CONFIG_DEFAULT_AOF_REWRITE_INCREMENTAL_FSYNC;
     server.aof_load_truncated = CONFIG_DEFAULT_AOF_LOAD_TRUNCATED;
     server.aof_last_fsync_opNum = 0;
+    server.aof_written_opNum = 0;
+    server.witness_table_entries = CONFIG_DEFAULT_WITNESS_TABLE_ENTRIES;
+    server.witness_associativity = CONFIG_DEFAULT_WITNESS_ASSOCIATIVITY;
+    server.witness_commutativity = CONFIG_DEFAULT_WITNESS_COMMUTATIVITY;
+    server.sync_on_write_conflict = CONFIG_DEFAULT_SYNC_ON_WRITE_CONFLICT;
+    server.curp_sync_replicas = CONFIG_DEFAULT_CURP_SYNC_REPLICAS;
+    server.witness_master_id = CONFIG_DEFAULT_WITNESS_MASTER_ID;
+    server.witness_batch_max_age = CONFIG_DEFAULT_WITNESS_BATCH_MAX_AGE;
+    server.witness_fsync_rate = CONFIG_DEFAULT_WITNESS_FSYNC_RATE;
+    server.witness_batch_max_occupancy = CONFIG_DEFAULT_WITNESS_BATCH_MAX_OCCUPANCY;
+    server.witness_binary_protocol = CONFIG_DEFAULT_WITNESS_BINARY_PROTOCOL;
     server.pidfile = NULL;
     server.rdb_filename = zstrdup(CONFIG_DEFAULT_RDB_FILENAME);
     server.aof_filename = zstrdup(CONFIG_DEFAULT_AOF_FILENAME);
@@ -1623,6 +1743,7 @@ void initServerConfig(void) {
     server.rpopCommand = lookupCommandByCString("rpop");
     server.sremCommand = lookupCommandByCString("srem");
     server.execCommand = lookupCommandByCString("exec");
+    server.riflCommand = lookupCommandByCString("rifl");
 
     /* Slow log */
     server.slowlog_log_slower_than = CONFIG_DEFAULT_SLOWLOG_LOG_SLOWER_THAN;
@@ -1875,6 +1996,10 @@ void resetServerStats(void) {
     server.stat_fork_time = 0;
     server.stat_fork_rate = 0;
     server.stat_rejected_conn = 0;
+    server.stat_fsync_waits = 0;
+    server.stat_group_fsyncs = 0;
+    server.stat_write_conflicts = 0;
+    server.stat_rifl_expired_clients = 0;
     server.stat_sync_full = 0;
     server.stat_sync_partial_ok = 0;
     server.stat_sync_partial_err = 0;
@@ -1888,6 +2013,7 @@ void resetServerStats(void) {
     server.stat_net_input_bytes = 0;
     server.stat_net_output_bytes = 0;
     server.aof_delayed_fsync = 0;
+    resetWitnessBatchStats();
 }
 
 void initServer(void) {
@@ -1913,6 +2039,7 @@ void initServer(void) {
     server.unblocked_clients = listCreate();
     server.ready_keys = listCreate();
     server.clients_waiting_acks = listCreate();
+    server.clients_waiting_fsync = listCreate();
     server.get_ack_from_slaves = 0;
     server.clients_paused = 0;
     server.system_memory_size = zmalloc_get_memory_size();
@@ -1920,6 +2047,8 @@ void initServer(void) {
     createSharedObjects();
     adjustOpenFilesLimit();
     server.el = aeCreateEventLoop(server.maxclients+CONFIG_FDSET_INCR);
+    riflInit();
+    aofInitGroupCommit();
     server.db = zmalloc(sizeof(redisDb)*server.dbnum);
 
     /* Open the TCP listening socket for the user commands. */
@@ -1956,6 +2085,9 @@ void initServer(void) {
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&setDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
+        server.db[j].unsynced_keys[0] = dictCreate(&unsyncedKeysDictType,NULL);
+        server.db[j].unsynced_keys[1] = dictCreate(&unsyncedKeysDictType,NULL);
+        server.db[j].unsynced_flush_opNum = 0;
         server.db[j].eviction_pool = evictionPoolAlloc();
         server.db[j].id = j;
         server.db[j].avg_ttl = 0;
@@ -1987,7 +2119,13 @@ void initServer(void) {
     server.aof_last_write_errno = 0;
     server.repl_good_slaves_count = 0;
     updateCachedTime();
-    server.last_client_replay = server.unixtime + 5; // give extra 5 secs for bootstrapping.
+    server.last_client_replay = server.unixtime + SECONDS_BOOT_REPLAY_SLACK;
+    server.replay_clients_pending = 0;
+    server.replay_clients_done = 0;
+    server.witness_recovery_done = false;
+    server.recovered_by_witness = false;
+    server.recovery_end_reason = NULL;
+    server.recovery_start_time = server.recovery_loaded_time = ustime();
 
     /* Create the serverCron() time event, that's our main way to process
      * background operations. */
@@ -2046,7 +2184,10 @@ void initServer(void) {
     bioInit();
     witnessInit();
 
-    /* Connect to witness servers */
+    /* Connect to witness servers. Until a witness tells us otherwise, assume
+     * it has the geometry we are configured with. */
+    server.witnessTableSlots = server.witness_table_entries *
+                               server.witness_associativity;
     connectToWitness();
 }
 
@@ -2081,6 +2222,13 @@ void populateCommandTable(void) {
             }
             f++;
         }
+        /* Writes to keys are recorded to the witnesses and must run at most
+         * once. Blocking commands are left out: their replay would block a
+         * recovery client, and they complete outside of call(). */
+        if (c->flags & CMD_WRITE && (c->getkeys_proc || c->firstkey > 0) &&
+            c->proc != blpopCommand && c->proc != brpopCommand &&
+            c->proc != brpoplpushCommand)
+            c->flags |= CMD_AT_MOST_ONCE;
 
         retval1 = dictAdd(server.commands, sdsnew(c->name), c);
         /* Populate an additional dictionary that will be unaffected
@@ -2099,6 +2247,7 @@ void resetCommandTableStats(void) {
 
         c->microseconds = 0;
         c->calls = 0;
+        latencyHistogramReset(c->latency_histogram);
     }
 }
 
@@ -2280,6 +2429,7 @@ void preventCommandReplication(client *c) {
  */
 void call(client *c, int flags) {
     long long dirty, start, duration;
+    uint64_t startCycles;
     int client_old_flags = c->flags;
 
     /* Sent the command to clients in MONITOR mode, only if the commands are
@@ -2299,36 +2449,54 @@ void call(client *c, int flags) {
     /* Call the command. */
     dirty = server.dirty;
     start = ustime();
+    startCycles = rdtsc();
 
     // RIFL check.
-    if (c->cmd->flags & CMD_AT_MOST_ONCE) {
-//        record("Starting preprocessing for RIFL", 0, 0, 0, 0);
-        getLongLongFromObjectInBase64(c->argv[c->argc-2], &c->clientId);
-        getLongLongFromObjectInBase64(c->argv[c->argc-1], &c->requestId);
-
-//        serverLog(LL_NOTICE,"clientId: %lld, requestId: %lld", c->clientId, c->requestId);
-
-//        record("Parsing for RIFL", 0, 0, 0, 0);
-        if (!riflCheckClientIdOk(c)) {
-            addReply(c, shared.riflClientIdCollision);
+    if (c->clientId != 0) {
+        if (!c->isRecovery && !riflCheckLease(c->clientId, c->requestId)) {
+            addReply(c, shared.riflLeaseExpired);
             return;
         }
         if (riflCheckDuplicate(c->clientId, c->requestId)){
+            /* We don't know when it executed, but not after now. */
+            if (!(c->flags & CLIENT_MULTI))
+                addReplyCurpHeader(c, server.currentOpNum);
             addReply(c, shared.riflDuplicate);
             return;
         }
-//        record("RIFL check completed", 0, 0, 0, 0);
     }
-    if (c->cmd->proc != selectCommand && c->cmd->flags & CMD_WRITE) {
+    /* Must run before the command updates the opNum of its keys. */
+    if (c->cmd->flags & CMD_WRITE && server.sync_on_write_conflict &&
+        server.aof_last_fsync_opNum < server.currentOpNum) {
+        checkUnsyncedWriteConflict(c);
+    }
+    /* RIFL only replays the ids of the command that follows it. */
+    if (c->cmd->proc != selectCommand && c->cmd != server.riflCommand &&
+        c->cmd->flags & CMD_WRITE) {
         ++server.currentOpNum;
     }
+    /* Hash the keys before the command may rewrite its arguments. */
+    int *witnessKeyHashes = NULL, witnessNumKeys = 0;
+    if (c->clientId != 0 && server.numWitness > 0)
+        witnessKeyHashes = unsyncedRpcKeyHashes(c, &witnessNumKeys);
+    /* Replies inside EXEC are elements of its multi bulk reply, and are
+     * left alone. */
+    size_t curpHeaderLen = 0;
+    if (c->clientId != 0 && !(c->flags & CLIENT_MULTI))
+        curpHeaderLen = addReplyCurpHeader(c, server.currentOpNum);
     c->cmd->proc(c);
 
-//    record("Executed command", 0, 0, 0, 0);
+    /* A command that blocked did not complete: it gets no envelope, and
+     * there is nothing to track yet. */
+    if (c->flags & CLIENT_BLOCKED) {
+        discardReplyTail(c, curpHeaderLen);
+        if (witnessKeyHashes) getKeysFreeResult(witnessKeyHashes);
+        witnessKeyHashes = NULL;
+    }
+
     // Track unsynced change.
-    if (c->cmd->flags & CMD_AT_MOST_ONCE && server.numWitness > 0) {
-        trackUnsyncedRpc(c);
-//        record("Tracked unsyncedRPC", 0, 0, 0, 0);
+    if (witnessKeyHashes) {
+        trackUnsyncedRpc(c, witnessKeyHashes, witnessNumKeys);
     }
 
     duration = ustime()-start;
@@ -2361,6 +2529,18 @@ void call(client *c, int flags) {
     if (flags & CMD_CALL_STATS) {
         c->lastcmd->microseconds += duration;
         c->lastcmd->calls++;
+        latencyHistogramAddCycles(&c->lastcmd->latency_histogram,
+                                  rdtsc()-startCycles);
+    }
+
+    /* Log the RIFL ids of the command ahead of it, so that the AOF and the
+     * slaves know it was processed even if it had no effect, or only the
+     * effects it propagated with alsoPropagate(). */
+    if (c->clientId != 0 && flags & CMD_CALL_PROPAGATE) {
+        int target = PROPAGATE_NONE;
+        if (flags & CMD_CALL_PROPAGATE_AOF) target |= PROPAGATE_AOF;
+        if (flags & CMD_CALL_PROPAGATE_REPL) target |= PROPAGATE_REPL;
+        riflPropagate(c->db->id, c->clientId, c->requestId, target);
     }
 
     /* Propagate the command into the AOF and replication link */
@@ -2446,11 +2626,17 @@ int processCommand(client *c) {
     /* Now lookup the command and check ASAP about trivial error conditions
      * such as wrong arity, bad command name and so forth. */
     c->cmd = c->lastcmd = lookupCommand(c->argv[0]->ptr);
+    c->clientId = c->requestId = 0;
     if (!c->cmd) {
         flagTransaction(c);
         addReplyErrorFormat(c,"unknown command '%s'",
             (char*)c->argv[0]->ptr);
         return C_OK;
+    } else if (c->riflEnabled && c->cmd->flags & CMD_AT_MOST_ONCE &&
+               !riflStripRequestIds(c)) {
+        flagTransaction(c);
+        addReplyError(c,"missing or malformed RIFL ids");
+        return C_OK;
     } else if ((c->cmd->arity > 0 && c->cmd->arity != c->argc) ||
                (c->argc < -c->cmd->arity)) {
         flagTransaction(c);
@@ -2610,8 +2796,26 @@ int processCommand(client *c) {
         queueMultiCommand(c);
         addReply(c,shared.queued);
     } else {
+        server.unsynced_read_opNum = 0;
+        server.unsynced_write_conflict = 0;
         call(c,CMD_CALL_FULL);
         c->woff = server.master_repl_offset;
+        /* The reply shows data that could still be lost in a crash: hold
+         * it until the AOF is fsynced past it. A write that conflicts with
+         * an unsynced operation waits for its own fsync as well, since the
+         * witnesses may have rejected its record. Replication and replay
+         * don't need to wait. */
+        if (server.unsynced_write_conflict) {
+            server.unsynced_read_opNum = server.currentOpNum;
+            server.stat_write_conflicts++;
+        }
+        if (server.unsynced_read_opNum > server.aof_last_fsync_opNum &&
+            (server.aof_state == AOF_ON || curpSyncByReplicas()) &&
+            !c->isRecovery &&
+            !(c->flags & (CLIENT_MASTER|CLIENT_BLOCKED)))
+        {
+            blockClientForFsync(c,server.unsynced_read_opNum);
+        }
         if (listLength(server.ready_keys))
             handleClientsBlockedOnLists();
     }
@@ -3013,10 +3217,12 @@ sds genRedisInfoString(char *section) {
             "connected_clients:%lu\r\n"
             "client_longest_output_list:%lu\r\n"
             "client_biggest_input_buf:%lu\r\n"
-            "blocked_clients:%d\r\n",
+            "blocked_clients:%d\r\n"
+            "fsync_waiting_clients:%lu\r\n",
             listLength(server.clients)-listLength(server.slaves),
             lol, bib,
-            server.bpop_blocked_clients);
+            server.bpop_blocked_clients,
+            listLength(server.clients_waiting_fsync));
     }
 
     /* Memory */
@@ -3181,6 +3387,12 @@ sds genRedisInfoString(char *section) {
             "instantaneous_input_kbps:%.2f\r\n"
             "instantaneous_output_kbps:%.2f\r\n"
             "rejected_connections:%lld\r\n"
+            "fsync_waits:%lld\r\n"
+            "group_fsyncs:%lld\r\n"
+            "write_conflicts:%lld\r\n"
+            "unsynced_keys:%lu\r\n"
+            "rifl_clients:%lu\r\n"
+            "rifl_expired_clients:%lld\r\n"
             "sync_full:%lld\r\n"
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
@@ -3200,6 +3412,12 @@ sds genRedisInfoString(char *section) {
             (float)getInstantaneousMetric(STATS_METRIC_NET_INPUT)/1024,
             (float)getInstantaneousMetric(STATS_METRIC_NET_OUTPUT)/1024,
             server.stat_rejected_conn,
+            server.stat_fsync_waits,
+            server.stat_group_fsyncs,
+            server.stat_write_conflicts,
+            unsyncedKeyCount(),
+            riflClientCount(),
+            server.stat_rifl_expired_clients,
             server.stat_sync_full,
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
@@ -3366,6 +3584,34 @@ sds genRedisInfoString(char *section) {
         }
     }
 
+    /* Latency percentiles, from the histograms of LATENCY HISTOGRAM. */
+    if (allsections || !strcasecmp(section,"latencystats")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info, "# Latencystats\r\n");
+        numcommands = sizeof(redisCommandTable)/sizeof(struct redisCommand);
+        for (j = 0; j < numcommands; j++) {
+            struct redisCommand *c = redisCommandTable+j;
+            struct latencyHistogram *h = c->latency_histogram;
+
+            if (h == NULL || h->count == 0) continue;
+            info = sdscatprintf(info,
+                "latency_percentiles_nsec_%s:p50=%llu,p99=%llu,p99.9=%llu,"
+                "max=%llu\r\n", c->name,
+                (unsigned long long)latencyHistogramPercentile(h,50),
+                (unsigned long long)latencyHistogramPercentile(h,99),
+                (unsigned long long)latencyHistogramPercentile(h,99.9),
+                (unsigned long long)h->max);
+        }
+    }
+
+    /* Witness */
+    if (allsections || defsections || !strcasecmp(section,"witness")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscat(info,"# Witness\r\n");
+        info = genWitnessInfoString(info);
+        info = genWitnessTableInfoString(info);
+    }
+
     /* Cluster */
     if (allsections || defsections || !strcasecmp(section,"cluster")) {
         if (sections++) info = sdscat(info,"\r\n");
@@ -4173,7 +4419,9 @@ int main(int argc, char **argv) {
     #ifdef __linux__
         linuxMemoryWarnings();
     #endif
+        server.recovery_start_time = ustime();
         loadDataFromDisk();
+        server.recovery_loaded_time = ustime();
         if (server.cluster_enabled) {
             if (verifyClusterConfigWithData() == C_ERR) {
                 serverLog(LL_WARNING,
@@ -4192,7 +4440,11 @@ int main(int argc, char **argv) {
 
     // Call this only after AOF recovery.
     riflStartRecoveryByWitness();
-    recoverFromWitness();
+    server.recovered_by_witness = recoverFromWitness();
+    server.recovery_witness_time = ustime();
+    server.witness_recovery_done = true;
+    witnessClientStart();
+    checkReplayComplete();
 
     /* Warning the user about suspicious maxmemory setting. */
     if (server.maxmemory > 0 && server.maxmemory < 1024*1024) {
@@ -81,6 +81,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_MAX_HZ            500
 #define CONFIG_DEFAULT_SERVER_PORT        6379    /* TCP port */
 #define CONFIG_DEFAULT_RECOVERY_PORT      6380    /* TCP port for recovery*/
+#define CONFIG_DEFAULT_REPLAY_QUORUM      0
+#define CONFIG_DEFAULT_RIFL_LEASE_TIME    600     /* Seconds, 0 = never expire */
+#define RIFL_GC_MAX_VISITS 1000 /* RIFL records visited per riflCron() call. */
 #define CONFIG_DEFAULT_TCP_BACKLOG       511     /* TCP listen backlog */
 #define CONFIG_DEFAULT_CLIENT_TIMEOUT       0       /* default client timeout: infinite */
 #define CONFIG_DEFAULT_DBNUM     16
@@ -142,6 +145,19 @@ typedef long long mstime_t; /* millisecond time type. */
 #define CONFIG_MIN_RESERVED_FDS 32
 #define CONFIG_DEFAULT_LATENCY_MONITOR_THRESHOLD 0
 #define CONFIG_WITNESS_MAX 3
+#define CONFIG_DEFAULT_WITNESS_TABLE_ENTRIES 1024 /* Must be power of 2. */
+#define CONFIG_DEFAULT_WITNESS_ASSOCIATIVITY 4
+#define CONFIG_DEFAULT_WITNESS_MASTER_ID 1
+#define CONFIG_WITNESS_MAX_TABLE_ENTRIES (1<<24)
+#define CONFIG_WITNESS_MAX_ASSOCIATIVITY 64
+#define WITNESS_HANDSHAKE_TIMEOUT 1000 /* Milliseconds. */
+#define CONFIG_DEFAULT_WITNESS_BATCH_MAX_AGE 1000 /* Microseconds. */
+#define CONFIG_DEFAULT_WITNESS_FSYNC_RATE 1000 /* Fsyncs per second. */
+#define CONFIG_DEFAULT_WITNESS_BATCH_MAX_OCCUPANCY 25 /* Percent of table. */
+#define CONFIG_DEFAULT_WITNESS_BINARY_PROTOCOL 1
+#define CONFIG_DEFAULT_WITNESS_COMMUTATIVITY 1
+#define CONFIG_DEFAULT_SYNC_ON_WRITE_CONFLICT 1
+#define CONFIG_DEFAULT_CURP_SYNC_REPLICAS 0
 
 #define ACTIVE_EXPIRE_CYCLE_LOOKUPS_PER_LOOP 20 /* Loopkups per loop. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds */
@@ -283,6 +299,14 @@ typedef long long mstime_t; /* millisecond time type. */
 #define BLOCKED_NONE 0    /* Not blocked, no CLIENT_BLOCKED flag set. */
 #define BLOCKED_LIST 1    /* BLPOP & co. */
 #define BLOCKED_WAIT 2    /* WAIT for synchronous replication. */
+#define BLOCKED_FSYNC 3   /* Reply read unsynced data, wait for AOF fsync. */
+
+/* Operation classes of witness records, see witness.c */
+#define WITNESS_OP_OTHER 0          /* Conflicts with everything. */
+#define WITNESS_OP_COUNTER 1        /* INCR and friends. */
+#define WITNESS_OP_SET_ADD 2        /* SADD. */
+#define WITNESS_OP_HASH_WRITE 3     /* Sets hash fields. */
+#define WITNESS_OP_HASH_COUNTER 4   /* HINCRBY. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -449,6 +473,9 @@ typedef long long mstime_t; /* millisecond time type. */
 #define SECONDS_WAITING_REPLAY 2       /* server waits extra seconds after last
                                            client replay before swithing from
                         SERVER_STATE_ACCEPTING_REPLAY to SERVER_STATE_NORMAL. */
+#define SECONDS_BOOT_REPLAY_SLACK 5    /* Extra wait at boot for clients to
+                                          reconnect, when witnesses didn't
+                                          give us the unsynced requests. */
 
 /* Get the first bind addr or NULL */
 #define NET_FIRST_BIND_ADDR (server.bindaddr_count ? server.bindaddr[0] : NULL)
@@ -520,6 +547,8 @@ typedef struct redisDb {
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP) */
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
+    dict *unsynced_keys[2];     /* Keys modified by unsynced ops, see db.c */
+    long long unsynced_flush_opNum; /* opNum of the last flush of this DB */
     struct evictionPoolEntry *eviction_pool;    /* Eviction pool of keys */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
@@ -530,6 +559,8 @@ typedef struct multiCmd {
     robj **argv;
     int argc;
     struct redisCommand *cmd;
+    long long clientId;     /* RIFL ids stripped from argv, or 0. */
+    long long requestId;
 } multiCmd;
 
 typedef struct multiState {
@@ -555,6 +586,9 @@ typedef struct blockingState {
     /* BLOCKED_WAIT */
     int numreplicas;        /* Number of replicas we are waiting for ACK. */
     long long reploffset;   /* Replication offset to reach. */
+
+    /* BLOCKED_FSYNC */
+    long long fsyncopnum;   /* Operation number the AOF must fsync. */
 } blockingState;
 
 /* The following structure represents a node in the server.ready_keys list,
@@ -625,6 +659,8 @@ typedef struct client {
     long long clientId;     /* RIFL client id. */
     long long requestId;    /* RIFL request sequence number of current request.*/
     bool isRecovery;        /* Indicates this connection is for recovery. */
+    bool replayDone;        /* Recovery connection sent REPLAYDONE. */
+    bool riflEnabled;       /* At most once commands carry RIFL ids. */
     /* Response buffer */
     int bufpos;
     char buf[PROTO_REPLY_CHUNK_BYTES];
@@ -644,7 +680,7 @@ struct sharedObjectsStruct {
     *busykeyerr, *oomerr, *plus, *messagebulk, *pmessagebulk, *subscribebulk,
     *unsubscribebulk, *psubscribebulk, *punsubscribebulk, *del, *rpop, *lpop,
     *lpush, *emptyscan, *minstring, *maxstring,
-    *riflDuplicate, *riflClientIdCollision, *unsyncedOk,
+    *riflDuplicate, *riflLeaseExpired,
     *witnessReject, *witnessAccept,
     *select[PROTO_SHARED_SELECT_CMDS],
     *integers[OBJ_SHARED_INTEGERS],
@@ -741,6 +777,17 @@ struct redisServer {
     long long currentOpNum;     /* Operation number that we are working on. */
     int serverState;            /* State of server (accepting recovery, normal).*/
     time_t last_client_replay;  /* Unix time at which clients stopped sending replay */
+    int replay_clients_pending; /* Recovery connections without REPLAYDONE. */
+    int replay_clients_done;    /* Recovery connections that sent REPLAYDONE. */
+    int replay_quorum;          /* REPLAYDONEs that end the replay, 0 = off. */
+    long long rifl_lease_time;  /* Seconds a RIFL record outlives its client. */
+    bool witness_recovery_done; /* recoverFromWitness() returned. */
+    bool recovered_by_witness;  /* ... and got the data from a witness. */
+    long long recovery_start_time;   /* ustime() of the recovery phases. */
+    long long recovery_loaded_time;
+    long long recovery_witness_time;
+    long long recovery_end_time;
+    char *recovery_end_reason;  /* Why we left SERVER_STATE_ACCEPTING_REPLAY. */
     /* Networking */
     int port;                   /* TCP listening port */
     int portForRecovery;        /* TCP listening port for client replay */
@@ -770,6 +817,12 @@ struct redisServer {
     char *addrToWitness[CONFIG_WITNESS_MAX];
     int fdToWitness[CONFIG_WITNESS_MAX];
     int numWitness;
+    long long witness_master_id; /* Id we register with at the witnesses. */
+    long long witnessTableSlots; /* Smallest witness table (entries * assoc). */
+    long long witness_batch_max_age; /* Max usecs an RPC waits for witness GC. */
+    int witness_fsync_rate;     /* Target fsyncs per second, 0 = no target. */
+    int witness_batch_max_occupancy; /* % of witness table unsynced RPCs use. */
+    int witness_binary_protocol; /* Send WGC in binary form. */
     /* For throughput benchmark */
     unsigned long long last_client_connected_usec;
     long long last_client_connected_opNum;
@@ -781,7 +834,7 @@ struct redisServer {
     off_t loading_process_events_interval_bytes;
     /* Fast pointers to often looked up command */
     struct redisCommand *delCommand, *multiCommand, *lpushCommand, *lpopCommand,
-                        *rpopCommand, *sremCommand, *execCommand;
+                        *rpopCommand, *sremCommand, *execCommand, *riflCommand;
     /* Fields used only for stats */
     time_t stat_starttime;          /* Server start time */
     long long stat_numcommands;     /* Number of processed commands */
@@ -794,6 +847,10 @@ struct redisServer {
     long long stat_fork_time;       /* Time needed to perform latest fork() */
     double stat_fork_rate;          /* Fork rate in GB/sec. */
     long long stat_rejected_conn;   /* Clients rejected because of maxclients */
+    long long stat_fsync_waits;     /* Replies held until an AOF fsync. */
+    long long stat_group_fsyncs;    /* Fsyncs issued by the group commit. */
+    long long stat_write_conflicts; /* Writes held because of an unsynced key. */
+    long long stat_rifl_expired_clients; /* RIFL records dropped by the GC. */
     long long stat_sync_full;       /* Number of full resyncs with slaves. */
     long long stat_sync_partial_ok; /* Number of accepted PSYNC requests. */
     long long stat_sync_partial_err;/* Number of unaccepted PSYNC requests. */
@@ -826,7 +883,11 @@ struct redisServer {
     /* AOF persistence */
     int aof_state;                  /* AOF_(ON|OFF|WAIT_REWRITE) */
     int aof_fsync;                  /* Kind of fsync() policy */
-    bool must_aof_fsync;                  /* indicate this ae cycle need to fsync before responding to client. */
+    long long unsynced_read_opNum;  /* Newest unsynced op the current command read. */
+    int unsynced_write_conflict;    /* Current command wrote an unsynced key. */
+    int sync_on_write_conflict;     /* Hold replies of such writes until fsync. */
+    int curp_sync_replicas;         /* Sync by acks of N slaves, 0 = AOF. */
+    list *clients_waiting_fsync;    /* Clients parked in BLOCKED_FSYNC. */
     char *aof_filename;             /* Name of the AOF file */
     int aof_no_fsync_on_rewrite;    /* Don't fsync if a rewrite is in prog. */
     int aof_rewrite_perc;           /* Rewrite AOF if % growth is > M and... */
@@ -850,6 +911,12 @@ struct redisServer {
     int aof_last_write_errno;       /* Valid if aof_last_write_status is ERR */
     int aof_load_truncated;         /* Don't stop on unexpected AOF EOF. */
     _Atomic long long aof_last_fsync_opNum; /* Operation number up untill are fsynced */
+    long long aof_written_opNum;    /* Operation number up to which the AOF
+                                       buffer is written to the file. */
+    /* Witness */
+    long long witness_table_entries; /* Buckets per witnessed master. */
+    long long witness_associativity; /* Slots per bucket. */
+    int witness_commutativity;  /* Accept commuting records on one key. */
     /* AOF pipes used to communicate between parent and child during rewrite. */
     int aof_pipe_write_data_to_child;
     int aof_pipe_read_data_from_parent;
@@ -1031,6 +1098,7 @@ struct redisCommand {
     int lastkey;  /* The last argument that's a key */
     int keystep;  /* The step between first and last key */
     long long microseconds, calls;
+    struct latencyHistogram *latency_histogram; /* Created on first call. */
 };
 
 struct redisFunctionSym {
@@ -1105,6 +1173,7 @@ extern dictType shaScriptObjectDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
 extern dictType replScriptCacheDictType;
+extern dictType unsyncedKeysDictType;
 
 /*-----------------------------------------------------------------------------
  * Functions prototypes
@@ -1140,7 +1209,8 @@ void addReplyBulkCBuffer(client *c, const void *p, size_t len);
 void addReplyBulkLongLong(client *c, long long ll);
 void addReply(client *c, robj *obj);
 void addReplySds(client *c, sds s);
-void addReplyOkCgar(client *c);
+size_t addReplyCurpHeader(client *c, long long opNum);
+void discardReplyTail(client *c, size_t len);
 void addReplyBulkSds(client *c, sds s);
 void addReplyError(client *c, const char *err);
 void addReplyStatus(client *c, const char *status);
@@ -1282,7 +1352,11 @@ void replicationScriptCacheAdd(sds sha1);
 int replicationScriptCacheExists(sds sha1);
 void processClientsWaitingReplicas(void);
 void unblockClientWaitingReplicas(client *c);
+void replicationRequestAckFromSlaves(void);
 int replicationCountAcksByOffset(long long offset);
+int curpSyncByReplicas(void);
+void replicationTrackCurpOpNum(void);
+void replicationCurpAcksUpdated(void);
 void replicationSendNewlineToMaster(void);
 long long replicationGetSlaveOffset(void);
 char *replicationGetSlaveName(client *c);
@@ -1299,6 +1373,13 @@ void stopLoading(void);
 
 /* AOF persistence */
 void flushAppendOnlyFile(int force);
+void blockClientForFsync(client *c, long long opNum);
+void unblockClientWaitingFsync(client *c);
+void processClientsWaitingFsync(void);
+void aofInitGroupCommit(void);
+void aofRequestFsync(long long opNum);
+void aofFsyncDone(long long opNum);
+void aofSyncModeChanged(void);
 void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
 void aofRemoveTempFile(pid_t childpid);
 int rewriteAppendOnlyFileBackground(void);
@@ -1342,6 +1423,7 @@ unsigned long zslGetRank(zskiplist *zsl, double score, robj *o);
 /* Core functions */
 int freeMemoryIfNeeded(void);
 int processCommand(client *c);
+void checkReplayComplete(void);
 void setupSignalHandlers(void);
 struct redisCommand *lookupCommand(sds name);
 struct redisCommand *lookupCommandByCString(char *s);
@@ -1440,6 +1522,7 @@ int expireIfNeeded(redisDb *db, robj *key);
 long long getExpire(redisDb *db, robj *key);
 void setExpire(redisDb *db, robj *key, long long when);
 robj *lookupKey(redisDb *db, robj *key, int flags);
+void checkUnsyncedWriteConflict(client *c);
 robj *lookupKeyRead(redisDb *db, robj *key);
 robj *lookupKeyWrite(redisDb *db, robj *key);
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply);
@@ -1458,6 +1541,12 @@ long long emptyDb(void(callback)(void*));
 int selectDb(client *c, int id);
 void signalModifiedKey(redisDb *db, robj *key);
 void signalFlushedDb(int dbid);
+void trackUnsyncedKey(redisDb *db, robj *key);
+void trackUnsyncedFlush(int dbid);
+long long unsyncedKeyOpNum(redisDb *db, robj *key);
+void trackUnsyncedRead(redisDb *db, robj *key);
+void pruneUnsyncedKeys(void);
+unsigned long unsyncedKeyCount(void);
 unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count);
 unsigned int countKeysInSlot(unsigned int hashslot);
 unsigned int delKeysInSlot(unsigned int hashslot);
@@ -1682,13 +1771,26 @@ void pfcountCommand(client *c);
 void pfmergeCommand(client *c);
 void pfdebugCommand(client *c);
 void latencyCommand(client *c);
+void timetraceCommand(client *c);
 void securityWarningCommand(client *c);
 void wrecordCommand(client *c);
+void replaydoneCommand(client *c);
+void curpsyncCommand(client *c);
+void riflCommand(client *c);
+void wmrecordCommand(client *c);
 void witnessGcCommand(client *c);
 void witnessGetRecoveryDataCommand(client *c);
+void wconfigCommand(client *c);
+void wregisterCommand(client *c);
 
 // Not command but need to be exposed...
 void witnessInit();
+int witnessResizeTables(long long entries, long long associativity);
+sds genWitnessTableInfoString(sds info);
+void witnessClassifyCommand(robj **argv, int argc, uint32_t keyHash,
+                            uint8_t *opClass, uint64_t *fieldMask);
+bool witnessOpsCommute(uint8_t prevClass, uint64_t prevMask,
+                       uint8_t opClass, uint64_t fieldMask);
 
 #if defined(__GNUC__)
 void *calloc(size_t count, size_t size) __attribute__ ((deprecated));
@@ -1698,6 +1800,11 @@ void *realloc(void *ptr, size_t size) __attribute__ ((deprecated));
 #endif
 
 /* Debugging stuff */
+#define CRASH_POINT_BATCH 0   /* See DEBUG CRASH-AT. */
+#define CRASH_POINT_GC 1
+#define CRASH_POINT_FSYNC 2
+#define CRASH_POINTS 3
+
 void _serverAssertWithInfo(client *c, robj *o, char *estr, char *file, int line);
 void _serverAssert(char *estr, char *file, int line);
 void _serverPanic(char *msg, char *file, int line);
@@ -1709,6 +1816,7 @@ void enableWatchdog(int period);
 void disableWatchdog(void);
 void watchdogScheduleSignal(int period);
 void serverLogHexDump(int level, char *descr, void *value, size_t len);
+void debugCrashPoint(int point);
 int memtest_preserving_test(unsigned long *m, size_t bytes, int passes);
 
 #define redisDebug(fmt, ...) \
@@ -90,20 +90,7 @@ void setGenericCommand(client *c, int flags, robj *key, robj *val, robj *expire,
     notifyKeyspaceEvent(NOTIFY_STRING,"set",key,c->db->id);
     if (expire) notifyKeyspaceEvent(NOTIFY_GENERIC,
         "expire",key,c->db->id);
-
-
-//    record("executed SET command", 0, 0, 0, 0);
     addReply(c, ok_reply ? ok_reply : shared.ok);
-
-////////////// DISABLED CGAR-C ///////////////////
-//    if (ok_reply) {
-//        addReply(c, ok_reply);
-//    } else {
-//
-//        addReplyOkCgar(c);
-//        record("added reply string", 0, 0, 0, 0);
-//    }
-////////////// DISABLED CGAR-C ///////////////////
 }
 
 /* SET key value [NX] [XX] [EX <seconds>] [PX <milliseconds>] */
@@ -113,10 +100,9 @@ void setCommand(client *c) {
     int unit = UNIT_SECONDS;
     int flags = OBJ_SET_NO_FLAGS;
 
-    // exclude last 2 RIFL arguments from original Redis argument parser.
-    for (j = 3; j < c->argc - 2; j++) {
+    for (j = 3; j < c->argc; j++) {
         char *a = c->argv[j]->ptr;
-        robj *next = (j == c->argc-1 - 3) ? NULL : c->argv[j+1];
+        robj *next = (j == c->argc-1) ? NULL : c->argv[j+1];
 
         if ((a[0] == 'n' || a[0] == 'N') &&
             (a[1] == 'x' || a[1] == 'X') && a[2] == '\0' &&
@@ -390,7 +376,6 @@ void incrDecrCommand(client *c, long long incr) {
     addReply(c,new);
 
     addReply(c,shared.crlf);
-//DISABLE CGAR-C    addReplyOkCgar(c);
 }
 
 void incrCommand(client *c) {
@@ -13,6 +13,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "server.h"
 #include "timeTrace.h"
 #include <errno.h>
 #include <stdint.h>
@@ -26,21 +27,20 @@
 // Determines the number of events we can retain as an exponent of 2
 //#define BUFFER_SIZE_EXP 16
 
-// Total number of events that we can retain any given time.
+// Total number of events that we can retain any given time, per thread.
 //#define BUFFER_SIZE (1 << 16)
 #define BUFFER_SIZE (1 << 13)
 
 // Bit mask used to implement a circular event buffer
 #define BUFFER_MASK() (BUFFER_SIZE - 1)
 
-// Index within events of the slot to use for the next call to the
-// record method.
-int nextIndex;
-
 /**
  * This structure holds one entry in the TimeTrace.
  */
 struct Event {
+    // Odd while the owner thread writes the event, bumped again once done.
+    // Readers skip an event whose sequence changed while they copied it.
+    _Atomic uint32_t seq;
     uint64_t timestamp;        // Time when a particular event occurred.
     const char* format;        // Format string describing the event.
                                // NULL means that this entry is unused.
@@ -54,11 +54,30 @@ struct Event {
                                // when printing out this event.
 };
 
-// Holds information from the most recent calls to the record method.
-struct Event events[BUFFER_SIZE] = {{ 0 }};
+/**
+ * Events recorded by one thread. Only the owner thread writes to it, so
+ * recording takes no lock; readers copy the events out and drop the ones
+ * that were being overwritten (see Event.seq). Buffers are registered in a
+ * global list the first time their thread records something, and are never
+ * freed: Redis threads live as long as the process.
+ */
+struct TraceBuffer {
+    // Index within events of the slot to use for the next call to the
+    // record method.
+    int nextIndex;
+    struct TraceBuffer *next;  // Next registered buffer.
+    // Holds information from the most recent calls to the record method.
+    struct Event events[BUFFER_SIZE];
+};
+
+_Atomic int timeTraceEnabled = 0;
+// Events older than this were dropped by TIMETRACE RESET. Buffers are only
+// written by their own thread, so a reset doesn't clear them.
+static _Atomic uint64_t traceResetTime = 0;
+static struct TraceBuffer *_Atomic traceBuffers = NULL;
+static __thread struct TraceBuffer *threadBuffer = NULL;
 
 double cyclesPerSec = 0;
-
 /*================================= Functions =============================== */
 void init() {
     if (cyclesPerSec != 0)
@@ -117,42 +136,81 @@ double toSeconds(uint64_t cycles)
     return ((double)(cycles))/cyclesPerSec;
 }
 
+static struct TraceBuffer *registerThreadBuffer(void) {
+    struct TraceBuffer *buffer = zcalloc(sizeof(*buffer));
+    buffer->next = atomic_load(&traceBuffers);
+    while (!atomic_compare_exchange_weak(&traceBuffers, &buffer->next, buffer));
+    return buffer;
+}
+
+static int compareEvents(const void *a, const void *b) {
+    const struct Event *ea = a, *eb = b;
+    if (ea->timestamp == eb->timestamp) return 0;
+    return ea->timestamp < eb->timestamp ? -1 : 1;
+}
+
 void recordWithTime(uint64_t timestamp, const char* format,
         uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3) {
-    struct Event* event = &events[nextIndex];
-    nextIndex = (nextIndex + 1) & BUFFER_MASK();
+    if (threadBuffer == NULL) threadBuffer = registerThreadBuffer();
+
+    struct TraceBuffer *buffer = threadBuffer;
+    struct Event* event = &buffer->events[buffer->nextIndex];
+    buffer->nextIndex = (buffer->nextIndex + 1) & BUFFER_MASK();
 
+    uint32_t seq = atomic_load_explicit(&event->seq, memory_order_relaxed);
+    atomic_store_explicit(&event->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
     event->timestamp = timestamp;
     event->format = format;
     event->arg0 = arg0;
     event->arg1 = arg1;
     event->arg2 = arg2;
     event->arg3 = arg3;
+    atomic_store_explicit(&event->seq, seq + 2, memory_order_release);
 }
 
-void
-printTrace(const char *filename)
-{
-    uint8_t printedAnything = 0;
-    // reader start?
+/* Copy the valid events of 'buffer' recorded since the last reset to
+ * 'dst', sorted by time, and return how many there are. The owner thread
+ * keeps recording meanwhile: events it was writing are left out. */
+static int copyTraceBuffer(struct TraceBuffer *buffer, struct Event *dst) {
+    uint64_t resetTime = atomic_load(&traceResetTime);
+    int count = 0;
 
-    // Initialize file for writing
-    FILE* output = filename ? fopen(filename, "a") : stdout;
+    for (int i = 0; i < BUFFER_SIZE; i++) {
+        struct Event *e = &buffer->events[i];
+        uint32_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if (seq & 1) continue;
+        dst[count].timestamp = e->timestamp;
+        dst[count].format = e->format;
+        dst[count].arg0 = e->arg0;
+        dst[count].arg1 = e->arg1;
+        dst[count].arg2 = e->arg2;
+        dst[count].arg3 = e->arg3;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&e->seq, memory_order_relaxed) != seq)
+            continue;
+        if (dst[count].format == NULL || dst[count].timestamp < resetTime)
+            continue;
+        count++;
+    }
+    qsort(dst, count, sizeof(*dst), compareEvents);
+    return count;
+}
 
-    // Holds the index of the next event to consider from each trace.
-    int current;
+/* Merge the events of every thread in time order, in the format ttsum.py
+ * reads: one "<time> ns (+<interval> ns): <message>" line per event. */
+static sds getTrace(sds output) {
+    // Buffers are only ever added at the head of the list.
+    struct TraceBuffer *head = atomic_load(&traceBuffers), *buffer;
+    int numBuffers = 0, j;
 
-    // Find the first (oldest) event in each trace. This will be events[0]
-    // if we never completely filled the buffer, otherwise events[nextIndex+1].
-    // This means we don't print the entry at nextIndex; this is convenient
-    // because it simplifies boundary conditions in the code below.
+    for (buffer = head; buffer; buffer = buffer->next) numBuffers++;
 
-    int index = (nextIndex + 1) % BUFFER_SIZE;
-    if (events[index].format != NULL) {
-        current = index;
-    } else {
-        current = 0;
-    }
+    // A sorted copy of the events of each trace, and the index of the next
+    // event to consider from each of them.
+    struct Event **events = zmalloc(sizeof(*events) * (numBuffers + 1));
+    int *count = zmalloc(sizeof(*count) * (numBuffers + 1));
+    int *current = zmalloc(sizeof(*current) * (numBuffers + 1));
 
     // Decide on the time of the first event to be included in the output.
     // This is most recent of the oldest times in all the traces (an empty
@@ -162,20 +220,41 @@ printTrace(const char *filename)
     // might have been related events that were once in trace B but have since
     // been overwritten).
     uint64_t startTime = 0;
-    startTime = events[current].timestamp;
+    for (buffer = head, j = 0; buffer; buffer = buffer->next, j++) {
+        events[j] = zmalloc(sizeof(struct Event) * BUFFER_SIZE);
+        count[j] = copyTraceBuffer(buffer, events[j]);
+        current[j] = 0;
+        if (count[j] > 0 && events[j][0].timestamp > startTime)
+            startTime = events[j][0].timestamp;
+    }
+    for (j = 0; j < numBuffers; j++) {
+        while (current[j] < count[j] &&
+               events[j][current[j]].timestamp < startTime) {
+            current[j]++;
+        }
+    }
 
     // Each iteration through this loop processes one event (the one with
     // the earliest timestamp).
     double prevTime = 0.0;
+    int printedAnything = 0;
     while (1) {
-        if (current == nextIndex || events[current].format == NULL) {
+        struct Event* event = NULL;
+        int earliest = -1;
+        for (j = 0; j < numBuffers; j++) {
+            if (current[j] == count[j]) continue;
+            struct Event *e = &events[j][current[j]];
+            if (event == NULL || e->timestamp < event->timestamp) {
+                event = e;
+                earliest = j;
+            }
+        }
+        if (event == NULL) {
             // Don't have any more events to process.
             break;
         }
-
+        current[earliest]++;
         printedAnything = 1;
-        struct Event* event = &events[current];
-        current = (current + 1) & BUFFER_MASK();
 
         char message[1000];
         double ns = toSeconds(event->timestamp - startTime) * 1e09;
@@ -185,17 +264,60 @@ printTrace(const char *filename)
         snprintf(message, sizeof(message), event->format, event->arg0,
                  event->arg1, event->arg2, event->arg3);
 #pragma GCC diagnostic pop
-        fprintf(output, "%8.1f ns (+%6.1f ns): %s", ns, ns - prevTime,
-                message);
-        fputc('\n', output);
-
+        output = sdscatprintf(output, "%8.1f ns (+%6.1f ns): %s\n", ns,
+                              ns - prevTime, message);
         prevTime = ns;
     }
+    for (j = 0; j < numBuffers; j++) zfree(events[j]);
+    zfree(events);
+    zfree(count);
+    zfree(current);
 
     if (!printedAnything) {
-        fprintf(output, "No time trace events to print");
+        output = sdscat(output, "No time trace events to print");
     }
+    return output;
+}
 
-    if (output && output != stdout)
+/* Drop the events recorded so far. */
+static void resetTrace(void) {
+    atomic_store(&traceResetTime, rdtsc());
+}
+
+void
+printTrace(const char *filename)
+{
+    // Initialize file for writing
+    FILE* output = filename ? fopen(filename, "a") : stdout;
+    if (output == NULL) return;
+
+    sds trace = getTrace(sdsempty());
+    fwrite(trace, 1, sdslen(trace), output);
+    sdsfree(trace);
+
+    if (output != stdout)
         fclose(output);
-}
\ No newline at end of file
+}
+
+/* TIMETRACE ON|OFF|DUMP|RESET
+ * Turn recording on or off, reply with the events of every thread merged in
+ * time order (to be fed to ttsum.py), or drop them. */
+void timetraceCommand(client *c) {
+    char *sub = c->argv[1]->ptr;
+
+    if (!strcasecmp(sub,"on")) {
+        if (cyclesPerSec == 0) init();
+        atomic_store(&timeTraceEnabled, 1);
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(sub,"off")) {
+        atomic_store(&timeTraceEnabled, 0);
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(sub,"dump")) {
+        addReplyBulkSds(c,getTrace(sdsempty()));
+    } else if (!strcasecmp(sub,"reset")) {
+        resetTrace();
+        addReply(c,shared.ok);
+    } else {
+        addReplyError(c,"Unknown TIMETRACE subcommand, try ON, OFF, DUMP or RESET");
+    }
+}
@@ -8,6 +8,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdatomic.h>
 
 __inline __attribute__((always_inline))
 uint64_t rdtsc()
@@ -17,14 +18,19 @@ uint64_t rdtsc()
     return (((uint64_t)hi << 32) | lo);
 }
 
+/* Recording is off until TIMETRACE ON, and costs one relaxed load then. */
+extern _Atomic int timeTraceEnabled;
+
 void recordWithTime(uint64_t timestamp, const char* format,
         uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3);
 
-inline void record(const char* format, uint32_t arg0,
+static inline void record(const char* format, uint32_t arg0,
         uint32_t arg1, uint32_t arg2, uint32_t arg3) {
-    recordWithTime(rdtsc(), format, arg0, arg1, arg2, arg3);
+    if (atomic_load_explicit(&timeTraceEnabled, memory_order_relaxed))
+        recordWithTime(rdtsc(), format, arg0, arg1, arg2, arg3);
 }
 
+double toSeconds(uint64_t cycles);
 void printTrace(const char *filename);
 
 #endif
@@ -15,28 +15,254 @@
 
 #include "server.h"
 #include "redisassert.h"
+#include "witnessProto.h"
+#include "MurmurHash3.h"
 
-#define MAX_WITNESS_REQUEST_SIZE 2048
-//    static const int NUM_ENTRIES_PER_TABLE = 512; // Must be power of 2.
-//#define WITNESS_NUM_ENTRIES_PER_TABLE 4096 // Must be power of 2.
-//#define HASH_BITMASK 4095
-#define WITNESS_NUM_ENTRIES_PER_TABLE 1024 // Must be power of 2.
-#define HASH_BITMASK 1023
-#define WITNESS_ASSOCIATIVITY 4
+/*============================ Record storage =============================== */
+
+/* Request payloads are kept out of the table in a size-class slab, so that a
+ * table slot only costs a few dozen bytes and memory grows with the number
+ * and size of records actually held. Chunk sizes are powers of two from
+ * 64 bytes to 8 KB; each class carves its chunks out of 64 KB pages that are
+ * allocated on demand. Anything bigger than the largest class gets its own
+ * allocation (the "large" class) which is released as soon as it is GCed.
+ *
+ * Every page keeps its own freelist, so that a page whose last chunk is
+ * freed can be given back to the allocator. Each class keeps one empty page
+ * around to avoid allocating and releasing a page on every record when the
+ * table hovers around a page boundary.
+ *
+ * A record is addressed by a 32-bit reference: the class in the high 8 bits
+ * and the chunk number within the class in the low 24 bits. */
+#define WITNESS_SLAB_MIN_CHUNK_BITS 6           /* 64 bytes */
+#define WITNESS_SLAB_NUM_CLASSES 8              /* 64 bytes .. 8 KB */
+#define WITNESS_SLAB_LARGE WITNESS_SLAB_NUM_CLASSES
+#define WITNESS_SLAB_PAGE_SIZE (64*1024)
+#define WITNESS_SLAB_NONE UINT32_MAX
+#define WITNESS_REF_CLASS(ref) ((ref) >> 24)
+#define WITNESS_REF_CHUNK(ref) ((ref) & 0xffffff)
+#define WITNESS_REF(cls, chunk) (((uint32_t)(cls) << 24) | (uint32_t)(chunk))
+
+struct SlabPage {
+    char *mem;              /* NULL once released; the slot is then reused. */
+    uint32_t freeHead;      /* First free chunk of the page, page relative;
+                             * the next link lives in the chunk. */
+    uint32_t usedChunks;
+    uint32_t prev, next;    /* Links in the list of pages with a free chunk,
+                             * or in the list of released slots. */
+};
+
+struct SlabClass {
+    size_t chunkSize;
+    uint32_t chunksPerPage;
+    struct SlabPage *pages;
+    uint32_t numPages;      /* Slots in pages[], released ones included. */
+    uint32_t availHead;     /* First page with a free chunk. */
+    uint32_t releasedHead;  /* First released slot of pages[]. */
+    uint32_t emptyPages;    /* Allocated pages without any used chunk. */
+    uint32_t usedChunks;
+};
+
+struct WitnessSlab {
+    struct SlabClass classes[WITNESS_SLAB_NUM_CLASSES];
+    char **large;           /* Oversized records, one allocation each. */
+    uint32_t largeSize;     /* Capacity of large[]. */
+    uint32_t *largeFree;    /* Stack of reusable indexes into large[]. */
+    uint32_t largeFreeCount;
+    size_t allocatedBytes;  /* Pages plus oversized records. */
+    size_t usedBytes;       /* Bytes of payload actually stored. */
+    size_t numPages;        /* Pages allocated, of every class. */
+};
+
+static struct WitnessSlab recordSlab;
+
+static void slabInit(struct WitnessSlab *slab) {
+    memset(slab, 0, sizeof(*slab));
+    for (int i = 0; i < WITNESS_SLAB_NUM_CLASSES; ++i) {
+        struct SlabClass *sc = &slab->classes[i];
+        sc->chunkSize = (size_t)1 << (WITNESS_SLAB_MIN_CHUNK_BITS + i);
+        sc->chunksPerPage = WITNESS_SLAB_PAGE_SIZE / sc->chunkSize;
+        sc->availHead = WITNESS_SLAB_NONE;
+        sc->releasedHead = WITNESS_SLAB_NONE;
+    }
+}
+
+static int slabClassForSize(size_t size) {
+    int cls = 0;
+    while (cls < WITNESS_SLAB_NUM_CLASSES &&
+           ((size_t)1 << (WITNESS_SLAB_MIN_CHUNK_BITS + cls)) < size) {
+        ++cls;
+    }
+    return cls;
+}
+
+static char *slabChunk(struct SlabClass *sc, uint32_t chunk) {
+    return sc->pages[chunk / sc->chunksPerPage].mem +
+           (size_t)(chunk % sc->chunksPerPage) * sc->chunkSize;
+}
+
+static void slabLinkAvail(struct SlabClass *sc, uint32_t idx) {
+    struct SlabPage *page = &sc->pages[idx];
+    page->prev = WITNESS_SLAB_NONE;
+    page->next = sc->availHead;
+    if (sc->availHead != WITNESS_SLAB_NONE) sc->pages[sc->availHead].prev = idx;
+    sc->availHead = idx;
+}
+
+static void slabUnlinkAvail(struct SlabClass *sc, uint32_t idx) {
+    struct SlabPage *page = &sc->pages[idx];
+    if (page->prev != WITNESS_SLAB_NONE) sc->pages[page->prev].next = page->next;
+    else sc->availHead = page->next;
+    if (page->next != WITNESS_SLAB_NONE) sc->pages[page->next].prev = page->prev;
+}
+
+/* Allocate a page for 'sc', thread its chunks into the page freelist and put
+ * it on the list of pages with a free chunk. */
+static void slabAddPage(struct WitnessSlab *slab, struct SlabClass *sc) {
+    uint32_t idx;
+    if (sc->releasedHead != WITNESS_SLAB_NONE) {
+        idx = sc->releasedHead;
+        sc->releasedHead = sc->pages[idx].next;
+    } else {
+        sc->pages = zrealloc(sc->pages, sizeof(struct SlabPage) * (sc->numPages + 1));
+        idx = sc->numPages++;
+    }
+    struct SlabPage *page = &sc->pages[idx];
+    page->mem = zmalloc(WITNESS_SLAB_PAGE_SIZE);
+    page->freeHead = WITNESS_SLAB_NONE;
+    page->usedChunks = 0;
+    for (uint32_t i = sc->chunksPerPage; i-- > 0; ) {
+        memcpy(page->mem + i * sc->chunkSize, &page->freeHead, sizeof(uint32_t));
+        page->freeHead = i;
+    }
+    slabLinkAvail(sc, idx);
+    sc->emptyPages++;
+    slab->numPages++;
+    slab->allocatedBytes += WITNESS_SLAB_PAGE_SIZE;
+}
+
+static void slabReleasePage(struct WitnessSlab *slab, struct SlabClass *sc, uint32_t idx) {
+    struct SlabPage *page = &sc->pages[idx];
+    slabUnlinkAvail(sc, idx);
+    zfree(page->mem);
+    page->mem = NULL;
+    page->next = sc->releasedHead;
+    sc->releasedHead = idx;
+    sc->emptyPages--;
+    slab->numPages--;
+    slab->allocatedBytes -= WITNESS_SLAB_PAGE_SIZE;
+}
+
+/* Copy 'size' bytes of 'data' into the slab and return the reference. */
+static uint32_t slabStore(struct WitnessSlab *slab, const void *data, size_t size) {
+    int cls = slabClassForSize(size);
+    uint32_t chunk;
+
+    if (cls == WITNESS_SLAB_LARGE) {
+        if (slab->largeFreeCount) {
+            chunk = slab->largeFree[--slab->largeFreeCount];
+        } else {
+            chunk = slab->largeSize;
+            slab->largeSize = slab->largeSize ? slab->largeSize * 2 : 16;
+            slab->large = zrealloc(slab->large, sizeof(char*) * slab->largeSize);
+            slab->largeFree = zrealloc(slab->largeFree,
+                                       sizeof(uint32_t) * slab->largeSize);
+            /* Push the new indexes (but the one we take) in reverse order,
+             * so that lower indexes are reused first. */
+            for (uint32_t i = slab->largeSize - 1; i > chunk; --i)
+                slab->largeFree[slab->largeFreeCount++] = i;
+        }
+        slab->large[chunk] = zmalloc(size);
+        memcpy(slab->large[chunk], data, size);
+        slab->allocatedBytes += size;
+        slab->usedBytes += size;
+        return WITNESS_REF(cls, chunk);
+    }
+
+    struct SlabClass *sc = &slab->classes[cls];
+    if (sc->availHead == WITNESS_SLAB_NONE) slabAddPage(slab, sc);
+    uint32_t idx = sc->availHead;
+    struct SlabPage *page = &sc->pages[idx];
+    char *dst = page->mem + (size_t)page->freeHead * sc->chunkSize;
+    chunk = idx * sc->chunksPerPage + page->freeHead;
+    memcpy(&page->freeHead, dst, sizeof(uint32_t));
+    if (page->usedChunks++ == 0) sc->emptyPages--;
+    if (page->freeHead == WITNESS_SLAB_NONE) slabUnlinkAvail(sc, idx);
+    memcpy(dst, data, size);
+    sc->usedChunks++;
+    slab->usedBytes += size;
+    return WITNESS_REF(cls, chunk);
+}
+
+static char *slabGet(struct WitnessSlab *slab, uint32_t ref) {
+    uint32_t cls = WITNESS_REF_CLASS(ref);
+    if (cls == WITNESS_SLAB_LARGE) return slab->large[WITNESS_REF_CHUNK(ref)];
+    return slabChunk(&slab->classes[cls], WITNESS_REF_CHUNK(ref));
+}
+
+static void slabFree(struct WitnessSlab *slab, uint32_t ref, size_t size) {
+    uint32_t cls = WITNESS_REF_CLASS(ref);
+    uint32_t chunk = WITNESS_REF_CHUNK(ref);
+
+    slab->usedBytes -= size;
+    if (cls == WITNESS_SLAB_LARGE) {
+        zfree(slab->large[chunk]);
+        slab->large[chunk] = NULL;
+        slab->allocatedBytes -= size;
+        slab->largeFree[slab->largeFreeCount++] = chunk;
+        return;
+    }
+    struct SlabClass *sc = &slab->classes[cls];
+    uint32_t idx = chunk / sc->chunksPerPage;
+    uint32_t offset = chunk % sc->chunksPerPage;
+    struct SlabPage *page = &sc->pages[idx];
+    memcpy(page->mem + (size_t)offset * sc->chunkSize, &page->freeHead,
+           sizeof(uint32_t));
+    if (page->freeHead == WITNESS_SLAB_NONE) slabLinkAvail(sc, idx);
+    page->freeHead = offset;
+    sc->usedChunks--;
+    if (--page->usedChunks == 0) {
+        /* Keep a single spare empty page per class. */
+        if (++sc->emptyPages > 1) slabReleasePage(slab, sc, idx);
+    }
+}
+
+/*================================ Witness table ============================ */
+
+/* The table geometry (number of buckets and ways per bucket) comes from the
+ * witness-table-entries and witness-associativity options. Clients learn it
+ * through WCONFIG and send keyHash & (entries-1) as the hash index of a
+ * record. The witnesses of a master may disagree on the geometry, and
+ * clients then use the widest mask: every witness narrows the index to its
+ * own table, so records land in the same bucket. Masters GC with the full
+ * key hash, so their GCs still find the records after a table is resized
+ * with CONFIG SET. */
 
 /**
- * Holds information to recover an RPC request in case of the master's crash
+ * One way of a table bucket. Holds information to recover an RPC request in
+ * case of the master's crash. The request itself lives in recordSlab.
  */
-struct Entry {
-    bool occupied[WITNESS_ASSOCIATIVITY]; // TODO(seojin): check padding to 64-bit improves perf?
-    int16_t requestSize[WITNESS_ASSOCIATIVITY];
-    uint32_t keyHash[WITNESS_ASSOCIATIVITY];
-    int64_t clientId[WITNESS_ASSOCIATIVITY];
-    int64_t requestId[WITNESS_ASSOCIATIVITY];
-    char request[WITNESS_ASSOCIATIVITY][MAX_WITNESS_REQUEST_SIZE];
-    unsigned long long GcSeqNum[WITNESS_ASSOCIATIVITY]; // GcRpcCount when it arrived.
+struct Slot {
+    bool occupied; // TODO(seojin): check padding to 64-bit improves perf?
+    uint8_t opClass;        /* WITNESS_OP_* of the request. */
+    uint32_t keyHash;
+    uint32_t requestSize;
+    uint32_t requestRef;
+    int64_t clientId;
+    int64_t requestId;
+    unsigned long long GcSeqNum; // GcRpcCount when it arrived.
+    uint64_t fieldMask;     /* Hash fields written, see classifyRequest(). */
 };
 
+struct WitnessGcInfo {
+    uint32_t keyHash;       /* Reported as the hash index: the master narrows
+                             * it to the mask it uses. */
+    long long clientId;
+    long long requestId;
+};
+
+#define WITNESS_MAX_OBSOLETE_RPCS 50
+
 /**
  * Holds information of a master being witnessed. Holds recent & unsynced
  * requests to the master.
@@ -44,86 +270,438 @@ struct Entry {
 struct Master {
     uint64_t id;
     bool writable;
-    struct Entry table[WITNESS_NUM_ENTRIES_PER_TABLE];
+    struct Slot *table;     /* numEntries buckets of 'associativity' slots. */
+    uint32_t numEntries;    /* Must be power of 2. */
+    uint32_t associativity;
     int occupiedCount;
     int gcMissedCount;
     unsigned long long totalGcRpcs;
     int totalRecordRpcs;
     int totalRejection;
     int trueCollision;
+    int commutedRecords;    /* Accepted next to a record for the same key. */
+    /* Records that missed their GC, reported in the next WGC reply. */
+    struct WitnessGcInfo obsoleteRpcs[WITNESS_MAX_OBSOLETE_RPCS];
+    int obsoleteRpcsSize;
 };
 
-struct WitnessGcInfo {
-    int hashIndex;
-    long long clientId;
-    long long requestId;
-};
+/* Return the first slot of the bucket at 'hashIndex'. */
+static struct Slot *getBucket(struct Master *m, long hashIndex) {
+    return &m->table[(size_t)hashIndex * m->associativity];
+}
 
-/* 0th index is not used. */
-struct WitnessGcInfo obsoleteRpcs[50] = {{0,0,0}, };
-int obsoleteRpcsSize = 0;
+/* Release the record held in the given slot. */
+static void freeSlot(struct Slot *slot) {
+    slot->occupied = false;
+    slabFree(&recordSlab, slot->requestRef, slot->requestSize);
+}
 
-void addToObsoleteRpcs(int hashIndex, long long clientId, long long requestId) {
-    if (obsoleteRpcsSize < 50) {
-        obsoleteRpcs[obsoleteRpcsSize].hashIndex = hashIndex;
-        obsoleteRpcs[obsoleteRpcsSize].clientId = clientId;
-        obsoleteRpcs[obsoleteRpcsSize].requestId = requestId;
+static void addToObsoleteRpcs(struct Master *m, struct Slot *slot) {
+    for (int i = 0; i < m->obsoleteRpcsSize; ++i) {
+        if (m->obsoleteRpcs[i].clientId == slot->clientId &&
+            m->obsoleteRpcs[i].requestId == slot->requestId) return;
+    }
+    if (m->obsoleteRpcsSize < WITNESS_MAX_OBSOLETE_RPCS) {
+        m->obsoleteRpcs[m->obsoleteRpcsSize].keyHash = slot->keyHash;
+        m->obsoleteRpcs[m->obsoleteRpcsSize].clientId = slot->clientId;
+        m->obsoleteRpcs[m->obsoleteRpcsSize].requestId = slot->requestId;
+        m->obsoleteRpcsSize++;
     }
     // Just ignore if this buffer is full..
 }
 
-struct Master masters[10];
+/* Tables of the masters registered with WREGISTER, keyed by master id. */
+static unsigned int dictMasterIdHash(const void *key) {
+    return dictGenHashFunction(key, sizeof(uint64_t));
+}
+
+static int dictMasterIdCompare(void *privdata, const void *key1,
+        const void *key2) {
+    UNUSED(privdata);
+    return *(const uint64_t*)key1 == *(const uint64_t*)key2;
+}
+
+static void dictMasterDestructor(void *privdata, void *val) {
+    struct Master *m = val;
+    size_t numSlots = (size_t)m->numEntries * m->associativity;
+    UNUSED(privdata);
+
+    for (size_t i = 0; i < numSlots; ++i) {
+        if (m->table[i].occupied) freeSlot(&m->table[i]);
+    }
+    zfree(m->table);
+    zfree(m);
+}
+
+/* The key is a pointer to the id field of the Master itself. */
+static dictType witnessMastersDictType = {
+    dictMasterIdHash,           /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictMasterIdCompare,        /* key compare */
+    NULL,                       /* key destructor */
+    dictMasterDestructor        /* val destructor */
+};
+
+static dict *masters;
 time_t lastStatPrintTime = 0;
 
 void witnessInit() {
-    memset(masters, 0, sizeof(masters));
-    for (int i = 0; i < 10; ++i) {
-        masters[i].writable = true;
+    masters = dictCreate(&witnessMastersDictType, NULL);
+    slabInit(&recordSlab);
+}
+
+/* Return the table of the given master, or NULL if it never registered. */
+static struct Master *lookupMaster(uint64_t id) {
+    dictEntry *de = dictFind(masters, &id);
+    return de ? dictGetVal(de) : NULL;
+}
+
+/* Return the table of the given master, creating it on first use. */
+static struct Master *lookupOrCreateMaster(uint64_t id) {
+    struct Master *m = lookupMaster(id);
+    if (m) return m;
+
+    m = zcalloc(sizeof(*m));
+    m->id = id;
+    m->writable = true;
+    m->numEntries = server.witness_table_entries;
+    m->associativity = server.witness_associativity;
+    m->table = zcalloc(sizeof(struct Slot) *
+            server.witness_table_entries * server.witness_associativity);
+    dictAdd(masters, &m->id, m);
+    serverLog(LL_NOTICE, "Witness table allocated for master %llu "
+            "(%lu masters registered).", (unsigned long long)id,
+            dictSize(masters));
+    return m;
+}
+
+/* Change the geometry of every witness table, moving the records already
+ * held to their bucket under the new geometry. Records know their keyHash,
+ * so nothing is lost as long as every bucket still has room: if it doesn't,
+ * all tables are left untouched and C_ERR is returned. */
+int witnessResizeTables(long long entries, long long associativity) {
+    unsigned long numMasters = dictSize(masters);
+    struct Master **list = zmalloc(sizeof(struct Master*) * (numMasters + 1));
+    struct Slot **newTables = zmalloc(sizeof(struct Slot*) * (numMasters + 1));
+    size_t newSlots = (size_t)entries * associativity;
+    dictIterator *di = dictGetIterator(masters);
+    dictEntry *de;
+    long i = 0;
+    int retval = C_OK;
+
+    while ((de = dictNext(di)) != NULL) list[i++] = dictGetVal(de);
+    dictReleaseIterator(di);
+
+    for (i = 0; i < (long)numMasters; ++i) {
+        struct Master *m = list[i];
+        newTables[i] = zcalloc(sizeof(struct Slot) * newSlots);
+        for (size_t j = 0; j < (size_t)m->numEntries * m->associativity; ++j) {
+            if (!m->table[j].occupied) continue;
+            struct Slot *bucket = &newTables[i][
+                    (size_t)(m->table[j].keyHash & (entries - 1)) * associativity];
+            int way = 0;
+            while (way < associativity && bucket[way].occupied) ++way;
+            if (way == associativity) {
+                for (; i >= 0; --i) zfree(newTables[i]);
+                retval = C_ERR;
+                goto cleanup;
+            }
+            bucket[way] = m->table[j];
+        }
     }
+
+    for (i = 0; i < (long)numMasters; ++i) {
+        zfree(list[i]->table);
+        list[i]->table = newTables[i];
+        list[i]->numEntries = entries;
+        list[i]->associativity = associativity;
+    }
+    server.witness_table_entries = entries;
+    server.witness_associativity = associativity;
+
+cleanup:
+    zfree(list);
+    zfree(newTables);
+    return retval;
 }
 
-void wrecordCommand(client *c) {
-    long masterIdx, hashIndex;
-    long long keyHash, clientId, requestId;
-    if (getLongFromObjectInBase64OrReply(c, c->argv[1], &masterIdx, NULL) != C_OK) return;
-    if (getLongFromObjectInBase64OrReply(c, c->argv[2], &hashIndex, NULL) != C_OK) return;
-    if (getLongLongFromObjectInBase64OrReply(c, c->argv[3], &keyHash, NULL) != C_OK) return;
-    if (getLongLongFromObjectInBase64OrReply(c, c->argv[4], &clientId, NULL) != C_OK) return;
-    if (getLongLongFromObjectInBase64OrReply(c, c->argv[5], &requestId, NULL) != C_OK) return;
-    size_t requestSize = sdslen(c->argv[6]->ptr);
-    void* data = c->argv[6]->ptr;
+/* The fields of INFO witness about the records this server holds as a
+ * witness, for every master. */
+sds genWitnessTableInfoString(sds info) {
+    dictIterator *di = dictGetIterator(masters);
+    dictEntry *de;
+    long long records = 0;
+
+    while ((de = dictNext(di)) != NULL)
+        records += ((struct Master *)dictGetVal(de))->occupiedCount;
+    dictReleaseIterator(di);
+    return sdscatprintf(info,
+        "witness_masters:%lu\r\n"
+        "witness_records:%lld\r\n"
+        "witness_record_bytes:%zu\r\n"
+        "witness_record_allocated_bytes:%zu\r\n"
+        "witness_slab_pages:%zu\r\n",
+        dictSize(masters), records, recordSlab.usedBytes,
+        recordSlab.allocatedBytes, recordSlab.numPages);
+}
+
+/* WREGISTER <master-id>
+ * Called by a master when it connects, so that its table is allocated before
+ * clients start recording. The reply is the table geometry, as for WCONFIG. */
+void wregisterCommand(client *c) {
+    long long masterId;
+    if (getLongLongFromObjectOrReply(c, c->argv[1], &masterId, NULL) != C_OK) return;
+
+    lookupOrCreateMaster((uint64_t)masterId);
+    addReplyMultiBulkLen(c, 2);
+    addReplyLongLong(c, server.witness_table_entries);
+    addReplyLongLong(c, server.witness_associativity);
+}
+
+/* WCONFIG
+ * Reply with the table geometry as [entries, associativity]. Masters and
+ * clients compute hash indexes as keyHash & (entries-1). */
+void wconfigCommand(client *c) {
+    addReplyMultiBulkLen(c, 2);
+    addReplyLongLong(c, server.witness_table_entries);
+    addReplyLongLong(c, server.witness_associativity);
+}
+
+#define RECORD_ACCEPTED 0
+#define RECORD_REJECTED 1
+#define RECORD_BAD_GEOMETRY 2
+
+/* Reply -WGEOMETRY so that a sender that computed the hash index with a
+ * stale geometry can refresh it and retry (or take the slow path). */
+static void addReplyWitnessGeometry(client *c) {
+    addReplySds(c,sdscatprintf(sdsempty(),"-WGEOMETRY %lld %lld\r\n",
+            server.witness_table_entries, server.witness_associativity));
+}
+
+/* Check the hash index a sender computed against our geometry: narrowed to
+ * our mask it must match the key hash. A wider mask is fine, see above. */
+static bool hashIndexOk(long hashIndex, long long keyHash) {
+    uint32_t mask = (uint32_t)(server.witness_table_entries - 1);
+    return ((uint32_t)hashIndex & mask) == ((uint32_t)keyHash & mask);
+}
+
+/*========================== Commutativity checks =========================== */
+
+/* Two records for the same key normally conflict: recovery replays them in
+ * no particular order, so the witness may hold only one of them. Some
+ * updates give the same result in any order, and are accepted side by side
+ * when witness-commutativity is on. The class of a record is derived from
+ * the command name of the request it carries.
+ *
+ * Hash updates also carry the set of fields they write, as a 64-bit mask
+ * with one bit per field chosen by hashing the field with the key hash as
+ * seed. Disjoint masks mean disjoint fields; overlapping masks may be a
+ * false positive, which only costs a rejection.
+ *
+ * The master runs the same checks on its unsynced keys (see db.c) to tell
+ * whether a witness may have rejected the record of a write. */
+
+static struct witnessOpClass {
+    char *name;
+    uint8_t opClass;
+    int firstField;     /* Argument index of the first hash field, or 0. */
+    int fieldStep;      /* Distance between hash fields. */
+} witnessOpClassTable[] = {
+    {"incr",WITNESS_OP_COUNTER,0,0},
+    {"incrby",WITNESS_OP_COUNTER,0,0},
+    {"decr",WITNESS_OP_COUNTER,0,0},
+    {"decrby",WITNESS_OP_COUNTER,0,0},
+    {"sadd",WITNESS_OP_SET_ADD,0,0},
+    {"hset",WITNESS_OP_HASH_WRITE,2,2},
+    {"hsetnx",WITNESS_OP_HASH_WRITE,2,2},
+    {"hmset",WITNESS_OP_HASH_WRITE,2,2},
+    {"hincrby",WITNESS_OP_HASH_COUNTER,2,2}
+};
+
+/* Read the header of the next RESP bulk string at *p, leaving *p at its
+ * payload. Returns the payload length or -1 if the request is malformed. */
+static long long nextBulk(const char **p, const char *end) {
+    const char *nl;
+    long long len;
+
+    if (*p >= end || **p != '$') return -1;
+    nl = memchr(*p, '\r', end - *p);
+    if (nl == NULL || nl + 1 >= end ||
+        !string2ll(*p + 1, nl - *p - 1, &len) ||
+        len < 0 || len > end - (nl + 2)) return -1;
+    *p = nl + 2;
+    return len;
+}
+
+static struct witnessOpClass *lookupWitnessOpClass(const char *name, size_t len) {
+    for (size_t j = 0; j < sizeof(witnessOpClassTable)/sizeof(witnessOpClassTable[0]); ++j) {
+        if (strlen(witnessOpClassTable[j].name) == len &&
+            !strncasecmp(name, witnessOpClassTable[j].name, len)) {
+            return &witnessOpClassTable[j];
+        }
+    }
+    return NULL;
+}
+
+/* Compute the operation class and field mask of a RESP encoded request.
+ * Anything we can't parse or don't know is WITNESS_OP_OTHER. If the request
+ * ends with the RIFL ids of the record, those are not fields. */
+static void classifyRequest(const char *req, size_t size, uint32_t keyHash,
+                            long long clientId, long long requestId,
+                            uint8_t *opClass, uint64_t *fieldMask) {
+    const char *p = req, *end = req + size, *nl;
+    struct witnessOpClass *oc = NULL;
+    long long argc, len;
+
+    *opClass = WITNESS_OP_OTHER;
+    *fieldMask = 0;
+    if (size == 0 || *p != '*') return;
+    nl = memchr(p, '\r', size);
+    if (nl == NULL || !string2ll(p + 1, nl - p - 1, &argc) || argc < 2) return;
+    p = nl + 2;
 
-    struct Master* buffer = &masters[masterIdx];
-    assert(requestSize <= MAX_WITNESS_REQUEST_SIZE);
-    assert(hashIndex < WITNESS_NUM_ENTRIES_PER_TABLE);
+    if ((len = nextBulk(&p, end)) < 0) return;
+    if ((oc = lookupWitnessOpClass(p, len)) == NULL) return;
+    if (oc->firstField == 0) {
+        *opClass = oc->opClass;
+        return;
+    }
+
+    /* The mask as it was before each of the last two arguments, and those
+     * arguments, so that the RIFL ids can be taken back out at the end. */
+    uint64_t mask = 0, maskBefore[2] = {0, 0};
+    long long ids[2] = {-1, -1};
+    p += len + 2;
+    for (long long j = 1; j < argc; ++j) {
+        if ((len = nextBulk(&p, end)) < 0) return;
+        maskBefore[j & 1] = mask;
+        if (j >= argc - 2 && !base64int2ll(p, len, &ids[j - (argc - 2)]))
+            ids[j - (argc - 2)] = -1;
+        if (j >= oc->firstField && (j - oc->firstField) % oc->fieldStep == 0) {
+            uint32_t h;
+            MurmurHash3_x86_32(p, (int)len, keyHash, &h);
+            mask |= (uint64_t)1 << (h & 63);
+        }
+        p += len + 2;
+    }
+    if (argc > oc->firstField + 2 && ids[0] == clientId && ids[1] == requestId)
+        mask = maskBefore[(argc - 2) & 1];
+    if (mask == 0) return;
+    *opClass = oc->opClass;
+    *fieldMask = mask;
+}
+
+/* Same as classifyRequest() for a command already parsed in 'argv', without
+ * its RIFL ids. */
+void witnessClassifyCommand(robj **argv, int argc, uint32_t keyHash,
+                            uint8_t *opClass, uint64_t *fieldMask) {
+    struct witnessOpClass *oc;
+    uint64_t mask = 0;
+
+    *opClass = WITNESS_OP_OTHER;
+    *fieldMask = 0;
+    if (argc < 2 || !sdsEncodedObject(argv[0])) return;
+    oc = lookupWitnessOpClass(argv[0]->ptr, sdslen(argv[0]->ptr));
+    if (oc == NULL) return;
+    if (oc->firstField == 0) {
+        *opClass = oc->opClass;
+        return;
+    }
+
+    for (int j = oc->firstField; j < argc; j += oc->fieldStep) {
+        /* Hash commands may have encoded their arguments in place. */
+        robj *field = getDecodedObject(argv[j]);
+        uint32_t h;
+        MurmurHash3_x86_32(field->ptr, (int)sdslen(field->ptr), keyHash, &h);
+        mask |= (uint64_t)1 << (h & 63);
+        decrRefCount(field);
+    }
+    if (mask == 0) return;
+    *opClass = oc->opClass;
+    *fieldMask = mask;
+}
+
+/* Return true if a request of class 'opClass' writing 'fieldMask' may be
+ * recorded next to a record of class 'prevClass' writing 'prevMask', which
+ * is for the same key. */
+bool witnessOpsCommute(uint8_t prevClass, uint64_t prevMask,
+                       uint8_t opClass, uint64_t fieldMask) {
+    switch (opClass) {
+    case WITNESS_OP_COUNTER:
+    case WITNESS_OP_SET_ADD:
+        return prevClass == opClass;
+    case WITNESS_OP_HASH_WRITE:
+    case WITNESS_OP_HASH_COUNTER:
+        if (prevClass != WITNESS_OP_HASH_WRITE &&
+            prevClass != WITNESS_OP_HASH_COUNTER) return false;
+        /* Increments of the same field still add up to the same value. */
+        if (opClass == WITNESS_OP_HASH_COUNTER &&
+            prevClass == WITNESS_OP_HASH_COUNTER) return true;
+        return (prevMask & fieldMask) == 0;
+    default:
+        return false;
+    }
+}
+
+/* Record a request for the master. Returns RECORD_ACCEPTED if the witness
+ * keeps it, RECORD_REJECTED if the client must take the slow path, or
+ * RECORD_BAD_GEOMETRY. */
+static int recordRequest(long long masterId, long hashIndex,
+                         long long keyHash, long long clientId,
+                         long long requestId, void *data, size_t requestSize) {
+    struct Master* buffer = lookupMaster((uint64_t)masterId);
+    if (buffer == NULL) {
+        /* The master hasn't registered (yet): we can't promise to keep the
+         * record, so the client must take the slow path. */
+        return RECORD_REJECTED;
+    }
+    if (!hashIndexOk(hashIndex, keyHash)) return RECORD_BAD_GEOMETRY;
+    hashIndex = (uint32_t)keyHash & (buffer->numEntries - 1);
 
     buffer->totalRecordRpcs++;
     // Sanity check.
     if (!buffer->writable) {
-        addReply(c, shared.witnessReject);
-        return;
+        return RECORD_REJECTED;
     }
 
-    int slot = WITNESS_ASSOCIATIVITY; // This means not available.
-    for (int i = 0; i < WITNESS_ASSOCIATIVITY; ++i) {
-        if (buffer->table[hashIndex].occupied[i]) {
+    uint8_t opClass = WITNESS_OP_OTHER;
+    uint64_t fieldMask = 0;
+    if (server.witness_commutativity)
+        classifyRequest(data, requestSize, (uint32_t)keyHash, clientId,
+                        requestId, &opClass, &fieldMask);
+
+    struct Slot *bucket = getBucket(buffer, hashIndex);
+    uint32_t ways = buffer->associativity;
+    uint32_t slot = ways; // This means not available.
+    bool commuted = false;
+    for (uint32_t i = 0; i < ways; ++i) {
+        if (bucket[i].occupied) {
             // Check slot has obsolete RPC.
-            if (buffer->totalGcRpcs - buffer->table[hashIndex].GcSeqNum[i] > 100) {
+            if (buffer->totalGcRpcs - bucket[i].GcSeqNum > 100) {
                 // Temporary hack. assuming the timing gap between witness
                 // and master RPCs are not over 40ms.
                 // If the entry has been stayed over 1000 cycles, just delete.
 //                serverLog(LL_NOTICE,"Obsolete witness record detected. Re-using this slot");
+                freeSlot(&bucket[i]);
                 --buffer->occupiedCount;
                 slot = i;
-                break;
-            } else if (buffer->totalGcRpcs - buffer->table[hashIndex].GcSeqNum[i] > 2) {
+                // Keep scanning: a later way may hold the same key.
+                continue;
+            } else if (buffer->totalGcRpcs - bucket[i].GcSeqNum > 2) {
                 // Put it in ObsoleteRecords.
-                addToObsoleteRpcs(hashIndex, clientId, requestId);
+                addToObsoleteRpcs(buffer, &bucket[i]);
             }
 
-            if (buffer->table[hashIndex].keyHash[i] == (uint32_t)keyHash) {
+            if (bucket[i].keyHash == (uint32_t)keyHash) {
+                if (opClass != WITNESS_OP_OTHER &&
+                    witnessOpsCommute(bucket[i].opClass, bucket[i].fieldMask,
+                                      opClass, fieldMask)) {
+                    commuted = true;
+                    continue;
+                }
                 // KeyHash collision with existing request.
-                slot = WITNESS_ASSOCIATIVITY;
+                slot = ways;
                 buffer->trueCollision++;
                 break;
             }
@@ -131,119 +709,223 @@ void wrecordCommand(client *c) {
             slot = i;
         }
     }
-    if (slot < WITNESS_ASSOCIATIVITY) {
-        buffer->table[hashIndex].occupied[slot] = true;
-        buffer->table[hashIndex].keyHash[slot] = (uint32_t)keyHash;
-        buffer->table[hashIndex].requestSize[slot] = requestSize;
-        buffer->table[hashIndex].clientId[slot] = clientId;
-        buffer->table[hashIndex].requestId[slot] = requestId;
-        memcpy(buffer->table[hashIndex].request[slot], data, requestSize);
-        buffer->table[hashIndex].GcSeqNum[slot] = buffer->totalGcRpcs;
-        addReply(c, shared.witnessAccept);
+    if (slot < ways) {
+        bucket[slot].occupied = true;
+        bucket[slot].keyHash = (uint32_t)keyHash;
+        bucket[slot].requestSize = requestSize;
+        bucket[slot].clientId = clientId;
+        bucket[slot].requestId = requestId;
+        bucket[slot].requestRef = slabStore(&recordSlab, data, requestSize);
+        bucket[slot].GcSeqNum = buffer->totalGcRpcs;
+        bucket[slot].opClass = opClass;
+        bucket[slot].fieldMask = fieldMask;
         ++buffer->occupiedCount;
-    } else {
+        if (commuted) buffer->commutedRecords++;
+        return RECORD_ACCEPTED;
+    }
+    buffer->totalRejection++;
+    return RECORD_REJECTED;
+}
+
+static void addReplyRecordResult(client *c, int result) {
+    if (result == RECORD_ACCEPTED)
+        addReply(c, shared.witnessAccept);
+    else if (result == RECORD_REJECTED)
         addReply(c, shared.witnessReject);
-        buffer->totalRejection++;
-#if 0
-        char* dataInStr = malloc(buffer->table[hashIndex].requestSize + 1);
-        memcpy(dataInStr, buffer->table[hashIndex].request, buffer->table[hashIndex].requestSize);
-        dataInStr[buffer->table[hashIndex].requestSize] = 0;
-        serverLog(LL_NOTICE,"Witness record request rejected. Occupied by data: %s "
-                "======== (size: %d, clientId: %"PRId64", requestId: %"PRId64")\n",
-                dataInStr, buffer->table[hashIndex].requestSize, buffer->table[hashIndex].clientId,
-                buffer->table[hashIndex].requestId);
-        free(dataInStr);
-#endif
+    else
+        addReplyWitnessGeometry(c);
+}
+
+/* WRECORD <record>, or in text form
+ * WRECORD <masterId> <hashIndex> <keyHash> <clientId> <requestId> <request>
+ * See witnessProto.h for the layouts. */
+void wrecordCommand(client *c) {
+    long hashIndex;
+    long long masterId, keyHash, clientId, requestId;
+
+    if (c->argc == 2) {
+        sds rec = c->argv[1]->ptr;
+        if (sdslen(rec) < WITNESS_RECORD_HDR_LEN) {
+            addReplyError(c,"malformed binary WRECORD");
+            return;
+        }
+        masterId = (long long)witnessLoad64(rec);
+        keyHash = witnessLoad32(rec + 8);
+        hashIndex = witnessLoad32(rec + 12);
+        clientId = (long long)witnessLoad64(rec + 16);
+        requestId = (long long)witnessLoad64(rec + 24);
+        addReplyRecordResult(c, recordRequest(masterId, hashIndex, keyHash,
+                clientId, requestId, rec + WITNESS_RECORD_HDR_LEN,
+                sdslen(rec) - WITNESS_RECORD_HDR_LEN));
+        return;
+    }
+    if (c->argc != 7) {
+        addReplyErrorFormat(c,"wrong number of arguments for '%s' command",
+            c->cmd->name);
+        return;
+    }
+    if (getLongLongFromObjectInBase64OrReply(c, c->argv[1], &masterId, NULL) != C_OK) return;
+    if (getLongFromObjectInBase64OrReply(c, c->argv[2], &hashIndex, NULL) != C_OK) return;
+    if (getLongLongFromObjectInBase64OrReply(c, c->argv[3], &keyHash, NULL) != C_OK) return;
+    if (getLongLongFromObjectInBase64OrReply(c, c->argv[4], &clientId, NULL) != C_OK) return;
+    if (getLongLongFromObjectInBase64OrReply(c, c->argv[5], &requestId, NULL) != C_OK) return;
+    addReplyRecordResult(c, recordRequest(masterId, hashIndex, keyHash,
+            clientId, requestId, c->argv[6]->ptr, sdslen(c->argv[6]->ptr)));
+}
+
+/* WMRECORD <record> [<record> ...]
+ * Records several requests with one command, each argument being a binary
+ * WRECORD payload. Every request is accepted or rejected on its own, and the
+ * reply is a bulk string bitmap with bit i set if the i-th one was accepted
+ * (see witnessProto.h). If any hash index was computed with a stale geometry
+ * nothing is recorded and -WGEOMETRY is returned, as for WRECORD. */
+void wmrecordCommand(client *c) {
+    int count = c->argc - 1;
+
+    for (int i = 1; i < c->argc; ++i) {
+        sds rec = c->argv[i]->ptr;
+        if (sdslen(rec) < WITNESS_RECORD_HDR_LEN) {
+            addReplyError(c,"malformed binary WMRECORD");
+            return;
+        }
+        if (!hashIndexOk(witnessLoad32(rec + 12), witnessLoad32(rec + 8))) {
+            addReplyWitnessGeometry(c);
+            return;
+        }
     }
+
+    sds bitmap = sdsgrowzero(sdsempty(), (count + 7) / 8);
+    for (int i = 0; i < count; ++i) {
+        sds rec = c->argv[i+1]->ptr;
+        int result = recordRequest((long long)witnessLoad64(rec),
+                witnessLoad32(rec + 12), witnessLoad32(rec + 8),
+                (long long)witnessLoad64(rec + 16),
+                (long long)witnessLoad64(rec + 24),
+                rec + WITNESS_RECORD_HDR_LEN,
+                sdslen(rec) - WITNESS_RECORD_HDR_LEN);
+        if (result == RECORD_ACCEPTED) bitmap[i/8] |= 1 << (i%8);
+    }
+    addReplyBulkSds(c, bitmap);
+}
+
+/* Drop the record of a synced request. */
+static void gcRequest(struct Master *buffer, uint32_t keyHash,
+                      long long clientId, long long requestId) {
+    struct Slot *bucket = getBucket(buffer, keyHash & (buffer->numEntries - 1));
+    for (uint32_t slot = 0; slot < buffer->associativity; ++slot) {
+        if (bucket[slot].occupied &&
+                bucket[slot].clientId == clientId &&
+                bucket[slot].requestId == requestId) {
+            freeSlot(&bucket[slot]);
+            --buffer->occupiedCount;
+            return;
+        }
+    }
+    ++buffer->gcMissedCount;
 }
 
+/* WGC <batch>, or in text form
+ * WGC <masterId> [<keyHash> <clientId> <requestId> ...]
+ * See witnessProto.h for the layouts. Replies with the obsolete records as
+ * [keyHash, clientId, requestId, ...]. */
 void
 witnessGcCommand(client *c) {
-    long masterIdx;
-    if (getLongFromObjectOrReply(c, c->argv[1], &masterIdx, NULL) != C_OK) return;
-
-    struct Master* buffer = &masters[masterIdx];
-
-//    int succeeded = 0, failed = 0;
-    for (int i = 2; i < c->argc; i += 3) {
-        long hashIndex;
-        long long clientId, requestId;
-        if (getLongFromObjectInBase64OrReply(c, c->argv[i], &hashIndex, NULL) != C_OK) return;
-        if (getLongLongFromObjectInBase64OrReply(c, c->argv[i+1], &clientId, NULL) != C_OK) return;
-        if (getLongLongFromObjectInBase64OrReply(c, c->argv[i+2], &requestId, NULL) != C_OK) return;
-
-        bool foundInTable = false;
-        for (int slot = 0; slot < WITNESS_ASSOCIATIVITY; ++slot) {
-            if (buffer->table[hashIndex].occupied[slot] &&
-                    buffer->table[hashIndex].clientId[slot] == clientId &&
-                    buffer->table[hashIndex].requestId[slot] == requestId) {
-                buffer->table[hashIndex].occupied[slot] = false;
-                --buffer->occupiedCount;
-                foundInTable = true;
-    //            succeeded++;
-                break;
-            } else {
-    //            serverLog(LL_NOTICE,"Witness GC failed. hashIndex: %ld, occupied: %d"
-    //                    " clientId: %"PRId64" (given %lld) requestId: %"PRId64" (given %lld)",
-    //                    hashIndex,
-    //                    buffer->table[hashIndex].occupied,
-    //                    buffer->table[hashIndex].clientId, clientId,
-    //                    buffer->table[hashIndex].requestId, requestId);
-    //            failed++;
-            }
+    long long masterId;
+    sds batch = NULL;
+    uint32_t count;
+
+    if (c->argc == 2) {
+        batch = c->argv[1]->ptr;
+        if (sdslen(batch) < WITNESS_GC_HDR_LEN) goto malformed;
+        masterId = (long long)witnessLoad64(batch);
+        count = witnessLoad32(batch + 8);
+        if ((sdslen(batch) - WITNESS_GC_HDR_LEN) / WITNESS_GC_ENTRY_LEN != count ||
+            (sdslen(batch) - WITNESS_GC_HDR_LEN) % WITNESS_GC_ENTRY_LEN != 0)
+            goto malformed;
+    } else {
+        if ((c->argc - 2) % 3 != 0) goto malformed;
+        if (getLongLongFromObjectOrReply(c, c->argv[1], &masterId, NULL) != C_OK) return;
+    }
+
+    struct Master* buffer = lookupMaster((uint64_t)masterId);
+    if (buffer == NULL) {
+        addReplyError(c,"master is not registered with this witness");
+        return;
+    }
+
+    if (batch) {
+        const char *p = batch + WITNESS_GC_HDR_LEN;
+        for (uint32_t i = 0; i < count; ++i, p += WITNESS_GC_ENTRY_LEN) {
+            gcRequest(buffer, witnessLoad32(p), (long long)witnessLoad64(p + 8),
+                    (long long)witnessLoad64(p + 16));
         }
-        if (!foundInTable) {
-            ++buffer->gcMissedCount;
+    } else {
+        for (int i = 2; i < c->argc; i += 3) {
+            long keyHash;
+            long long clientId, requestId;
+            if (getLongFromObjectInBase64OrReply(c, c->argv[i], &keyHash, NULL) != C_OK) return;
+            if (getLongLongFromObjectInBase64OrReply(c, c->argv[i+1], &clientId, NULL) != C_OK) return;
+            if (getLongLongFromObjectInBase64OrReply(c, c->argv[i+2], &requestId, NULL) != C_OK) return;
+            gcRequest(buffer, (uint32_t)keyHash, clientId, requestId);
         }
     }
     ++buffer->totalGcRpcs;
 //    addReply(c, shared.ok);
 
     // Reply with ObsoleteRpcs.
-    addReplyMultiBulkLen(c, obsoleteRpcsSize * 3);
-    for (int i = 0; i < obsoleteRpcsSize; ++i) {
-        addReplyBulkLongLong(c, obsoleteRpcs[i].hashIndex);
-        addReplyBulkLongLong(c, obsoleteRpcs[i].clientId);
-        addReplyBulkLongLong(c, obsoleteRpcs[i].requestId);
+    addReplyMultiBulkLen(c, buffer->obsoleteRpcsSize * 3);
+    for (int i = 0; i < buffer->obsoleteRpcsSize; ++i) {
+        addReplyBulkLongLong(c, buffer->obsoleteRpcs[i].keyHash);
+        addReplyBulkLongLong(c, buffer->obsoleteRpcs[i].clientId);
+        addReplyBulkLongLong(c, buffer->obsoleteRpcs[i].requestId);
     }
-    obsoleteRpcsSize = 0;
+    buffer->obsoleteRpcsSize = 0;
 
 //    serverLog(LL_NOTICE,"Witness GC received. total entries: %d, cleaned: %d, failed: %d",
 //            (c->argc-2)/3, succeeded, failed);
     if (server.unixtime - lastStatPrintTime > 10) {
-        serverLog(LL_NOTICE,"Witness stat.. occupied: %d, use ratio: %2.3f %%, total GC missed count: %d, total GC rpcs: %llu, total rejection: %d, false collision: %d, cumRejectRate: %4.3f %%",
+        serverLog(LL_NOTICE,"Witness stat.. occupied: %d, use ratio: %2.3f %%, total GC missed count: %d, total GC rpcs: %llu, total rejection: %d, false collision: %d, commuted: %d, cumRejectRate: %4.3f %%, record bytes: %zu (allocated: %zu)",
                 buffer->occupiedCount, ((double)buffer->occupiedCount * 100) /
-                WITNESS_NUM_ENTRIES_PER_TABLE / WITNESS_ASSOCIATIVITY,
+                buffer->numEntries / buffer->associativity,
                 buffer->gcMissedCount, buffer->totalGcRpcs, buffer->totalRejection,
                 buffer->totalRejection - buffer->trueCollision,
-                (double)(buffer->totalRejection) * 100 / (double)(buffer->totalRecordRpcs));
+                buffer->commutedRecords,
+                (double)(buffer->totalRejection) * 100 / (double)(buffer->totalRecordRpcs),
+                recordSlab.usedBytes, recordSlab.allocatedBytes);
         lastStatPrintTime = server.unixtime;
     }
+    return;
+
+malformed:
+    addReplyError(c,"malformed WGC");
 }
 
 void witnessGetRecoveryDataCommand(client *c) {
-    long masterIdx;
-    if (getLongFromObjectOrReply(c, c->argv[1], &masterIdx, NULL) != C_OK) return;
+    long long masterId;
+    if (getLongLongFromObjectOrReply(c, c->argv[1], &masterId, NULL) != C_OK) return;
 
-    struct Master* buffer = &masters[masterIdx];
+    struct Master* buffer = lookupMaster((uint64_t)masterId);
+    if (buffer == NULL) {
+        /* Nothing was ever recorded for this master. */
+        addReply(c, shared.emptymultibulk);
+        return;
+    }
+    size_t numSlots = (size_t)buffer->numEntries * buffer->associativity;
     int count = 0;
 //    int totalSize = 0;
-    for (int i = 0; i < WITNESS_NUM_ENTRIES_PER_TABLE; ++i) {
-        for (int slot = 0; slot < WITNESS_ASSOCIATIVITY; ++slot) {
-            if (buffer->table[i].occupied[slot]) {
+    for (size_t i = 0; i < numSlots; ++i) {
+        if (buffer->table[i].occupied) {
     //            totalSize += buffer->table[i].requestSize;
-                count++;
-            }
+            count++;
         }
     }
     addReplyMultiBulkLen(c, count);
 //    addReplyMultiBulkLen(c, totalSize);
-    for (int i = 0; i < WITNESS_NUM_ENTRIES_PER_TABLE; ++i) {
-        for (int slot = 0; slot < WITNESS_ASSOCIATIVITY; ++slot) {
-            if (buffer->table[i].occupied[slot]) {
-                addReplySds(c, sdsnewlen(buffer->table[i].request[slot],
-                                         buffer->table[i].requestSize[slot]));
-            }
+    for (size_t i = 0; i < numSlots; ++i) {
+        if (buffer->table[i].occupied) {
+            addReplySds(c, sdsnewlen(
+                    slabGet(&recordSlab, buffer->table[i].requestRef),
+                    buffer->table[i].requestSize));
         }
     }
-}
\ No newline at end of file
+}
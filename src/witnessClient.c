@@ -0,0 +1,469 @@
+/* Copyright (c) 2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Master side connections to the witnesses.
+ *
+ * At startup we connect and register with every witness synchronously, since
+ * recovery reads from these sockets right away. Once recovery is done the
+ * connections are handed to the event loop: GC RPCs are queued until the
+ * fsync that covers them is done, then written to every connected witness
+ * in parallel without blocking, and the replies (which carry the RPCs the
+ * witness considers obsolete) are parsed as they arrive. A witness that
+ * disconnects, or falls too far behind, is dropped and reconnected from
+ * serverCron(), so it never holds back the fsync pipeline. */
+
+#include "server.h"
+#include "witnessTracker.h"
+#include "rifl.h"
+
+#include <sys/socket.h>
+
+#define WITNESS_CONN_NONE 0         /* Not connected. */
+#define WITNESS_CONN_CONNECTING 1   /* Non blocking connect in progress. */
+#define WITNESS_CONN_REGISTERING 2  /* WREGISTER sent, waiting the reply. */
+#define WITNESS_CONN_CONNECTED 3    /* Ready to take GC RPCs. */
+
+#define WITNESS_MAX_OUTSTANDING_GCS 1024
+#define WITNESS_MAX_SENDBUF (16*1024*1024)
+#define WITNESS_IOBUF_LEN (16*1024)
+
+struct WitnessConn {
+    int state;
+    int fd;
+    sds sendbuf;
+    sds recvbuf;
+    long long entries;          /* Table geometry from the last WREGISTER. */
+    long long assoc;
+    mstime_t connectStart;      /* For the handshake timeout. */
+    int outstandingGcs;         /* GC RPCs sent but not replied yet. */
+    long long gcsSent;
+    long long gcsAcked;
+    long long obsoleteRpcs;     /* Obsolete RPCs reported by the witness. */
+    long long reconnects;
+};
+
+/* GC RPCs waiting for the fsync of their batch. */
+struct PendingGc {
+    long long maxOpNum;
+    sds cmd;
+};
+
+static struct WitnessConn witnessConns[CONFIG_WITNESS_MAX];
+static list *pendingGcs = NULL;
+
+static void witnessReadHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+static void witnessWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/*============================ Connection handling ========================== */
+
+static char *witnessConnStateName(int state) {
+    switch (state) {
+    case WITNESS_CONN_NONE: return "disconnected";
+    case WITNESS_CONN_CONNECTING: return "connecting";
+    case WITNESS_CONN_REGISTERING: return "registering";
+    case WITNESS_CONN_CONNECTED: return "connected";
+    default: return "unknown";
+    }
+}
+
+/* We send witnesses full key hashes, which each one narrows to its own
+ * table, so they may disagree on the geometry. GC batching must not fill up
+ * the smallest table, though. */
+static void updateWitnessGeometry(void) {
+    long long minSlots = 0;
+
+    for (int i = 0; i < server.numWitness; ++i) {
+        struct WitnessConn *wc = &witnessConns[i];
+        if (wc->entries <= 0 || wc->assoc <= 0) continue;
+        if (!minSlots || wc->entries * wc->assoc < minSlots)
+            minSlots = wc->entries * wc->assoc;
+    }
+    if (minSlots) server.witnessTableSlots = minSlots;
+}
+
+static sds witnessRegisterCommand(void) {
+    char idstr[LONG_STR_SIZE];
+    int idlen = ll2string(idstr,sizeof(idstr),server.witness_master_id);
+    return sdscatprintf(sdsempty(),"*2\r\n$9\r\nWREGISTER\r\n$%d\r\n%s\r\n",
+            idlen, idstr);
+}
+
+/* Register with a witness (WREGISTER), which allocates our table there and
+ * replies with its geometry. Returns the number of table entries, or -1 if
+ * the witness didn't answer properly. */
+static long long registerWithWitness(int fd, long long *assoc) {
+    char buf[64];
+    sds cmd = witnessRegisterCommand();
+    long long entries;
+
+    if (syncWrite(fd,cmd,sdslen(cmd),WITNESS_HANDSHAKE_TIMEOUT) == -1) {
+        sdsfree(cmd);
+        return -1;
+    }
+    sdsfree(cmd);
+    if (syncReadLine(fd,buf,sizeof(buf),WITNESS_HANDSHAKE_TIMEOUT) == -1 ||
+        buf[0] != '*') return -1;
+    if (syncReadLine(fd,buf,sizeof(buf),WITNESS_HANDSHAKE_TIMEOUT) == -1 ||
+        buf[0] != ':') return -1;
+    entries = strtoll(buf+1,NULL,10);
+    if (syncReadLine(fd,buf,sizeof(buf),WITNESS_HANDSHAKE_TIMEOUT) == -1 ||
+        buf[0] != ':') return -1;
+    *assoc = strtoll(buf+1,NULL,10);
+    if (entries < 1 || (entries & (entries-1)) != 0) return -1;
+    return entries;
+}
+
+/* Connect and register with every witness, blocking. Called at startup so
+ * that recoverFromWitness() can use the sockets. */
+void connectToWitness() {
+    for (int i = 0; i < server.numWitness; ++i) {
+        struct WitnessConn *wc = &witnessConns[i];
+        if (wc->sendbuf == NULL) {
+            wc->fd = -1;
+            wc->sendbuf = sdsempty();
+            wc->recvbuf = sdsempty();
+        }
+        if (server.fdToWitness[i] > 0) {
+            continue;
+        }
+        char err[ANET_ERR_LEN];
+        server.fdToWitness[i] = anetTcpConnect(err, server.addrToWitness[i], server.port);
+        if (server.fdToWitness[i] == ANET_ERR) {
+            serverLog(LL_WARNING, "Error connecting to witness:%s", server.addrToWitness[i]);
+            continue;
+        }
+
+        long long assoc;
+        long long entries = registerWithWitness(server.fdToWitness[i], &assoc);
+        if (entries == -1) {
+            serverLog(LL_WARNING, "Witness %s didn't reply to WREGISTER.",
+                    server.addrToWitness[i]);
+            close(server.fdToWitness[i]);
+            server.fdToWitness[i] = -1;
+            continue;
+        }
+        wc->fd = server.fdToWitness[i];
+        wc->entries = entries;
+        wc->assoc = assoc;
+        wc->state = WITNESS_CONN_CONNECTED;
+    }
+    updateWitnessGeometry();
+}
+
+/* Hand the witness connections to the event loop. Must be called after
+ * recovery is done with the sockets. */
+void witnessClientStart(void) {
+    pendingGcs = listCreate();
+    for (int i = 0; i < server.numWitness; ++i) {
+        struct WitnessConn *wc = &witnessConns[i];
+        if (wc->state != WITNESS_CONN_CONNECTED) continue;
+        anetNonBlock(NULL, wc->fd);
+        anetEnableTcpNoDelay(NULL, wc->fd);
+        if (aeCreateFileEvent(server.el, wc->fd, AE_READABLE,
+                    witnessReadHandler, (void*)(long)i) == AE_ERR) {
+            serverLog(LL_WARNING, "Can't watch witness %s connection.",
+                    server.addrToWitness[i]);
+        }
+    }
+}
+
+static void witnessConnDrop(int i, const char *reason) {
+    struct WitnessConn *wc = &witnessConns[i];
+
+    /* Failed reconnection attempts aren't news. */
+    serverLog(wc->state == WITNESS_CONN_CONNECTED ? LL_WARNING : LL_VERBOSE,
+            "Dropping connection to witness %s: %s "
+            "(%d GC RPCs unacknowledged).", server.addrToWitness[i], reason,
+            wc->outstandingGcs);
+    if (wc->fd != -1) {
+        aeDeleteFileEvent(server.el, wc->fd, AE_READABLE|AE_WRITABLE);
+        close(wc->fd);
+    }
+    wc->fd = -1;
+    server.fdToWitness[i] = -1;
+    wc->state = WITNESS_CONN_NONE;
+    wc->outstandingGcs = 0;
+    sdsclear(wc->sendbuf);
+    sdsclear(wc->recvbuf);
+}
+
+/* Give up on a witness connection, e.g. after a failed recovery. It is
+ * reconnected by witnessClientCron(). */
+void witnessClientDisconnect(int i, const char *reason) {
+    witnessConnDrop(i, reason);
+}
+
+/* Write as much of the send buffer as the socket takes, and watch for
+ * writability only while something is left. */
+static void witnessConnFlush(int i) {
+    struct WitnessConn *wc = &witnessConns[i];
+
+    while (sdslen(wc->sendbuf) > 0) {
+        ssize_t nwritten = write(wc->fd, wc->sendbuf, sdslen(wc->sendbuf));
+        if (nwritten <= 0) {
+            if (nwritten == -1 && errno == EAGAIN) break;
+            witnessConnDrop(i, nwritten == -1 ? strerror(errno) : "write failed");
+            return;
+        }
+        sdsrange(wc->sendbuf, nwritten, -1);
+    }
+    if (sdslen(wc->sendbuf) > 0) {
+        aeCreateFileEvent(server.el, wc->fd, AE_WRITABLE,
+                witnessWriteHandler, (void*)(long)i);
+    } else {
+        aeDeleteFileEvent(server.el, wc->fd, AE_WRITABLE);
+    }
+}
+
+static void witnessWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    int i = (long)privdata;
+    struct WitnessConn *wc = &witnessConns[i];
+    UNUSED(el);
+    UNUSED(mask);
+
+    if (wc->state == WITNESS_CONN_CONNECTING) {
+        int sockerr = 0;
+        socklen_t errlen = sizeof(sockerr);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &sockerr, &errlen) == -1)
+            sockerr = errno;
+        if (sockerr) {
+            witnessConnDrop(i, strerror(sockerr));
+            return;
+        }
+        wc->state = WITNESS_CONN_REGISTERING;
+        server.fdToWitness[i] = fd;
+        sds cmd = witnessRegisterCommand();
+        wc->sendbuf = sdscatsds(wc->sendbuf, cmd);
+        sdsfree(cmd);
+        if (aeCreateFileEvent(server.el, fd, AE_READABLE,
+                    witnessReadHandler, privdata) == AE_ERR) {
+            witnessConnDrop(i, "can't create readable event");
+            return;
+        }
+    }
+    witnessConnFlush(i);
+}
+
+/*=============================== Reply parsing ============================= */
+
+/* Parse the integer or bulk string integer at *pp, advancing *pp past it.
+ * Returns 1 on success, 0 if the buffer doesn't hold the whole element yet,
+ * and -1 on protocol error. */
+static int parseIntegerElement(char **pp, char *end, long long *val) {
+    char *p = *pp, *cr;
+    long long blen;
+
+    if (p >= end) return 0;
+    cr = memchr(p, '\r', end - p);
+    if (cr == NULL || cr + 1 >= end) return 0;
+    if (*p == ':') {
+        if (!string2ll(p+1, cr-p-1, val)) return -1;
+        *pp = cr + 2;
+        return 1;
+    }
+    if (*p != '$' || !string2ll(p+1, cr-p-1, &blen) || blen < 0) return -1;
+    p = cr + 2;
+    if (end - p < blen + 2) return 0;
+    if (!string2ll(p, blen, val)) return -1;
+    *pp = p + blen + 2;
+    return 1;
+}
+
+/* The witness reports RPCs that sat in its table for a while. If we already
+ * executed one of them, it is GCed again with the next batch. */
+static void handleObsoleteRpcs(int i, long long *vals, long long count) {
+    for (long long j = 0; j + 2 < count; j += 3) {
+        witnessConns[i].obsoleteRpcs++;
+        if (riflIsProcessed(vals[j+1], vals[j+2]))
+            retrackUnsyncedRpc(vals[j], vals[j+1], vals[j+2]);
+    }
+}
+
+/* Process one reply at the head of the receive buffer. Returns the number
+ * of bytes consumed, 0 if the reply is incomplete, or -1 on error (the
+ * connection is dropped then). */
+static long processWitnessReply(int i) {
+    struct WitnessConn *wc = &witnessConns[i];
+    char *start = wc->recvbuf, *end = start + sdslen(wc->recvbuf);
+    char *p = start, *cr;
+    long long count, *vals = NULL;
+    long consumed = 0;
+
+    cr = memchr(p, '\r', end - p);
+    if (cr == NULL || cr + 1 >= end) return 0;
+    if (*p == '-') {
+        serverLog(LL_WARNING, "Witness %s replied error: %.*s",
+                server.addrToWitness[i], (int)(cr-p-1), p+1);
+        if (wc->state != WITNESS_CONN_CONNECTED) {
+            witnessConnDrop(i, "registration refused");
+            return -1;
+        }
+        if (wc->outstandingGcs > 0) wc->outstandingGcs--;
+        wc->gcsAcked++;
+        return cr + 2 - start;
+    }
+    if (*p != '*' || !string2ll(p+1, cr-p-1, &count) || count < 0) goto fmterr;
+    p = cr + 2;
+    if (count) vals = zmalloc(sizeof(long long) * count);
+    for (long long j = 0; j < count; ++j) {
+        int ret = parseIntegerElement(&p, end, &vals[j]);
+        if (ret == 0) goto done;
+        if (ret == -1) goto fmterr;
+    }
+    consumed = p - start;
+
+    if (wc->state == WITNESS_CONN_REGISTERING) {
+        if (count != 2 || vals[0] < 1 || (vals[0] & (vals[0]-1)) != 0)
+            goto fmterr;
+        wc->entries = vals[0];
+        wc->assoc = vals[1];
+        wc->state = WITNESS_CONN_CONNECTED;
+        serverLog(LL_NOTICE, "Registered with witness %s.",
+                server.addrToWitness[i]);
+        updateWitnessGeometry();
+    } else {
+        if (wc->outstandingGcs > 0) wc->outstandingGcs--;
+        wc->gcsAcked++;
+        handleObsoleteRpcs(i, vals, count);
+    }
+
+done:
+    zfree(vals);
+    return consumed;
+
+fmterr:
+    zfree(vals);
+    witnessConnDrop(i, "protocol error");
+    return -1;
+}
+
+static void witnessReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    int i = (long)privdata;
+    struct WitnessConn *wc = &witnessConns[i];
+    char buf[WITNESS_IOBUF_LEN];
+    ssize_t nread;
+    long consumed;
+    UNUSED(el);
+    UNUSED(mask);
+
+    nread = read(fd, buf, sizeof(buf));
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        witnessConnDrop(i, nread == 0 ? "connection closed" : strerror(errno));
+        return;
+    }
+    wc->recvbuf = sdscatlen(wc->recvbuf, buf, nread);
+    while (sdslen(wc->recvbuf) > 0 &&
+           (consumed = processWitnessReply(i)) > 0) {
+        sdsrange(wc->recvbuf, consumed, -1);
+    }
+}
+
+/*================================ GC pipeline ============================== */
+
+/* Queue a WGC command to be sent once everything up to maxOpNum is fsynced.
+ * Takes ownership of cmd. */
+void witnessClientQueueGc(long long maxOpNum, sds cmd) {
+    struct PendingGc *gc = zmalloc(sizeof(*gc));
+    gc->maxOpNum = maxOpNum;
+    gc->cmd = cmd;
+    listAddNodeTail(pendingGcs, gc);
+}
+
+/* Send the GC RPCs whose fsync is done to all connected witnesses. Called
+ * by the group commit each time aof_last_fsync_opNum moves. */
+void witnessClientSendDueGcs(void) {
+    listNode *ln;
+
+    if (pendingGcs == NULL) return;
+    while ((ln = listFirst(pendingGcs)) != NULL) {
+        struct PendingGc *gc = listNodeValue(ln);
+        if (gc->maxOpNum > server.aof_last_fsync_opNum) break;
+
+        for (int i = 0; i < server.numWitness; ++i) {
+            struct WitnessConn *wc = &witnessConns[i];
+            /* A disconnected witness misses this GC; it reports the records
+             * as obsolete later on and we GC them again. */
+            if (wc->state != WITNESS_CONN_CONNECTED) continue;
+            if (wc->outstandingGcs >= WITNESS_MAX_OUTSTANDING_GCS ||
+                sdslen(wc->sendbuf) > WITNESS_MAX_SENDBUF) {
+                witnessConnDrop(i, "witness is too slow");
+                continue;
+            }
+            wc->sendbuf = sdscatsds(wc->sendbuf, gc->cmd);
+            wc->outstandingGcs++;
+            wc->gcsSent++;
+        }
+        sdsfree(gc->cmd);
+        zfree(gc);
+        listDelNode(pendingGcs, ln);
+    }
+    for (int i = 0; i < server.numWitness; ++i) {
+        if (witnessConns[i].state == WITNESS_CONN_CONNECTED &&
+            sdslen(witnessConns[i].sendbuf) > 0) {
+            witnessConnFlush(i);
+            debugCrashPoint(CRASH_POINT_GC);
+        }
+    }
+}
+
+/* Called every second by serverCron(): reconnect lost witnesses and time
+ * out stuck handshakes. */
+void witnessClientCron(void) {
+    for (int i = 0; i < server.numWitness; ++i) {
+        struct WitnessConn *wc = &witnessConns[i];
+
+        if ((wc->state == WITNESS_CONN_CONNECTING ||
+             wc->state == WITNESS_CONN_REGISTERING) &&
+            mstime() - wc->connectStart > WITNESS_HANDSHAKE_TIMEOUT) {
+            witnessConnDrop(i, "handshake timeout");
+        }
+        if (wc->state != WITNESS_CONN_NONE) continue;
+
+        char err[ANET_ERR_LEN];
+        int fd = anetTcpNonBlockConnect(err, server.addrToWitness[i], server.port);
+        if (fd == ANET_ERR) {
+            serverLog(LL_VERBOSE, "Error reconnecting to witness %s: %s",
+                    server.addrToWitness[i], err);
+            continue;
+        }
+        anetEnableTcpNoDelay(NULL, fd);
+        if (aeCreateFileEvent(server.el, fd, AE_WRITABLE,
+                    witnessWriteHandler, (void*)(long)i) == AE_ERR) {
+            close(fd);
+            continue;
+        }
+        wc->fd = fd;
+        wc->state = WITNESS_CONN_CONNECTING;
+        wc->connectStart = mstime();
+        wc->reconnects++;
+    }
+}
+
+sds genWitnessClientInfoString(sds info) {
+    info = sdscatprintf(info, "witness_pending_gcs:%lu\r\n",
+            pendingGcs ? listLength(pendingGcs) : 0);
+    for (int i = 0; i < server.numWitness; ++i) {
+        struct WitnessConn *wc = &witnessConns[i];
+        info = sdscatprintf(info,
+            "witness%d:addr=%s,state=%s,outstanding_gcs=%d,gcs_sent=%lld,"
+            "gcs_acked=%lld,obsolete_rpcs=%lld,reconnects=%lld\r\n",
+            i, server.addrToWitness[i], witnessConnStateName(wc->state),
+            wc->outstandingGcs, wc->gcsSent, wc->gcsAcked, wc->obsoleteRpcs,
+            wc->reconnects);
+    }
+    return info;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2017 Stanford University.
+ * All rights reserved.
+ */
+
+#ifndef __WITNESSPROTO_H
+#define __WITNESSPROTO_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "endianconv.h"
+
+/* Binary form of the WRECORD and WGC commands.
+ *
+ * The text forms take every field as its own base64 argument, which costs
+ * the witness one object and one parse per field. The binary forms carry a
+ * fixed layout payload in a single bulk string, read in place. Integers are
+ * little endian; reserved fields must be zero.
+ *
+ *   WRECORD <record>
+ *     masterId u64 | keyHash u32 | hashIndex u32 | clientId i64 |
+ *     requestId i64 | request (the RESP encoded command, up to the end)
+ *
+ *   WMRECORD <record> [<record> ...]
+ *     Same records as WRECORD. The reply is a bulk string bitmap of
+ *     ceil(N/8) bytes: bit (i % 8) of byte i / 8 is set if the i-th record
+ *     was accepted.
+ *
+ *   WGC <batch>
+ *     masterId u64 | count u32 | reserved u32 | count * entry
+ *     entry: keyHash u32 | reserved u32 | clientId i64 | requestId i64
+ *     The witness narrows keyHash to its own table, so a GC still finds
+ *     its record after the table was resized.
+ *
+ * The text forms, "WRECORD <masterId> <hashIndex> <keyHash> <clientId>
+ * <requestId> <request>" and "WGC <masterId> [<keyHash> <clientId>
+ * <requestId> ...]", are still accepted, which is handy for debugging. */
+
+#define WITNESS_RECORD_HDR_LEN 32
+#define WITNESS_GC_HDR_LEN 16
+#define WITNESS_GC_ENTRY_LEN 24
+
+static inline uint32_t witnessLoad32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return intrev32ifbe(v);
+}
+
+static inline uint64_t witnessLoad64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return intrev64ifbe(v);
+}
+
+static inline void witnessStore32(char *p, uint32_t v) {
+    v = intrev32ifbe(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline void witnessStore64(char *p, uint64_t v) {
+    v = intrev64ifbe(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+#endif
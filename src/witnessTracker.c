@@ -21,6 +21,11 @@
 #include "MurmurHash3.h"
 #include "rifl.h"
 #include "timeTrace.h"
+#include "witnessTracker.h"
+#include "witnessProto.h"
+#include "crc64.h"
+
+#include <poll.h>
 
 /* functions from aof.c */
 struct client *createFakeClient();
@@ -30,17 +35,76 @@ void freeFakeClient(struct client *c);
 /*================================= Globals ================================= */
 
 /* Global vars */
-#define WITNESS_BATCH_SIZE 40
+
+/* Unsynced RPCs are GCed from witnesses in batches, and every batch rides on
+ * one fsync. Bigger batches mean fewer fsyncs and WGC RPCs, but records stay
+ * longer at the witnesses where they take slots and cause rejections. A batch
+ * is flushed from beforeSleep(), once the AOF buffer reached the kernel, as
+ * soon as one of the following holds:
+ *  - its oldest RPC is older than witness-batch-max-age microseconds;
+ *  - it reached the target size, which is the rate of unsynced RPCs divided
+ *    by witness-fsync-rate, so we fsync about as often as configured;
+ *  - it plus the batches still being fsynced would take more than
+ *    witness-batch-max-occupancy percent of the witness table. */
+#define WITNESS_BATCH_INIT_CAPACITY 64
+#define WITNESS_MAX_INFLIGHT_BATCHES 64
+#define WITNESS_BATCH_HIST_BUCKETS 13 /* 1, 2, 4, ..., 4096 and more. */
+#define WITNESS_RATE_SAMPLE_PERIOD 100 /* Milliseconds. */
 
 struct WitnessGcInfo {
-    int hashIndex;
+    uint32_t keyHash;
     long long clientId;
     long long requestId;
 };
 
-/* 0th index is not used. */
-struct WitnessGcInfo unsyncedRpcs[WITNESS_BATCH_SIZE] = {{0,0,0}, };
+struct WitnessGcInfo *unsyncedRpcs = NULL;
 int unsyncedRpcsSize = 0;
+static int unsyncedRpcsCapacity = 0;
+static long long batchStartTime = 0; /* ustime() of the oldest unsynced RPC. */
+static bool batchTimerArmed = false;
+
+/* Batches handed to the BIO thread whose fsync may not be done yet. Their
+ * records are still held by the witnesses. */
+static struct {
+    long long maxOpNum;
+    int size;
+} inflightBatches[WITNESS_MAX_INFLIGHT_BATCHES];
+static int inflightHead = 0, inflightCount = 0;
+static long long inflightRpcs = 0;
+
+/* Load estimation, updated by witnessBatchCron(). */
+static long long trackedSinceSample = 0;
+static long long lastSampleTime = 0;
+static double unsyncedRpcRate = 0; /* RPCs per second, moving average. */
+static long long targetBatchSize = 1;
+
+/* Statistics reported by INFO witness. */
+static struct {
+    long long batches;
+    long long rpcs;
+    long long bySize;
+    long long byAge;
+    long long byOccupancy;
+    long long sizeHist[WITNESS_BATCH_HIST_BUCKETS];
+} batchStats;
+
+/* What the recovery from witnesses found, also reported by INFO witness. */
+struct RecoveryStats {
+    long long received;     /* Requests received from all witnesses. */
+    long long duplicates;   /* Copies of a request another witness sent. */
+    long long mismatched;   /* Copies that differ from the first one. */
+    long long filteredByRifl;
+    long long replayed;
+};
+static struct RecoveryStats recoveryStats;
+static int recoveryWitnesses;
+
+enum {
+    FLUSH_NONE = 0,
+    FLUSH_BY_SIZE,
+    FLUSH_BY_AGE,
+    FLUSH_BY_OCCUPANCY
+};
 
 struct WitnessGcBioContext {
     long long maxOpNum;
@@ -48,184 +112,626 @@ struct WitnessGcBioContext {
 };
 
 /*================================= Functions =============================== */
-void scheduleFsyncAndWitnessGc() {
-    record("start constructing gc RPC.", 0, 0, 0, 0);
-    char* masterIdxStr = "1";
+/* Text WGC, see witnessProto.h. Only used for debugging. */
+static sds buildTextGcCommand(void) {
+    char masterIdxStr[LONG_STR_SIZE];
+    ll2string(masterIdxStr, sizeof(masterIdxStr), server.witness_master_id);
     sds cmdstr = sdscatprintf(sdsempty(), "*%d\r\n$3\r\nWGC\r\n$%d\r\n%s\r\n",
             2 + 3 * unsyncedRpcsSize, (int)strlen(masterIdxStr), masterIdxStr);
     for (int i = 0; i < unsyncedRpcsSize; ++i) {
-        int hashIndex_len, clientId_len, requestId_len;
-        char hashIndex_str[LONG_STR_SIZE];
+        int keyHash_len, clientId_len, requestId_len;
+        char keyHash_str[LONG_STR_SIZE];
         char clientId_str[LONG_STR_SIZE];
         char requestId_str[LONG_STR_SIZE];
 
-        hashIndex_len = ulltoa64(hashIndex_str, sizeof(hashIndex_str),
-                unsyncedRpcs[i].hashIndex);
+        keyHash_len = ulltoa64(keyHash_str, sizeof(keyHash_str),
+                unsyncedRpcs[i].keyHash);
         clientId_len = ulltoa64(clientId_str, sizeof(clientId_str),
                 unsyncedRpcs[i].clientId);
         requestId_len = ulltoa64(requestId_str, sizeof(requestId_str),
                 unsyncedRpcs[i].requestId);
-//        hashIndex_len = ll2string(hashIndex_str, sizeof(hashIndex_str),
-//                unsyncedRpcs[i].hashIndex);
-//        clientId_len = ll2string(clientId_str, sizeof(clientId_str),
-//                unsyncedRpcs[i].clientId);
-//        requestId_len = ll2string(requestId_str, sizeof(requestId_str),
-//                unsyncedRpcs[i].requestId);
         cmdstr = sdscatprintf(cmdstr, "$%d\r\n%s\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n",
-                hashIndex_len, hashIndex_str, clientId_len, clientId_str, requestId_len, requestId_str);
+                keyHash_len, keyHash_str, clientId_len, clientId_str, requestId_len, requestId_str);
+    }
+    return cmdstr;
+}
+
+/* Binary WGC: the whole batch in a single bulk string. */
+static sds buildBinaryGcCommand(void) {
+    size_t len = WITNESS_GC_HDR_LEN + (size_t)unsyncedRpcsSize * WITNESS_GC_ENTRY_LEN;
+    sds cmdstr = sdscatprintf(sdsempty(), "*2\r\n$3\r\nWGC\r\n$%zu\r\n", len);
+    size_t off = sdslen(cmdstr);
+
+    cmdstr = sdsgrowzero(cmdstr, off + len);
+    char *p = cmdstr + off;
+    witnessStore64(p, (uint64_t)server.witness_master_id);
+    witnessStore32(p + 8, (uint32_t)unsyncedRpcsSize);
+    p += WITNESS_GC_HDR_LEN;
+    for (int i = 0; i < unsyncedRpcsSize; ++i, p += WITNESS_GC_ENTRY_LEN) {
+        witnessStore32(p, unsyncedRpcs[i].keyHash);
+        witnessStore64(p + 8, (uint64_t)unsyncedRpcs[i].clientId);
+        witnessStore64(p + 16, (uint64_t)unsyncedRpcs[i].requestId);
     }
+    return sdscatlen(cmdstr, "\r\n", 2);
+}
+
+void scheduleFsyncAndWitnessGc() {
+    record("start constructing gc RPC.", 0, 0, 0, 0);
+    sds cmdstr = server.witness_binary_protocol ?
+            buildBinaryGcCommand() : buildTextGcCommand();
     unsyncedRpcsSize = 0;
 
     record("constructed gc RPC.", 0, 0, 0, 0);
-    bioCreateBackgroundJob(BIO_FSYNC_AND_GC_WITNESS, (void*)cmdstr,
-            (void*)(long)server.aof_fd, server.currentOpNum);
-    record("bioBackgroundJob Created.", 0, 0, 0, 0);
+    witnessClientQueueGc(server.currentOpNum, cmdstr);
+    aofRequestFsync(server.currentOpNum);
+    record("fsync requested.", 0, 0, 0, 0);
+}
+
+static int batchTimerProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
+
+/* Number of unsynced RPCs we allow at the witnesses at once. */
+static long long occupancyLimit(void) {
+    long long limit = server.witnessTableSlots *
+                      server.witness_batch_max_occupancy / 100;
+    return limit > 0 ? limit : 1;
+}
+
+/* Forget the batches whose fsync is already done. */
+static void retireInflightBatches(void) {
+    while (inflightCount > 0 &&
+           inflightBatches[inflightHead].maxOpNum <= server.aof_last_fsync_opNum) {
+        inflightRpcs -= inflightBatches[inflightHead].size;
+        inflightHead = (inflightHead + 1) % WITNESS_MAX_INFLIGHT_BATCHES;
+        --inflightCount;
+    }
+}
+
+static void addInflightBatch(long long maxOpNum, int size) {
+    if (inflightCount == WITNESS_MAX_INFLIGHT_BATCHES) {
+        /* The BIO thread is far behind. Fold into the newest batch: it is
+         * fsynced last, so we never underestimate occupancy. */
+        int last = (inflightHead + inflightCount - 1) % WITNESS_MAX_INFLIGHT_BATCHES;
+        inflightBatches[last].maxOpNum = maxOpNum;
+        inflightBatches[last].size += size;
+    } else {
+        int next = (inflightHead + inflightCount) % WITNESS_MAX_INFLIGHT_BATCHES;
+        inflightBatches[next].maxOpNum = maxOpNum;
+        inflightBatches[next].size = size;
+        ++inflightCount;
+    }
+    inflightRpcs += size;
+}
+
+/* Append an RPC to the current batch. */
+static void addUnsyncedRpc(uint32_t keyHash, long long clientId, long long requestId) {
+    if (unsyncedRpcsSize == unsyncedRpcsCapacity) {
+        unsyncedRpcsCapacity = unsyncedRpcsCapacity ?
+                unsyncedRpcsCapacity * 2 : WITNESS_BATCH_INIT_CAPACITY;
+        unsyncedRpcs = zrealloc(unsyncedRpcs,
+                sizeof(struct WitnessGcInfo) * unsyncedRpcsCapacity);
+    }
+    unsyncedRpcs[unsyncedRpcsSize].clientId = clientId;
+    unsyncedRpcs[unsyncedRpcsSize].requestId = requestId;
+    unsyncedRpcs[unsyncedRpcsSize].keyHash = keyHash;
+    if (unsyncedRpcsSize++ == 0) {
+        batchStartTime = ustime();
+        /* Make sure an idle server still honors the max age. */
+        if (!batchTimerArmed) {
+            long long ms = (server.witness_batch_max_age + 999) / 1000;
+            if (aeCreateTimeEvent(server.el, ms ? ms : 1, batchTimerProc,
+                                  NULL, NULL) != AE_ERR) {
+                batchTimerArmed = true;
+            }
+        }
+    }
 }
 
-void trackUnsyncedRpc(client *c) {
+/* Return the hashes of the keys under which the client recorded its request,
+ * one per key of the command. Called before the command runs, since commands
+ * may rewrite their arguments. The result is passed to trackUnsyncedRpc().
+ * The full hash is sent in the WGC: each witness narrows it to the geometry
+ * of its table at that time, which may have changed since we registered. */
+int *unsyncedRpcKeyHashes(client *c, int *numkeys) {
+    int *keys = getKeysFromCommand(c->cmd, c->argv, c->argc, numkeys);
+    for (int j = 0; j < *numkeys; ++j) {
+        robj *key = c->argv[keys[j]];
+        uint32_t keyHash;
+        MurmurHash3_x86_32(key->ptr, sdslen(key->ptr), c->db->id, &keyHash);
+        keys[j] = (int)keyHash;
+    }
+    return keys;
+}
+
+/* Track the RPC the client just executed until the witnesses can forget it.
+ * A client records a multi-key request once per key, so there is one entry
+ * to GC for every key of the command. Frees 'keyHashes'. */
+void trackUnsyncedRpc(client *c, int *keyHashes, int numkeys) {
     record("tracking UnsyncedRpc", 0, 0, 0, 0);
-    unsyncedRpcs[unsyncedRpcsSize].clientId = c->clientId;
-    unsyncedRpcs[unsyncedRpcsSize].requestId = c->requestId;
-    uint32_t keyHash;
-    MurmurHash3_x86_32(c->argv[1]->ptr, sdslen(c->argv[1]->ptr), c->db->id, &keyHash);
-//    serverLog(LL_NOTICE, "dictid: %d, key: %s keyLen: %d", c->db->id, (sds)c->argv[1]->ptr, sdslen(c->argv[1]->ptr));
-    unsyncedRpcs[unsyncedRpcsSize].hashIndex = keyHash & 1023;
-    ++unsyncedRpcsSize;
+    for (int j = 0; j < numkeys; ++j)
+        addUnsyncedRpc((uint32_t)keyHashes[j], c->clientId, c->requestId);
+    getKeysFreeResult(keyHashes);
+    ++trackedSinceSample;
     record("tracking done", 0, 0, 0, 0);
+    debugCrashPoint(CRASH_POINT_BATCH);
+}
 
-    if (unsyncedRpcsSize == WITNESS_BATCH_SIZE) {
-        scheduleFsyncAndWitnessGc();
+/* GC again an RPC a witness reported as obsolete. It is executed already,
+ * so the next fsync covers it. */
+void retrackUnsyncedRpc(long long keyHash, long long clientId, long long requestId) {
+    addUnsyncedRpc((uint32_t)keyHash, clientId, requestId);
+}
+
+/* Return why the current batch should be flushed, or FLUSH_NONE. */
+static int batchFlushReason(void) {
+    if (unsyncedRpcsSize == 0) return FLUSH_NONE;
+    retireInflightBatches();
+    if (unsyncedRpcsSize >= targetBatchSize) return FLUSH_BY_SIZE;
+    if (unsyncedRpcsSize + inflightRpcs >= occupancyLimit())
+        return FLUSH_BY_OCCUPANCY;
+    if (ustime() - batchStartTime >= server.witness_batch_max_age)
+        return FLUSH_BY_AGE;
+    return FLUSH_NONE;
+}
+
+/* Flush the batch of unsynced RPCs if the policy says so. Called from
+ * beforeSleep() after flushAppendOnlyFile(), since the fsync we schedule must
+ * cover every command of the batch. */
+void flushUnsyncedRpcsIfNeeded(void) {
+    int reason = batchFlushReason();
+    if (reason == FLUSH_NONE) return;
+
+    /* The AOF write was postponed; the commands aren't in the file yet. */
+    if (sdslen(server.aof_buf) > 0) return;
+
+    switch (reason) {
+    case FLUSH_BY_SIZE: batchStats.bySize++; break;
+    case FLUSH_BY_AGE: batchStats.byAge++; break;
+    case FLUSH_BY_OCCUPANCY: batchStats.byOccupancy++; break;
+    }
+    int bucket = 0;
+    while (bucket < WITNESS_BATCH_HIST_BUCKETS - 1 &&
+           (1 << (bucket + 1)) <= unsyncedRpcsSize) {
+        ++bucket;
     }
+    batchStats.sizeHist[bucket]++;
+    batchStats.batches++;
+    batchStats.rpcs += unsyncedRpcsSize;
+
+    addInflightBatch(server.currentOpNum, unsyncedRpcsSize);
+    scheduleFsyncAndWitnessGc();
+}
+
+static int batchTimerProc(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    UNUSED(eventLoop);
+    UNUSED(id);
+    UNUSED(clientData);
+
+    flushUnsyncedRpcsIfNeeded();
+    if (unsyncedRpcsSize == 0) {
+        batchTimerArmed = false;
+        return AE_NOMORE;
+    }
+    /* Wake up again when the current batch gets too old. */
+    long long left = server.witness_batch_max_age - (ustime() - batchStartTime);
+    left = (left + 999) / 1000;
+    return left > 0 ? left : 1;
+}
+
+/* Called from serverCron(): estimate the rate of unsynced RPCs and derive
+ * the batch size that keeps fsyncs close to witness-fsync-rate. */
+void witnessBatchCron(void) {
+    long long now = ustime();
+
+    if (lastSampleTime && now - lastSampleTime >= WITNESS_RATE_SAMPLE_PERIOD*1000) {
+        double rate = (double)trackedSinceSample * 1000000 / (now - lastSampleTime);
+        unsyncedRpcRate = unsyncedRpcRate ? (unsyncedRpcRate + rate) / 2 : rate;
+        trackedSinceSample = 0;
+        lastSampleTime = now;
+    } else if (!lastSampleTime) {
+        lastSampleTime = now;
+    }
+
+    long long limit = occupancyLimit();
+    if (server.witness_fsync_rate > 0) {
+        targetBatchSize = (long long)(unsyncedRpcRate / server.witness_fsync_rate);
+        if (targetBatchSize < 1) targetBatchSize = 1;
+        if (targetBatchSize > limit) targetBatchSize = limit;
+    } else {
+        targetBatchSize = limit;
+    }
+}
+
+void resetWitnessBatchStats(void) {
+    memset(&batchStats, 0, sizeof(batchStats));
+}
+
+sds genWitnessInfoString(sds info) {
+    long long end = server.serverState == SERVER_STATE_ACCEPTING_REPLAY ?
+            ustime() : server.recovery_end_time;
+    long long witnessEnd = server.witness_recovery_done ?
+            server.recovery_witness_time : end;
+
+    info = sdscatprintf(info,
+        "recovery_state:%s\r\n"
+        "recovery_end_reason:%s\r\n"
+        "recovery_replay_clients:%d\r\n"
+        "recovery_load_ms:%lld\r\n"
+        "recovery_witness_ms:%lld\r\n"
+        "recovery_replay_ms:%lld\r\n"
+        "recovery_total_ms:%lld\r\n"
+        "recovery_witnesses:%d\r\n"
+        "recovery_witness_requests:%lld\r\n"
+        "recovery_witness_duplicates:%lld\r\n"
+        "recovery_witness_mismatched:%lld\r\n"
+        "recovery_witness_filtered:%lld\r\n"
+        "recovery_witness_replayed:%lld\r\n",
+        server.serverState == SERVER_STATE_ACCEPTING_REPLAY ? "replay" : "normal",
+        server.recovery_end_reason ? server.recovery_end_reason : "none",
+        server.replay_clients_done,
+        (server.recovery_loaded_time - server.recovery_start_time) / 1000,
+        (witnessEnd - server.recovery_loaded_time) / 1000,
+        (end - witnessEnd) / 1000,
+        (end - server.recovery_start_time) / 1000,
+        recoveryWitnesses,
+        recoveryStats.received,
+        recoveryStats.duplicates,
+        recoveryStats.mismatched,
+        recoveryStats.filteredByRifl,
+        recoveryStats.replayed);
+
+    retireInflightBatches();
+    info = sdscatprintf(info,
+        "witness_count:%d\r\n"
+        "witness_table_slots:%lld\r\n"
+        "witness_unsynced_rpcs:%d\r\n"
+        "witness_inflight_rpcs:%lld\r\n"
+        "witness_unsynced_rpc_rate:%.2f\r\n"
+        "witness_batch_target_size:%lld\r\n"
+        "witness_gc_batches:%lld\r\n"
+        "witness_gc_rpcs:%lld\r\n"
+        "witness_gc_avg_batch_size:%.2f\r\n"
+        "witness_gc_flush_by_size:%lld\r\n"
+        "witness_gc_flush_by_age:%lld\r\n"
+        "witness_gc_flush_by_occupancy:%lld\r\n",
+        server.numWitness,
+        server.witnessTableSlots,
+        unsyncedRpcsSize,
+        inflightRpcs,
+        unsyncedRpcRate,
+        targetBatchSize,
+        batchStats.batches,
+        batchStats.rpcs,
+        batchStats.batches ? (double)batchStats.rpcs / batchStats.batches : 0,
+        batchStats.bySize,
+        batchStats.byAge,
+        batchStats.byOccupancy);
+
+    /* Batch size distribution, bucketed by powers of two. */
+    info = sdscat(info, "witness_gc_batch_size_hist:");
+    for (int j = 0; j < WITNESS_BATCH_HIST_BUCKETS; ++j) {
+        info = sdscatprintf(info, "%s%d=%lld", j ? "," : "", 1 << j,
+                batchStats.sizeHist[j]);
+    }
+    info = sdscat(info, "\r\n");
+    return genWitnessClientInfoString(info);
 }
 
 void witnessListChanged();
 
+/*============================ Recovery from witnesses ====================== */
+
+/* After a crash we fetch the unsynced requests (WGETRECOVERYDATA) from every
+ * witness at once and parse the replies as they stream in, straight from the
+ * receive buffers. A request may be held by several witnesses: the first copy
+ * is replayed and the others are only checked to be identical. Requests are
+ * replayed in batches through a single fake client. */
+
+#define RECOVERY_IOBUF_LEN (64*1024)
+#define RECOVERY_REPLAY_BATCH 256
+#define RECOVERY_TIMEOUT 5000 /* Milliseconds without progress. */
+
+struct RecoverySource {
+    int fd;
+    sds buf;                /* Received data, parsed up to 'pos'. */
+    size_t pos;
+    long long remaining;    /* Requests left in the reply, -1 before header. */
+    long long received;
+    bool done;
+};
+
+/* Requests to replay, parsed but not executed yet. */
+static struct {
+    struct redisCommand *cmd[RECOVERY_REPLAY_BATCH];
+    robj **argv[RECOVERY_REPLAY_BATCH];
+    int argc[RECOVERY_REPLAY_BATCH];
+    int count;
+} replayBatch;
+
+/* Requests seen so far, keyed by (clientId, requestId). The value is the
+ * CRC64 of the request, to cross-check copies from other witnesses. */
+static unsigned int dictRpcIdHash(const void *key) {
+    return dictGenHashFunction(key, 2 * sizeof(long long));
+}
+
+static int dictRpcIdCompare(void *privdata, const void *key1, const void *key2) {
+    UNUSED(privdata);
+    return memcmp(key1, key2, 2 * sizeof(long long)) == 0;
+}
+
+static void dictRpcIdDestructor(void *privdata, void *key) {
+    UNUSED(privdata);
+    zfree(key);
+}
+
+static dictType recoveredRpcsDictType = {
+    dictRpcIdHash,              /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictRpcIdCompare,           /* key compare */
+    dictRpcIdDestructor,        /* key destructor */
+    NULL                        /* val destructor */
+};
+
+static void replayBatchedRequests(client *fakeClient, struct RecoveryStats *stats) {
+    for (int i = 0; i < replayBatch.count; ++i) {
+        struct redisCommand *cmd = replayBatch.cmd[i];
+        fakeClient->argc = replayBatch.argc[i];
+        fakeClient->argv = replayBatch.argv[i];
+
+        // RIFL check. Witnesses only keep requests with RIFL ids.
+        if (!(cmd->flags & CMD_AT_MOST_ONCE) ||
+            !riflStripRequestIds(fakeClient) ||
+            (cmd->arity > 0 && cmd->arity != fakeClient->argc) ||
+            fakeClient->argc < -cmd->arity) {
+            serverLog(LL_WARNING,"Malformed '%s' request in recovery data "
+                    "from witness. Skipped.", cmd->name);
+            goto next;
+        }
+        if (fakeClient->clientId != 0 &&
+            riflCheckDuplicate(fakeClient->clientId, fakeClient->requestId)) {
+            stats->filteredByRifl++;
+            goto next;
+        }
+
+        /* Run the command in the context of a fake client */
+        cmd->proc(fakeClient);
+        stats->replayed++;
+
+        /* The fake client should not have a reply */
+        serverAssert(fakeClient->bufpos == 0 && listLength(fakeClient->reply) == 0);
+        /* The fake client should never get blocked */
+        serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
+
+next:
+        /* Clean up. Command code may have changed argv/argc so we use the
+         * argv/argc of the client instead of the local variables. */
+        freeFakeClientArgv(fakeClient);
+    }
+    replayBatch.count = 0;
+}
+
+/* Parse "<prefix><number>\r\n" at *pp. Returns 1 on success, 0 if the line
+ * isn't complete yet, -1 on protocol error. */
+static int parseRecoveryLine(char **pp, char *end, char prefix, long long *val) {
+    char *p = *pp, *cr;
+    if (p >= end) return 0;
+    if (*p != prefix) return -1;
+    cr = memchr(p, '\r', end - p);
+    if (cr == NULL || cr + 1 >= end) return 0;
+    if (!string2ll(p+1, cr-p-1, val)) return -1;
+    *pp = cr + 2;
+    return 1;
+}
+
+/* Parse the next request of a source. Returns 1 if one was consumed, 0 if
+ * more data is needed, and -1 on protocol error. */
+static int parseRecoveredRequest(struct RecoverySource *src, dict *seen,
+                                 client *fakeClient, struct RecoveryStats *stats) {
+    char *start = src->buf + src->pos, *end = src->buf + sdslen(src->buf);
+    char *p = start;
+    long long argc, len;
+    int ret;
+
+    if ((ret = parseRecoveryLine(&p, end, '*', &argc)) != 1) return ret;
+    if (argc < 3 || argc > 1024*1024) return -1;
+
+    /* Find the arguments in place first: nothing gets copied until we know
+     * the whole request is there and we haven't seen it yet. */
+    char **args = zmalloc(sizeof(char*) * argc);
+    size_t *lens = zmalloc(sizeof(size_t) * argc);
+    for (long long j = 0; j < argc; ++j) {
+        if ((ret = parseRecoveryLine(&p, end, '$', &len)) != 1) goto cleanup;
+        if (len < 0) { ret = -1; goto cleanup; }
+        if (end - p < len + 2) { ret = 0; goto cleanup; }
+        args[j] = p;
+        lens[j] = len;
+        p += len + 2;
+    }
+    src->pos = p - src->buf;
+    src->remaining--;
+    src->received++;
+    stats->received++;
+    ret = 1;
+
+    long long ids[2];
+    if (!base64int2ll(args[argc-2], lens[argc-2], &ids[0]) ||
+        !base64int2ll(args[argc-1], lens[argc-1], &ids[1])) {
+        serverLog(LL_WARNING, "Recovered request without RIFL ids. Skipped.");
+        goto cleanup;
+    }
+    uint64_t crc = crc64(0, (unsigned char*)start, p - start);
+    dictEntry *de = dictFind(seen, ids);
+    if (de) {
+        stats->duplicates++;
+        if (dictGetUnsignedIntegerVal(de) != crc) stats->mismatched++;
+        goto cleanup;
+    }
+    long long *key = zmalloc(sizeof(ids));
+    memcpy(key, ids, sizeof(ids));
+    de = dictAddRaw(seen, key);
+    dictSetUnsignedIntegerVal(de, crc);
+
+    sds name = sdsnewlen(args[0], lens[0]);
+    struct redisCommand *cmd = lookupCommand(name);
+    sdsfree(name);
+    if (!cmd) {
+        serverLog(LL_WARNING,"Unknown command '%.*s' in recovery data from "
+                "witness. Skipped.", (int)lens[0], args[0]);
+        goto cleanup;
+    }
+    robj **argv = zmalloc(sizeof(robj*) * argc);
+    for (long long j = 0; j < argc; ++j)
+        argv[j] = createStringObject(args[j], lens[j]);
+    replayBatch.cmd[replayBatch.count] = cmd;
+    replayBatch.argv[replayBatch.count] = argv;
+    replayBatch.argc[replayBatch.count] = argc;
+    if (++replayBatch.count == RECOVERY_REPLAY_BATCH)
+        replayBatchedRequests(fakeClient, stats);
+
+cleanup:
+    zfree(args);
+    zfree(lens);
+    return ret;
+}
+
+/* Consume whatever a source has buffered. Returns -1 on protocol error. */
+static int processRecoverySource(struct RecoverySource *src, dict *seen,
+                                 client *fakeClient, struct RecoveryStats *stats) {
+    int ret = 1;
+
+    if (src->remaining == -1) {
+        char *p = src->buf;
+        ret = parseRecoveryLine(&p, src->buf + sdslen(src->buf), '*',
+                &src->remaining);
+        if (ret != 1) return ret;
+        if (src->remaining < 0) return -1;
+        src->pos = p - src->buf;
+    }
+    while (src->remaining > 0 &&
+           (ret = parseRecoveredRequest(src, seen, fakeClient, stats)) == 1);
+    if (ret == -1) return -1;
+    if (src->remaining == 0) src->done = true;
+    sdsrange(src->buf, src->pos, -1);
+    src->pos = 0;
+    return 0;
+}
+
 bool recoverFromWitness() {
+    struct RecoverySource sources[CONFIG_WITNESS_MAX];
+    struct pollfd pfds[CONFIG_WITNESS_MAX];
+    struct RecoveryStats stats = {0, 0, 0, 0, 0};
+    int numSources = 0, numCompleted = 0;
+    long long start = ustime();
+
+    for (int i = 0; i < server.numWitness; ++i) {
+        sources[i].fd = -1;
+        sources[i].buf = NULL;
+    }
+
+    char masterIdxStr[LONG_STR_SIZE];
+    ll2string(masterIdxStr, sizeof(masterIdxStr), server.witness_master_id);
+    sds cmdstr = sdscatprintf(sdsempty(),
+            "*2\r\n$16\r\nWGETRECOVERYDATA\r\n$%d\r\n%s\r\n",
+            (int)strlen(masterIdxStr), masterIdxStr);
     for (int i = 0; i < server.numWitness; ++i) {
-        // Send command.
-        char* masterIdxStr = "1";
-        sds cmdstr = sdscatprintf(sdsempty(),
-                "*2\r\n$16\r\nWGETRECOVERYDATA\r\n$%d\r\n%s\r\n",
-                (int)strlen(masterIdxStr), masterIdxStr);
+        if (server.fdToWitness[i] <= 0) continue;
         if (anetWrite(server.fdToWitness[i], cmdstr, sdslen(cmdstr)) == -1) {
             serverLog(LL_WARNING, "Error while sending WGETRECOVERYDATA. %s", strerror(errno));
+            witnessClientDisconnect(i, "can't send WGETRECOVERYDATA");
             continue;
         }
+        sources[i].fd = server.fdToWitness[i];
+        sources[i].buf = sdsempty();
+        sources[i].pos = 0;
+        sources[i].remaining = -1;
+        sources[i].received = 0;
+        sources[i].done = false;
+        ++numSources;
+    }
+    sdsfree(cmdstr);
+    if (numSources == 0) {
+        serverLog(LL_WARNING, "Could not find and recover from any witnesses.");
+        return false;
+    }
 
-        // Receive response.
-        struct client *fakeClient;
-        fakeClient = createFakeClient();
-
-        FILE *fp = fdopen(server.fdToWitness[i], "r");
-        int count, filteredByRifl = 0;
-        char buf[50];
-        if (fgets(buf, sizeof(buf), fp) == NULL)
-            goto readerr;
-        if (buf[0] != '*') goto fmterr;
-        if (buf[1] == '\0') goto readerr;
-        count = atoi(buf+1);
-
-//        char* data = zmalloc(totalSize + 1);
-//        if (fread(data, 1, totalSize, fp) != totalSize)
-//            goto readerr;
-
-        for (int reqIdx = 0; reqIdx < count; ++reqIdx) {
-            int argc, j;
-            unsigned long len;
-            robj **argv;
-            char buf[128];
-            sds argsds;
-            struct redisCommand *cmd;
-
-            if (fgets(buf,sizeof(buf),fp) == NULL) {
-                if (feof(fp))
-                    break;
-                else
-                    goto readerr;
-            }
-            if (buf[0] != '*') goto fmterr;
-            if (buf[1] == '\0') goto readerr;
-            argc = atoi(buf+1);
-            if (argc < 1) goto fmterr;
-
-            argv = zmalloc(sizeof(robj*)*argc);
-            fakeClient->argc = argc;
-            fakeClient->argv = argv;
-
-            for (j = 0; j < argc; j++) {
-                if (fgets(buf,sizeof(buf),fp) == NULL) {
-                    fakeClient->argc = j; /* Free up to j-1. */
-                    freeFakeClientArgv(fakeClient);
-                    goto readerr;
-                }
-                if (buf[0] != '$') goto fmterr;
-                len = strtol(buf+1,NULL,10);
-                argsds = sdsnewlen(NULL,len);
-                if (len && fread(argsds,len,1,fp) == 0) {
-                    sdsfree(argsds);
-                    fakeClient->argc = j; /* Free up to j-1. */
-                    freeFakeClientArgv(fakeClient);
-                    goto readerr;
-                }
-                argv[j] = createObject(OBJ_STRING,argsds);
-                if (fread(buf,2,1,fp) == 0) {
-                    fakeClient->argc = j+1; /* Free up to j. */
-                    freeFakeClientArgv(fakeClient);
-                    goto readerr; /* discard CRLF */
-                }
-            }
-
-            /* Command lookup */
-            cmd = lookupCommand(argv[0]->ptr);
-            if (!cmd) {
-                serverLog(LL_WARNING,"Unknown command '%s' recovery data from witness", (char*)argv[0]->ptr);
-                exit(1);
-            }
-
-            // RIFL check.
-            if (cmd->flags & CMD_AT_MOST_ONCE) {
-                getLongLongFromObject(argv[argc-2], &fakeClient->clientId);
-                getLongLongFromObject(argv[argc-1], &fakeClient->requestId);
-                if (!riflCheckClientIdOk(fakeClient)) {
-                    serverLog(LL_WARNING,"Detected RIFL client ID collision.");
-                    continue;
-                }
-                if (riflCheckDuplicate(fakeClient->clientId, fakeClient->requestId)){
-                    ++filteredByRifl;
-                    goto rifl_duplicate;
-                }
-            }
-
-            /* Run the command in the context of a fake client */
-            cmd->proc(fakeClient);
+    dict *seen = dictCreate(&recoveredRpcsDictType, NULL);
+    client *fakeClient = createFakeClient();
+    char buf[RECOVERY_IOBUF_LEN];
 
-            /* The fake client should not have a reply */
-            serverAssert(fakeClient->bufpos == 0 && listLength(fakeClient->reply) == 0);
-            /* The fake client should never get blocked */
-            serverAssert((fakeClient->flags & CLIENT_BLOCKED) == 0);
+    while (numSources > 0) {
+        int nfds = 0, ready;
+        int index[CONFIG_WITNESS_MAX];
 
-    rifl_duplicate:
-            /* Clean up. Command code may have changed argv/argc so we use the
-             * argv/argc of the client instead of the local variables. */
-            freeFakeClientArgv(fakeClient);
+        for (int i = 0; i < server.numWitness; ++i) {
+            if (sources[i].fd == -1 || sources[i].done) continue;
+            pfds[nfds].fd = sources[i].fd;
+            pfds[nfds].events = POLLIN;
+            pfds[nfds].revents = 0;
+            index[nfds++] = i;
+        }
+        if (nfds == 0) break;
+        ready = poll(pfds, nfds, RECOVERY_TIMEOUT);
+        if (ready == -1 && errno == EINTR) continue;
+        if (ready <= 0) {
+            serverLog(LL_WARNING, "Witnesses stopped sending recovery data.");
+            break;
         }
-        // Recovery completed.
-        serverLog(LL_NOTICE, "Recovered state from witness data. (Found: %d, "
-                "filtered by RIFL: %d)", count, filteredByRifl);
-        return true;
-
-    readerr: /* Read error. If feof(fp) is true, fall through to unexpected EOF. */
-        if (!feof(fp)) {
-            if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
-            serverLog(LL_WARNING,"Unrecoverable error reading witness recovery data socket: %s", strerror(errno));
-            exit(1);
+
+        for (int j = 0; j < nfds; ++j) {
+            if (!pfds[j].revents) continue;
+            int i = index[j];
+            struct RecoverySource *src = &sources[i];
+            ssize_t nread = read(src->fd, buf, sizeof(buf));
+            if (nread == -1 && errno == EINTR) continue;
+            if (nread > 0) {
+                src->buf = sdscatlen(src->buf, buf, nread);
+                if (processRecoverySource(src, seen, fakeClient, &stats) == -1)
+                    nread = -1;
+            }
+            if (nread <= 0) {
+                serverLog(LL_WARNING, "Recovery from witness %s failed after "
+                        "%lld requests: %s", server.addrToWitness[i],
+                        src->received, nread == 0 ? "connection closed" :
+                        "read or protocol error");
+                witnessClientDisconnect(i, "recovery failed");
+                src->fd = -1;
+                --numSources;
+                continue;
+            }
+            if (src->done) {
+                ++numCompleted;
+                --numSources;
+            }
         }
+    }
+    replayBatchedRequests(fakeClient, &stats);
+    fakeClient->argc = 0;
+    fakeClient->argv = NULL;
+    freeFakeClient(fakeClient);
+    dictRelease(seen);
+
+    for (int i = 0; i < server.numWitness; ++i) {
+        if (sources[i].fd != -1 && !sources[i].done)
+            witnessClientDisconnect(i, "recovery timed out");
+        sdsfree(sources[i].buf);
+    }
 
-    fmterr: /* Format error. */
-        if (fakeClient) freeFakeClient(fakeClient); /* avoid valgrind warning */
-        serverLog(LL_WARNING,"Bad file format reading the append only file: make a backup of your AOF file, then use ./redis-check-aof --fix <filename>");
-        exit(1);
+    // Recovery completed.
+    if (stats.mismatched) {
+        serverLog(LL_WARNING, "%lld recovered requests differ between "
+                "witnesses. The first copy received was replayed.",
+                stats.mismatched);
     }
-    serverLog(LL_WARNING, "Could not find and recover from any witnesses.");
-    return false;
-}
\ No newline at end of file
+    serverLog(LL_NOTICE, "Recovered state from %d witness(es) in %lld ms. "
+            "(Found: %lld, duplicates: %lld, replayed: %lld, filtered by "
+            "RIFL: %lld)", numCompleted, (ustime() - start) / 1000,
+            stats.received, stats.duplicates, stats.replayed,
+            stats.filteredByRifl);
+    recoveryStats = stats;
+    recoveryWitnesses = numCompleted;
+    if (numCompleted == 0) {
+        serverLog(LL_WARNING, "Could not find and recover from any witnesses.");
+        return false;
+    }
+    return true;
+}
@@ -11,8 +11,22 @@
 /* TBD: include only necessary headers. */
 #include "server.h"
 
-void trackUnsyncedRpc(client *c);
+int *unsyncedRpcKeyHashes(client *c, int *numkeys);
+void trackUnsyncedRpc(client *c, int *keyHashes, int numkeys);
 void scheduleFsyncAndWitnessGc();
+void flushUnsyncedRpcsIfNeeded(void);
+void witnessBatchCron(void);
+void resetWitnessBatchStats(void);
+sds genWitnessInfoString(sds info);
+void retrackUnsyncedRpc(long long keyHash, long long clientId, long long requestId);
+
+/* witnessClient.c */
+void witnessClientStart(void);
+void witnessClientDisconnect(int i, const char *reason);
+void witnessClientQueueGc(long long maxOpNum, sds cmd);
+void witnessClientSendDueGcs(void);
+void witnessClientCron(void);
+sds genWitnessClientInfoString(sds info);
 void witnessListChanged();
 bool recoverFromWitness();
 
@@ -0,0 +1,83 @@
+# With curp-sync-replicas an operation is synced once that many slaves
+# acknowledged it, so reads of unsynced data wait for the slaves.
+start_server {tags {"repl"} overrides {curp-sync-replicas 1}} {
+    set master [srv 0 client]
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+
+    # Wait until the master holds $n clients until their data is synced.
+    proc wait_for_waiting_clients {r n} {
+        wait_for_condition 100 100 {
+            [status $r fsync_waiting_clients] == $n
+        } else {
+            fail "[status $r fsync_waiting_clients] clients wait for a sync, not $n"
+        }
+    }
+
+    test {Reads of unsynced data wait for a slave} {
+        $master set foo bar
+        set rd [redis_deferring_client]
+        $rd get foo
+        wait_for_waiting_clients $master 1
+    }
+
+    start_server {} {
+        test {The read is released once the slave acknowledged the write} {
+            r slaveof $master_host $master_port
+            wait_for_waiting_clients $master 0
+            set reply [$rd read]
+            $rd close
+            set reply
+        } {bar}
+
+        test {Reads wait for curp-sync-replicas slaves} {
+            $master config set curp-sync-replicas 2
+            $master set foo bar2
+            set rd [redis_deferring_client -1]
+            $rd get foo
+            wait_for_waiting_clients $master 1
+            # The slave acknowledges the replication offset every second.
+            after 1500
+            assert_equal 1 [status $master fsync_waiting_clients]
+            $master config set curp-sync-replicas 1
+            wait_for_waiting_clients $master 0
+            set reply [$rd read]
+            $rd close
+            set reply
+        } {bar2}
+
+        test {Local fsyncs do not sync operations when the slaves do} {
+            $master config set appendfsync always
+            $master config set appendonly yes
+            wait_for_condition 50 100 {
+                [status $master aof_rewrite_in_progress] == 0 &&
+                [status $master aof_rewrite_scheduled] == 0 &&
+                [status $master aof_enabled] == 1
+            } else {
+                fail "The AOF was not turned on"
+            }
+            $master config set curp-sync-replicas 2
+            $master set foo bar3
+            set rd [redis_deferring_client -1]
+            $rd get foo
+            wait_for_waiting_clients $master 1
+            after 1500
+            assert_equal 1 [status $master fsync_waiting_clients]
+            $master config set curp-sync-replicas 1
+            wait_for_waiting_clients $master 0
+            set reply [$rd read]
+            $rd close
+            set reply
+        } {bar3}
+
+        test {Slaves do not wait for slaves of their own} {
+            r config set curp-sync-replicas 1
+            wait_for_condition 50 100 {
+                [r get foo] eq {bar3}
+            } else {
+                fail "The write did not reach the slave"
+            }
+            status r fsync_waiting_clients
+        } {0}
+    }
+}
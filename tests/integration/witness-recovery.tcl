@@ -0,0 +1,119 @@
+# A master that restarts recovers the requests held by its witnesses, then
+# waits for its clients to replay until it knows that nothing is missing.
+
+# Pick a port for the recovery listener the way start_server picks ports.
+proc recovery_port {} {
+    set ::port [find_available_port [expr {$::port+1}]]
+}
+
+# Wait until a master that is replaying accepts normal connections again.
+proc wait_for_normal_state {srv} {
+    wait_for_condition 150 100 {
+        [catch {
+            set c [redis [dict get $srv host] [dict get $srv port]]
+            $c ping
+            $c close
+        }] == 0
+    } else {
+        fail "The master did not leave the replay state"
+    }
+    redis [dict get $srv host] [dict get $srv port]
+}
+
+# The master reaches its witnesses on its own port, so they listen on other
+# loopback addresses.
+start_server {tags {"witness"} overrides {bind 127.0.0.2}} {
+    set witness1 [srv 0 client]
+    set port [srv 0 port]
+
+    start_server [list overrides [list bind 127.0.0.3 port $port]] {
+        set witness2 [srv 0 client]
+        set master_config [list port $port witnessIp {127.0.0.2 127.0.0.3} \
+            witness-master-id 7]
+
+        # Without slaves nothing is ever synced, so nothing is GCed either.
+        start_server [list overrides [concat $master_config curp-sync-replicas 1]] {
+            test {Requests are recorded on both witnesses before they execute} {
+                set h [witness_key_hash counter 0]
+                set req [resp_request incr counter B B]
+                foreach w [list $witness1 $witness2] {
+                    assert_equal ACCEPT \
+                        [$w wrecord [wrecord_payload 7 $h [expr {$h & 1023}] 1 1 $req]]
+                }
+                set h [witness_key_hash single 0]
+                assert_equal ACCEPT [$witness1 wrecord [wrecord_payload 7 $h \
+                    [expr {$h & 1023}] 2 1 [resp_request set single 1 C B]]]
+
+                set rc [redis [srv 0 host] [srv 0 port]]
+                $rc client rifl on
+                assert_equal 1 [$rc incr counter B B]
+                $rc close
+                list [llength [$witness1 wgetrecoverydata 7]] \
+                     [llength [$witness2 wgetrecoverydata 7]]
+            } {2 1}
+
+            exec kill -9 [srv 0 pid]
+        }
+
+        start_server [list overrides [concat $master_config \
+                recovery-port [recovery_port]]] {
+            test {A restarted master replays each request of its witnesses once} {
+                # Recovery uses db 0, where the requests executed.
+                r select 0
+                list [r get counter] [r get single] \
+                     [status r recovery_witnesses] \
+                     [status r recovery_witness_requests] \
+                     [status r recovery_witness_duplicates] \
+                     [status r recovery_witness_mismatched] \
+                     [status r recovery_witness_replayed]
+            } {1 1 2 3 1 0 2}
+
+            test {Replay ends as soon as the witnesses answered} {
+                list [status r recovery_state] [status r recovery_end_reason] \
+                     [expr {[status r recovery_total_ms] < 5000}]
+            } {normal witness 1}
+        }
+    }
+}
+
+# Without a witness to recover from, the master waits for its clients.
+set master_config [list witnessIp 127.0.0.4 witness-master-id 8]
+
+tags {"witness"} {
+    set rport [recovery_port]
+    set srv [start_server [list overrides [concat $master_config \
+        recovery-port $rport replay-quorum 1]]]
+
+    test {Replay ends once replay-quorum clients sent REPLAYDONE} {
+        wait_for_condition 50 100 {
+            [catch {set rec [redis [dict get $srv host] $rport]}] == 0
+        } else {
+            fail "Can't connect to the recovery port"
+        }
+        assert_equal OK [$rec set replayed 1 B B]
+        assert_equal OK [$rec replaydone]
+        $rec close
+        set rc [wait_for_normal_state $srv]
+        list [$rc get replayed] [status $rc recovery_end_reason] \
+             [status $rc recovery_replay_clients] [status $rc recovery_witnesses]
+    } {1 {replay quorum} 1 0}
+
+    test {REPLAYDONE is refused on a normal connection} {
+        catch {$rc replaydone} e
+        $rc close
+        set e
+    } {*only valid on a recovery connection*}
+    kill_server $srv
+
+    set srv [start_server [list overrides [concat $master_config \
+        recovery-port [recovery_port]]]]
+
+    test {Replay ends after a while without replayed requests} {
+        set rc [wait_for_normal_state $srv]
+        set res [list [status $rc recovery_end_reason] \
+                      [expr {[status $rc recovery_total_ms] >= 5000}]]
+        $rc close
+        set res
+    } {{replay timeout} 1}
+    kill_server $srv
+}
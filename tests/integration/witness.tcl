@@ -0,0 +1,204 @@
+# A master reaches its witnesses on its own port, so the witness listens on
+# another loopback address.
+start_server {tags {"witness"} overrides {bind 127.0.0.2}} {
+    set witness [srv 0 client]
+    set witness_port [srv 0 port]
+
+    start_server [list overrides [list port $witness_port \
+            witnessIp 127.0.0.2 witness-master-id 7 appendonly yes]] {
+        test {Master registers with its witness at startup} {
+            wait_for_condition 50 100 {
+                [string match {*state=connected*} [status r witness0]]
+            } else {
+                fail "Master did not connect to its witness"
+            }
+            $witness wrecord [wrecord_payload 7 5 5 1 1 [resp_request set a 1]]
+        } {ACCEPT}
+
+        test {Records of other masters are kept apart} {
+            assert_equal REJECT \
+                [$witness wrecord [wrecord_payload 8 5 5 1 1 [resp_request set a 1]]]
+            $witness wregister 8
+            $witness wrecord [wrecord_payload 8 5 5 1 1 [resp_request set a 1]]
+        } {ACCEPT}
+
+        # serverCron() sizes the batches every 100 milliseconds.
+        proc wait_for_batch_target_size {size} {
+            wait_for_condition 50 100 {
+                [status r witness_batch_target_size] == $size
+            } else {
+                fail "Batch target size is not $size"
+            }
+        }
+
+        set rc [redis [srv 0 host] [srv 0 port]]
+        $rc client rifl on
+
+        test {A lone unsynced RPC is GCed once its batch is old enough} {
+            r config set witness-fsync-rate 0
+            r config set witness-batch-max-age 300000
+            wait_for_batch_target_size 1024
+            r config resetstat
+            $rc set lone 1 B B
+            assert_equal 1 [status r witness_unsynced_rpcs]
+            wait_for_condition 50 100 {
+                [status r witness_gc_flush_by_age] == 1
+            } else {
+                fail "The batch was not flushed by age"
+            }
+            assert_equal 0 [status r witness_unsynced_rpcs]
+            status r witness_gc_batch_size_hist
+        } {1=1,2=0,*}
+
+        test {Batches do not grow past witness-batch-max-occupancy} {
+            # 1% of 1024x4 slots is 40 RPCs.
+            r config set witness-batch-max-occupancy 1
+            r config set witness-batch-max-age 10000000
+            wait_for_batch_target_size 40
+            r config resetstat
+            for {set j 2} {$j < 102} {incr j} {
+                $rc set key:$j $j B [::redis::int_base64 $j]
+            }
+            # What is left waits for the batch age.
+            set gced [status r witness_gc_rpcs]
+            set pending [status r witness_unsynced_rpcs]
+            assert_equal 100 [expr {$gced+$pending}]
+            assert {$pending < 40}
+            status r witness_gc_batch_size_hist
+        } {*,64=0,128=0,*}
+
+        test {Batches follow witness-fsync-rate} {
+            # A high fsync rate makes every RPC its own batch.
+            r config set witness-fsync-rate 1000000
+            wait_for_batch_target_size 1
+            wait_for_condition 50 100 {
+                [status r witness_unsynced_rpcs] == 0
+            } else {
+                fail "The previous batch was not flushed"
+            }
+            r config resetstat
+            for {set j 102} {$j < 112} {incr j} {
+                $rc set key:$j $j B [::redis::int_base64 $j]
+            }
+            wait_for_condition 50 100 {
+                [status r witness_gc_rpcs] == 10
+            } else {
+                fail "Not every RPC was GCed"
+            }
+            # Batches merge while the AOF write waits for a background fsync.
+            set batches [status r witness_gc_batches]
+            assert {$batches > 1}
+            assert_equal $batches [status r witness_gc_flush_by_size]
+        }
+        r config set witness-batch-max-occupancy 25
+        r config set witness-batch-max-age 1000
+
+        # A field of the witness0 line of INFO witness.
+        proc witness_conn {field} {
+            regexp "$field=(\[^,\]*)" [status r witness0] _ value
+            set value
+        }
+
+        test {GC replies are read back from the witness} {
+            wait_for_condition 50 100 {
+                [witness_conn outstanding_gcs] == 0
+            } else {
+                fail "GC replies were not processed"
+            }
+            assert {[witness_conn gcs_sent] > 0}
+            expr {[witness_conn gcs_acked] == [witness_conn gcs_sent]}
+        } {1}
+
+        test {A stalled witness does not stall the master} {
+            set witness_pid [srv -1 pid]
+            exec kill -STOP $witness_pid
+            for {set j 200} {$j < 250} {incr j} {
+                $rc set key:$j $j B [::redis::int_base64 $j]
+            }
+            wait_for_condition 50 100 {
+                [witness_conn outstanding_gcs] > 0
+            } else {
+                exec kill -CONT $witness_pid
+                fail "No GC was sent to the witness"
+            }
+            set written [llength [$rc keys key:2??]]
+            exec kill -CONT $witness_pid
+            assert_equal 50 $written
+            wait_for_condition 50 100 {
+                [witness_conn outstanding_gcs] == 0
+            } else {
+                fail "GC replies were not processed once the witness resumed"
+            }
+        }
+
+        test {Master reconnects to a witness that dropped it} {
+            set reconnects [witness_conn reconnects]
+            $witness client kill type normal skipme yes
+            wait_for_condition 50 100 {
+                [witness_conn reconnects] > $reconnects &&
+                [witness_conn state] eq {connected}
+            } else {
+                fail "Master did not reconnect to its witness"
+            }
+            $rc set key:300 1 B [::redis::int_base64 300]
+            wait_for_condition 50 100 {
+                [witness_conn outstanding_gcs] == 0 &&
+                [status r witness_unsynced_rpcs] == 0
+            } else {
+                fail "GC did not resume after the reconnection"
+            }
+        }
+    }
+}
+
+start_server {tags {"witness"} overrides {bind 127.0.0.2}} {
+    set witness [srv 0 client]
+    set witness_port [srv 0 port]
+
+    start_server [list overrides [list port $witness_port \
+            witnessIp 127.0.0.2 witness-master-id 7 appendonly no]] {
+        test {Witness GCs are sent without the AOF} {
+            wait_for_condition 50 100 {
+                [string match {*state=connected*} [status r witness0]]
+            } else {
+                fail "Master did not connect to its witness"
+            }
+            set rc [redis [srv 0 host] [srv 0 port]]
+            $rc client rifl on
+            for {set j 1} {$j <= 10} {incr j} {
+                $rc set key:$j $j B [::redis::int_base64 $j]
+            }
+            $rc close
+            # Nothing syncs, so the GCs go out as soon as they are built.
+            wait_for_condition 50 100 {
+                [status r witness_gc_rpcs] == 10 &&
+                [witness_conn gcs_acked] == [status r witness_gc_batches]
+            } else {
+                fail "The GCs were not sent to the witness"
+            }
+            witness_conn outstanding_gcs
+        } {0}
+
+        test {GCs find their records after the witness table grew} {
+            # A key whose bucket moves when the table grows to 4096 entries.
+            for {set j 0} {1} {incr j} {
+                set key resize:$j
+                set h [witness_key_hash $key]
+                if {($h & 4095) != ($h & 1023)} break
+            }
+            assert_equal ACCEPT [$witness wrecord [wrecord_payload 7 $h \
+                [expr {$h & 1023}] 500 1 [resp_request set $key 1]]]
+            $witness config set witness-table-entries 4096
+            set rc [redis [srv 0 host] [srv 0 port]]
+            $rc select 9
+            $rc client rifl on
+            $rc set $key 1 [::redis::int_base64 500] B
+            $rc close
+            wait_for_condition 50 100 {
+                [$witness wgetrecoverydata 7] eq {}
+            } else {
+                fail "The record was not GCed"
+            }
+        }
+    }
+}
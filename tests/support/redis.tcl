@@ -36,6 +36,7 @@ array set ::redis::blocking {}
 array set ::redis::deferred {}
 array set ::redis::reconnect {}
 array set ::redis::callback {}
+array set ::redis::curp {} ;# Last CURP envelope, {opNum syncedOpNum}
 array set ::redis::state {} ;# State in non-blocking reply reading
 array set ::redis::statestack {} ;# Stack of states, for nested mbulks
 
@@ -48,6 +49,7 @@ proc redis {{server 127.0.0.1} {port 6379} {defer 0}} {
     set ::redis::blocking($id) 1
     set ::redis::deferred($id) $defer
     set ::redis::reconnect($id) 0
+    set ::redis::curp($id) {}
     ::redis::redis_reset_state $id
     interp alias {} ::redis::redisHandle$id {} ::redis::__dispatch__ $id
 }
@@ -123,6 +125,12 @@ proc ::redis::__method__reconnect {id fd val} {
     set ::redis::reconnect($id) $val
 }
 
+# Return the CURP envelope of the last reply that had one, as a list of
+# the opNum of the command and the synced opNum, decoded from base64.
+proc ::redis::__method__curp {id fd} {
+    set ::redis::curp($id)
+}
+
 proc ::redis::__method__read {id fd} {
     ::redis::redis_read_reply $id $fd
 }
@@ -138,6 +146,7 @@ proc ::redis::__method__flush {id fd} {
 proc ::redis::__method__close {id fd} {
     catch {close $fd}
     catch {unset ::redis::fd($id)}
+    catch {unset ::redis::curp($id)}
     catch {unset ::redis::addr($id)}
     catch {unset ::redis::blocking($id)}
     catch {unset ::redis::deferred($id)}
@@ -207,6 +216,14 @@ proc ::redis::redis_read_reply {id fd} {
         - {return -code error [redis_read_line $fd]}
         $ {redis_bulk_read $fd}
         * {redis_multi_bulk_read $id $fd}
+        @ {
+            # CURP envelope of a RIFL request, the actual reply follows.
+            set ::redis::curp($id) {}
+            foreach n [split [redis_read_line $fd] " "] {
+                lappend ::redis::curp($id) [base64_int $n]
+            }
+            redis_read_reply $id $fd
+        }
         default {
             if {$type eq {}} {
                 set ::redis::fd($id) {}
@@ -217,6 +234,27 @@ proc ::redis::redis_read_reply {id fd} {
     }
 }
 
+# Integers in RIFL ids and CURP envelopes are written with the base64
+# alphabet, most significant digit first.
+proc ::redis::base64_int {str} {
+    set alphabet "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"
+    set v 0
+    foreach c [split $str {}] {
+        set v [expr {$v*64 + [string first $c $alphabet]}]
+    }
+    return $v
+}
+
+proc ::redis::int_base64 {v} {
+    set alphabet "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"
+    set str {}
+    while 1 {
+        set str "[string index $alphabet [expr {$v % 64}]]$str"
+        set v [expr {$v / 64}]
+        if {$v == 0} {return $str}
+    }
+}
+
 proc ::redis::redis_reset_state id {
     set ::redis::state($id) [dict create buf {} mbulk -1 bulk -1 reply {}]
     set ::redis::statestack($id) {}
@@ -224,12 +224,18 @@ proc start_server {options {code undefined}} {
     # ugly but tries to be as fast as possible...
     if {$::valgrind} {set retrynum 1000} else {set retrynum 100}
 
+    # setup properties to be able to initialize a client object
+    set host $::host
+    set port $::port
+    if {[dict exists $config bind]} { set host [dict get $config bind] }
+    if {[dict exists $config port]} { set port [dict get $config port] }
+
     if {$::verbose} {
-        puts -nonewline "=== ($tags) Starting server ${::host}:${::port} "
+        puts -nonewline "=== ($tags) Starting server ${host}:${port} "
     }
 
     if {$code ne "undefined"} {
-        set serverisup [server_is_up $::host $::port $retrynum]
+        set serverisup [server_is_up $host $port $retrynum]
     } else {
         set serverisup 1
     }
@@ -251,12 +257,6 @@ proc start_server {options {code undefined}} {
         after 100
     }
 
-    # setup properties to be able to initialize a client object
-    set host $::host
-    set port $::port
-    if {[dict exists $config bind]} { set host [dict get $config bind] }
-    if {[dict exists $config port]} { set port [dict get $config port] }
-
     # setup config dict
     dict set srv "config_file" $config_file
     dict set srv "config" $config
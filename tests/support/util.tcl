@@ -375,3 +375,57 @@ proc start_write_load {host port seconds} {
 proc stop_write_load {handle} {
     catch {exec /bin/kill -9 $handle}
 }
+
+# Binary WRECORD payload, see witnessProto.h.
+proc wrecord_payload {master keyhash hashidx clientid reqid request} {
+    binary format wiiwwa* $master $keyhash $hashidx $clientid $reqid $request
+}
+
+# Binary WGC batch of {keyHash clientId requestId} triples.
+proc wgc_payload {master entries} {
+    set batch [binary format wii $master [expr {[llength $entries]/3}] 0]
+    foreach {keyhash clientid reqid} $entries {
+        append batch [binary format iiww $keyhash 0 $clientid $reqid]
+    }
+    return $batch
+}
+
+proc murmur3_rotl {x r} {
+    expr {(($x << $r) | ($x >> (32 - $r))) & 0xffffffff}
+}
+
+proc murmur3_mix {k} {
+    set k [expr {($k * 0xcc9e2d51) & 0xffffffff}]
+    expr {([murmur3_rotl $k 15] * 0x1b873593) & 0xffffffff}
+}
+
+# MurmurHash3_x86_32 of a key, seeded with its db id, as the master hashes
+# the keys of the requests it GCs at the witnesses.
+proc witness_key_hash {key {dbid 9}} {
+    set len [string length $key]
+    set h $dbid
+    for {set i 0} {$i + 4 <= $len} {incr i 4} {
+        binary scan $key @${i}iu k
+        set h [expr {$h ^ [murmur3_mix $k]}]
+        set h [expr {([murmur3_rotl $h 13] * 5 + 0xe6546b64) & 0xffffffff}]
+    }
+    set k 0
+    set j 0
+    foreach b [split [string range $key $i end] {}] {
+        scan $b %c c
+        set k [expr {$k | ($c << (8 * $j))}]
+        incr j
+    }
+    if {$j} {set h [expr {$h ^ [murmur3_mix $k]}]}
+    set h [expr {$h ^ $len}]
+    set h [expr {(($h ^ ($h >> 16)) * 0x85ebca6b) & 0xffffffff}]
+    set h [expr {(($h ^ ($h >> 13)) * 0xc2b2ae35) & 0xffffffff}]
+    expr {$h ^ ($h >> 16)}
+}
+
+# RESP encoding of a command, as a client records it.
+proc resp_request {args} {
+    set req "*[llength $args]\r\n"
+    foreach a $args {append req "\$[string length $a]\r\n$a\r\n"}
+    return $req
+}
@@ -32,6 +32,10 @@ set ::all_tests {
     unit/multi
     unit/quit
     unit/aofrw
+    unit/unsynced
+    unit/rifl
+    unit/timetrace
+    unit/latency-monitor
     integration/replication
     integration/replication-2
     integration/replication-3
@@ -41,6 +45,9 @@ set ::all_tests {
     integration/rdb
     integration/convert-zipmap-hash-on-load
     integration/logging
+    integration/witness
+    integration/witness-recovery
+    integration/curp-replicas
     unit/pubsub
     unit/slowlog
     unit/scripting
@@ -54,6 +61,7 @@ set ::all_tests {
     unit/geo
     unit/memefficiency
     unit/hyperloglog
+    unit/witness
 }
 # Index to the next test to run in the ::all_tests list.
 set ::next_test 0
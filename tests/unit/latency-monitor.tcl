@@ -48,3 +48,62 @@ start_server {tags {"latency-monitor"}} {
         assert {[r latency latest] eq {}}
     }
 }
+
+start_server {tags {"latency-monitor"}} {
+    # The number of samples in the buckets of a LATENCY HISTOGRAM reply.
+    proc histogram_samples {hist} {
+        set samples 0
+        foreach bucket [dict get $hist buckets] {
+            incr samples [lindex $bucket 1]
+        }
+        set samples
+    }
+
+    test {LATENCY HISTOGRAM counts the calls of a command} {
+        r latency histogram set reset
+        set hist [r latency histogram set]
+        assert_equal {0 {}} [list [dict get $hist calls] [dict get $hist buckets]]
+        for {set j 0} {$j < 10} {incr j} {
+            r set foo $j
+        }
+        set hist [r latency histogram set]
+        assert_equal 10 [histogram_samples $hist]
+        assert {[dict get $hist p50] <= [dict get $hist p99]}
+        assert {[dict get $hist p99] <= [dict get $hist p99.9]}
+        assert {[dict get $hist p99.9] <= [dict get $hist max]}
+        dict get $hist calls
+    } {10}
+
+    test {LATENCY HISTOGRAM reports times in nanoseconds} {
+        r latency histogram debug reset
+        r debug sleep 0.1
+        set hist [r latency histogram debug]
+        assert_equal 1 [dict get $hist calls]
+        assert {[dict get $hist max] >= 100000000}
+        assert {[dict get $hist max] < 1000000000}
+        expr {[dict get $hist p50] == [dict get $hist max]}
+    } {1}
+
+    test {INFO latencystats reports the percentiles of called commands} {
+        set info [r info latencystats]
+        assert_match {*latency_percentiles_nsec_set:p50=*,p99=*,p99.9=*,max=*} $info
+        assert {![string match {*latency_percentiles_nsec_lpush:*} $info]}
+        r lpush mylist a
+        r info latencystats
+    } {*latency_percentiles_nsec_lpush:p50=*}
+
+    test {CONFIG RESETSTAT resets the histograms} {
+        r config resetstat
+        assert_equal 0 [dict get [r latency histogram set] calls]
+        assert {![string match {*latency_percentiles_nsec_set:*} [r info latencystats]]}
+        r set foo bar
+        r info latencystats
+    } {*latency_percentiles_nsec_set:*}
+
+    test {LATENCY HISTOGRAM with a wrong command or argument is refused} {
+        catch {r latency histogram nosuchcommand} e
+        assert_match {*Unknown command*} $e
+        catch {r latency histogram set foo} e
+        set e
+    } {*syntax error*}
+}
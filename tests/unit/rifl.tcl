@@ -0,0 +1,145 @@
+start_server {tags {"rifl"}} {
+    set rc [redis [srv 0 host] [srv 0 port]]
+    $rc select 9
+    $rc client rifl on
+
+    # The clientId and requestId that end a request, in base64.
+    proc rifl_ids {clientid reqid} {
+        list [::redis::int_base64 $clientid] [::redis::int_base64 $reqid]
+    }
+
+    test {At most once commands need RIFL ids} {
+        catch {$rc incr foo} e
+        set e
+    } {*missing or malformed RIFL ids*}
+
+    test {A request is executed at most once} {
+        assert_equal OK [$rc set foo bar {*}[rifl_ids 1 1]]
+        assert_equal {OK (RIFL duplicate)} [$rc set foo baz {*}[rifl_ids 1 1]]
+        r get foo
+    } {bar}
+
+    test {Replies to RIFL requests come in a CURP envelope} {
+        assert_equal 1 [$rc incr counter {*}[rifl_ids 1 2]]
+        lassign [$rc curp] opnum synced
+        expr {$opnum > 0}
+    } {1}
+
+    test {Read commands take no RIFL ids} {
+        $rc get foo
+    } {bar}
+
+    test {Clients with ids equal modulo 2^20 are kept apart} {
+        set other [expr {1 + (1 << 20)}]
+        assert_equal OK [$rc set foo2 1 {*}[rifl_ids $other 1]]
+        assert_equal {OK (RIFL duplicate)} [$rc set foo2 2 {*}[rifl_ids $other 1]]
+        assert_equal {OK (RIFL duplicate)} [$rc set foo 2 {*}[rifl_ids 1 2]]
+        r debug rifl
+    } [list 1 2 [expr {1 + (1 << 20)}] 1]
+
+    test {RIFL records are saved in the RDB} {
+        assert_equal OK [$rc set rdb 1 {*}[rifl_ids 7 1]]
+        assert_equal OK [$rc set rdb 2 {*}[rifl_ids 7 5]]
+        r debug reload
+        assert_equal 5 [dict get [r debug rifl] 7]
+        assert_equal {OK (RIFL duplicate)} [$rc set rdb 3 {*}[rifl_ids 7 5]]
+        assert_equal OK [$rc set rdb 4 {*}[rifl_ids 7 6]]
+        r get rdb
+    } {4}
+
+    test {DEBUG RIFL lists the last request of every client} {
+        set table [r debug rifl]
+        assert_equal [status r rifl_clients] [expr {[llength $table]/2}]
+        lsort -stride 2 -integer $table
+    } [list 1 2 7 6 [expr {1 + (1 << 20)}] 1]
+
+    test {DEBUG RIFL LOG writes the table to the log} {
+        assert_equal OK [r debug rifl log]
+        wait_for_condition 50 100 {
+            [string match {*ClientId: 7, lastRpcId: 6*} \
+                [exec tail -n 10 < [srv 0 stdout]]]
+        } else {
+            fail "The RIFL table is not in the log"
+        }
+    }
+
+    test {DEBUG RIFL takes no other argument} {
+        catch {r debug rifl foo} e
+        set e
+    } {*syntax error*}
+
+    test {RIFL records survive an AOF rewrite} {
+        r config set appendonly yes
+        wait_for_condition 50 100 {
+            [status r aof_rewrite_in_progress] == 0 &&
+            [status r aof_rewrite_scheduled] == 0 &&
+            [status r aof_enabled] == 1
+        } else {
+            fail "The AOF was not turned on"
+        }
+        r debug loadaof
+        r config set appendonly no
+        assert_equal {OK (RIFL duplicate)} [$rc set rdb 5 {*}[rifl_ids 7 6]]
+        lsort -stride 2 -integer [r debug rifl]
+    } [list 1 2 7 6 [expr {1 + (1 << 20)}] 1]
+
+    test {Records of idle clients expire with their lease} {
+        r config resetstat
+        r config set rifl-lease-time 1
+        assert_equal OK [$rc set lease 1 {*}[rifl_ids 100 1]]
+        wait_for_condition 50 100 {
+            [status r rifl_expired_clients] == 1
+        } else {
+            fail "The RIFL record did not expire"
+        }
+        # Leases granted before rifl-lease-time changed are kept.
+        assert_equal [list 1 2 7 6 [expr {1 + (1 << 20)}] 1] \
+            [lsort -stride 2 -integer [r debug rifl]]
+        catch {$rc set lease 2 {*}[rifl_ids 100 2]} e
+        assert_match {RIFLEXPIRED*} $e
+        # A client that starts over is accepted. Leases are counted in whole
+        # seconds, so give it a longer one for the next test.
+        r config set rifl-lease-time 2
+        $rc set lease 3 {*}[rifl_ids 101 1]
+    } {OK}
+
+    test {Requests renew the lease} {
+        for {set j 2} {$j < 10} {incr j} {
+            assert_equal OK [$rc set lease $j {*}[rifl_ids 101 $j]]
+            after 500
+        }
+        list [status r rifl_expired_clients] [dict get [r debug rifl] 101]
+    } {1 9}
+
+    test {Records never expire with rifl-lease-time 0} {
+        r config set rifl-lease-time 0
+        after 2500
+        status r rifl_expired_clients
+    } {1}
+}
+
+start_server {tags {"rifl repl"}} {
+    set master [srv 0 client]
+    set mc [redis [srv 0 host] [srv 0 port]]
+    $mc client rifl on
+    set master_host [srv 0 host]
+    set master_port [srv 0 port]
+
+    start_server {} {
+        test {A full resync replaces the RIFL table of the slave} {
+            set rc [redis [srv 0 host] [srv 0 port]]
+            $rc client rifl on
+            assert_equal OK [$rc set foo 1 {*}[rifl_ids 50 1]]
+            $rc close
+            assert_equal OK [$mc set bar 1 {*}[rifl_ids 60 1]]
+            assert_equal OK [$mc set bar 2 {*}[rifl_ids 60 2]]
+            r slaveof $master_host $master_port
+            wait_for_condition 50 100 {
+                [s master_link_status] eq {up}
+            } else {
+                fail "The slave did not sync"
+            }
+            r debug rifl
+        } {60 2}
+    }
+}
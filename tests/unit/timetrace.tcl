@@ -0,0 +1,40 @@
+# The BIO thread records the fsyncs of the group commit, which a read of
+# unsynced data asks for with appendfsync no.
+start_server {tags {"timetrace"} overrides {appendonly yes appendfsync no}} {
+    test {Nothing is recorded until TIMETRACE ON} {
+        r set foo bar
+        r get foo
+        r timetrace dump
+    } {No time trace events to print}
+
+    test {TIMETRACE DUMP returns the events of the BIO thread} {
+        r timetrace on
+        r set foo bar2
+        r get foo
+        wait_for_condition 50 100 {
+            [string match {*bio fsync done.*} [r timetrace dump]]
+        } else {
+            fail "The fsync was not traced"
+        }
+        set lines [split [string trim [r timetrace dump]] "\n"]
+        assert_match {*ns (+*ns): bio fsync started.} [lindex $lines 0]
+        lindex $lines 1
+    } {*ns (+*ns): bio fsync done.}
+
+    test {TIMETRACE RESET drops the recorded events} {
+        r timetrace reset
+        r timetrace dump
+    } {No time trace events to print}
+
+    test {Nothing is recorded after TIMETRACE OFF} {
+        r timetrace off
+        r set foo bar3
+        r get foo
+        r timetrace dump
+    } {No time trace events to print}
+
+    test {TIMETRACE refuses unknown subcommands} {
+        catch {r timetrace foo} e
+        set e
+    } {*Unknown TIMETRACE subcommand*}
+}
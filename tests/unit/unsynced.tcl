@@ -0,0 +1,198 @@
+# With appendfsync no the AOF is only fsynced when somebody waits for it.
+start_server {tags {"unsynced"} overrides {appendonly yes appendfsync no}} {
+    test {Reading an unsynced key waits for an fsync} {
+        r config resetstat
+        r set foo bar
+        list [r get foo] [status r fsync_waits]
+    } {bar 1}
+
+    test {Reading synced data does not wait} {
+        r get foo
+        status r fsync_waits
+    } {1}
+
+    test {A key deleted by an unsynced operation is unsynced too} {
+        r del foo
+        list [r exists foo] [status r fsync_waits]
+    } {0 2}
+
+    test {EXISTS waits for unsynced keys without touching keyspace stats} {
+        r config resetstat
+        r set foo bar
+        list [r exists foo nokey] [status r fsync_waits] \
+             [status r keyspace_hits] [status r keyspace_misses]
+    } {1 1 0 0}
+
+    test {Only the client that read unsynced data waits} {
+        # Without slaves to acknowledge it, nothing is ever synced.
+        r config set curp-sync-replicas 1
+        r set foo bar2
+        set rd [redis_deferring_client]
+        $rd get foo
+        wait_for_condition 50 100 {
+            [status r fsync_waiting_clients] == 1
+        } else {
+            fail "The client did not wait for the sync"
+        }
+        assert_equal PONG [r ping]
+        assert_equal OK [r set other 1]
+        assert_equal 1 [status r fsync_waiting_clients]
+        r config set curp-sync-replicas 0
+        set reply [$rd read]
+        $rd close
+        list $reply [status r fsync_waiting_clients]
+    } {bar2 0}
+
+    test {Waiting clients are released once nothing syncs anymore} {
+        r config set curp-sync-replicas 1
+        r set foo bar3
+        set rd [redis_deferring_client]
+        $rd get foo
+        wait_for_condition 50 100 {
+            [status r fsync_waiting_clients] == 1
+        } else {
+            fail "The client did not wait for the sync"
+        }
+        # The slaves still sync operations without the AOF.
+        r config set appendonly no
+        after 100
+        assert_equal 1 [status r fsync_waiting_clients]
+        r config set curp-sync-replicas 0
+        set reply [$rd read]
+        $rd close
+        r config set appendonly yes
+        wait_for_condition 50 100 {
+            [status r aof_rewrite_in_progress] == 0 &&
+            [status r aof_rewrite_scheduled] == 0 &&
+            [status r aof_enabled] == 1
+        } else {
+            fail "The AOF was not turned back on"
+        }
+        set reply
+    } {bar3}
+
+    test {Readers waiting together are released by one group fsync} {
+        set clients {}
+        for {set j 0} {$j < 10} {incr j} {
+            lappend clients [redis_deferring_client]
+            r set group:$j $j
+        }
+        r config resetstat
+        # Queue all the reads while the server sleeps, so that they are
+        # served by the same event loop iteration.
+        set sleeper [redis_deferring_client]
+        $sleeper debug sleep 0.5
+        after 100
+        set j 0
+        foreach rd $clients {
+            $rd get group:$j
+            incr j
+        }
+        set replies {}
+        foreach rd $clients {
+            lappend replies [$rd read]
+            $rd close
+        }
+        $sleeper read
+        $sleeper close
+        list $replies [status r group_fsyncs]
+    } {{0 1 2 3 4 5 6 7 8 9} 1}
+
+    test {The CURP envelope reports the synced opNum} {
+        set rc [redis [srv 0 host] [srv 0 port]]
+        $rc select 9
+        $rc client rifl on
+        $rc set curp:1 1 B B
+        lassign [$rc curp] opnum synced
+        assert {$synced < $opnum}
+        $rc get curp:1
+        $rc set curp:2 1 B C
+        lassign [$rc curp] opnum2 synced2
+        $rc close
+        list [expr {$opnum2 > $opnum}] [expr {$synced2 >= $opnum}]
+    } {1 1}
+
+    test {A write to an unsynced key waits for an fsync} {
+        r config resetstat
+        r set conflict 1
+        r set conflict 2
+        list [status r write_conflicts] [status r fsync_waits]
+    } {1 1}
+
+    test {Commuting writes to an unsynced key do not wait} {
+        r config resetstat
+        r incr counter
+        r incrby counter 2
+        r sadd set a
+        r sadd set b
+        r hset hash a 1
+        r hset hash b 2
+        r hincrby hash c 1
+        r hincrby hcounter a 1
+        r hincrby hcounter a 1
+        status r write_conflicts
+    } {0}
+
+    test {Writes that do not commute with the unsynced ones wait} {
+        r config resetstat
+        r incr counter2
+        r set counter2 10
+        r hset hash2 a 1
+        r hset hash2 a 2
+        r sadd set2 a
+        r del set2
+        status r write_conflicts
+    } {3}
+
+    test {Every write conflicts with witness-commutativity off} {
+        r config set witness-commutativity no
+        r config resetstat
+        r incr counter3
+        r incr counter3
+        r config set witness-commutativity yes
+        status r write_conflicts
+    } {1}
+
+    test {Writes do not wait with sync-on-write-conflict off} {
+        r config set sync-on-write-conflict no
+        r config resetstat
+        r set conflict2 1
+        r set conflict2 2
+        r config set sync-on-write-conflict yes
+        status r write_conflicts
+    } {0}
+
+    test {Unsynced keys are tracked until an fsync covers them} {
+        # Sync everything written so far.
+        r set unsynced:sync 1
+        r get unsynced:sync
+        r set unsynced:1 1
+        r hmset unsynced:2 a 1 b 2 c 3
+        set tracked [status r unsynced_keys]
+        r get unsynced:1
+        list $tracked [status r unsynced_keys]
+    } {2 0}
+
+    test {FLUSHALL makes every key unsynced} {
+        r config resetstat
+        r flushall
+        list [status r unsynced_keys] [r get unsynced:1] [status r fsync_waits]
+    } {0 {} 1}
+
+    test {Nothing is tracked without the AOF} {
+        r config set appendonly no
+        r config resetstat
+        r set unsynced:3 1
+        set tracked [status r unsynced_keys]
+        r get unsynced:3
+        r config set appendonly yes
+        wait_for_condition 50 100 {
+            [status r aof_rewrite_in_progress] == 0 &&
+            [status r aof_rewrite_scheduled] == 0 &&
+            [status r aof_enabled] == 1
+        } else {
+            fail "The AOF was not turned back on"
+        }
+        list $tracked [status r fsync_waits]
+    } {0 0}
+}
@@ -0,0 +1,140 @@
+start_server {tags {"witness"}} {
+    test {WREGISTER replies with the table geometry} {
+        list [r wregister 1] [r wconfig]
+    } {{1024 4} {1024 4}}
+
+    test {WRECORD is rejected for a master that never registered} {
+        r wrecord [wrecord_payload 2 5 5 1 1 [resp_request set a 1]]
+    } {REJECT}
+
+    test {Binary WRECORD is accepted and returned by WGETRECOVERYDATA} {
+        assert_equal ACCEPT \
+            [r wrecord [wrecord_payload 1 5 5 1 1 [resp_request set a 1]]]
+        # The recorded requests are sent back as they are, in RESP.
+        r wgetrecoverydata 1
+    } {{set a 1}}
+
+    test {WRECORD on the same key is rejected until the record is GCed} {
+        assert_equal REJECT \
+            [r wrecord [wrecord_payload 1 5 5 2 1 [resp_request set a 2]]]
+        r wgc [wgc_payload 1 {5 1 1}]
+        assert_equal {} [r wgetrecoverydata 1]
+        r wrecord [wrecord_payload 1 5 5 2 1 [resp_request set a 2]]
+    } {ACCEPT}
+
+    test {Text WRECORD and WGC take base64 integers} {
+        # Master 1, hash index and key hash 6, clientId 3, requestId 1.
+        assert_equal ACCEPT [r wrecord B G G D B [resp_request set b 1]]
+        r wgc 1 G D B
+        r wrecord B G G E B [resp_request set b 2]
+    } {ACCEPT}
+
+    test {Tables are kept per master} {
+        r wregister 3
+        assert_equal ACCEPT \
+            [r wrecord [wrecord_payload 3 5 5 1 1 [resp_request set a 3]]]
+        list [llength [r wgetrecoverydata 1]] [llength [r wgetrecoverydata 3]] \
+             [r wgetrecoverydata 4]
+    } {2 1 {}}
+
+    test {WMRECORD replies with a bitmap of the accepted records} {
+        r wregister 5
+        set reply [r wmrecord \
+            [wrecord_payload 5 9 9 1 1 [resp_request set c 1]] \
+            [wrecord_payload 5 9 9 2 1 [resp_request set c 2]] \
+            [wrecord_payload 5 10 10 3 1 [resp_request set d 1]]]
+        binary scan $reply c bits
+        expr {$bits & 0xff}
+    } {5}
+
+    test {A hash index that does not match our table is refused} {
+        catch {r wrecord [wrecord_payload 1 5 6 9 1 [resp_request set a 4]]} e
+        set e
+    } {WGEOMETRY 1024 4}
+
+    test {A wider hash index than our table is accepted} {
+        r wrecord [wrecord_payload 1 [expr {4096+11}] [expr {4096+11}] 9 1 \
+            [resp_request set e 1]]
+    } {ACCEPT}
+
+    test {Malformed WGC is refused} {
+        catch {r wgc [string range [wgc_payload 1 {5 1 1}] 0 end-1]} e
+        set e
+    } {*malformed*}
+
+    test {WGC for an unknown master is refused} {
+        catch {r wgc [wgc_payload 42 {5 1 1}]} e
+        set e
+    } {*not registered*}
+
+    # Master 10, a fresh table for the commutativity checks below.
+    proc wrecord10 {keyhash clientid reqid args} {
+        r wrecord [wrecord_payload 10 $keyhash $keyhash $clientid $reqid \
+            [resp_request {*}$args]]
+    }
+
+    test {Counter updates of the same key commute} {
+        r wregister 10
+        list [wrecord10 20 1 1 incr k] [wrecord10 20 2 1 incrby k 5] \
+             [wrecord10 20 3 1 decr k] [wrecord10 20 4 1 set k 1]
+    } {ACCEPT ACCEPT ACCEPT REJECT}
+
+    test {SADD commutes with SADD only} {
+        list [wrecord10 21 1 1 sadd s a] [wrecord10 21 2 1 sadd s b] \
+             [wrecord10 21 3 1 incr s]
+    } {ACCEPT ACCEPT REJECT}
+
+    test {Hash writes commute when their fields differ} {
+        list [wrecord10 22 1 1 hset h a 1] [wrecord10 22 2 1 hmset h b 2 c 3] \
+             [wrecord10 22 3 1 hset h a 4]
+    } {ACCEPT ACCEPT REJECT}
+
+    test {HINCRBY of the same field commute} {
+        list [wrecord10 23 1 1 hincrby h a 1] [wrecord10 23 2 1 hincrby h a 2] \
+             [wrecord10 23 3 1 hset h a 1]
+    } {ACCEPT ACCEPT REJECT}
+
+    test {RIFL ids at the end of a hash write are not fields} {
+        # Each request ends with its clientId and requestId in base64: the
+        # id B of the first and the last would otherwise be a common field.
+        list [wrecord10 24 1 1 hset h a 1 B B] [wrecord10 24 2 1 hset h b 2 C B] \
+             [wrecord10 24 1 2 hset h c 3 B C]
+    } {ACCEPT ACCEPT ACCEPT}
+
+    test {Nothing commutes with witness-commutativity off} {
+        r config set witness-commutativity no
+        set res [list [wrecord10 25 1 1 incr k] [wrecord10 25 2 1 incr k]]
+        r config set witness-commutativity yes
+        set res
+    } {ACCEPT REJECT}
+
+    test {Records larger than the biggest slab chunk are kept and freed} {
+        r wregister 11
+        set before [status r witness_record_allocated_bytes]
+        set value [string repeat x 20000]
+        assert_equal ACCEPT [r wrecord [wrecord_payload 11 30 30 1 1 \
+            [resp_request set big $value]]]
+        assert {[status r witness_record_allocated_bytes] >= $before + 20000}
+        assert_equal [list [list set big $value]] [r wgetrecoverydata 11]
+        r wgc [wgc_payload 11 {30 1 1}]
+        list [r wgetrecoverydata 11] \
+             [expr {[status r witness_record_allocated_bytes] - $before}]
+    } {{} 0}
+
+    test {Slab pages are released once their records are GCed} {
+        # 6 KB requests take 8 KB chunks, 8 to a page.
+        set value [string repeat y 6000]
+        set pages [status r witness_slab_pages]
+        set gc {}
+        for {set j 1} {$j <= 24} {incr j} {
+            assert_equal ACCEPT [r wrecord [wrecord_payload 11 [expr {40+$j}] \
+                [expr {40+$j}] $j 1 [resp_request set k$j $value]]]
+            lappend gc [expr {40+$j}] $j 1
+        }
+        set full [status r witness_slab_pages]
+        r wgc [wgc_payload 11 $gc]
+        # One empty page per class is kept around.
+        list [expr {$full - $pages}] [expr {[status r witness_slab_pages] - $pages}] \
+             [r wgetrecoverydata 11]
+    } {3 1 {}}
+}
@@ -0,0 +1,329 @@
+# Crash recovery benchmark and fault injection harness for CURP.
+#
+# Every iteration starts witnesses and a master from scratch, runs
+# redis-curp-load against them, and kills the master with SIGKILL at a crash
+# point armed with DEBUG CRASH-AT:
+#
+#   batch  an update was executed, but neither replied nor in the AOF yet.
+#   gc     a WGC was sent to the first witness only.
+#   fsync  the group commit fsync is in progress.
+#
+# The master is then restarted. We measure how long it takes to take normal
+# requests again, and its own recovery phases (INFO witness): AOF load,
+# recovery from the witnesses, and client replay. The load driver checks that
+# no acknowledged update was lost and that no update was applied twice.
+#
+# The witnesses listen on the port of the master, on 127.0.0.2, 127.0.0.3,
+# ... so this only runs where the whole 127.0.0.0/8 network is on the
+# loopback interface (Linux). The master also listens on the recovery port
+# (6380), which must be free.
+#
+# Usage: tclsh utils/curp-recovery.tcl [--iterations <n>] [--points <list>]
+#        [--port <port>] [--witnesses <n>] [--clients <n>] [--window <n>]
+#        [--requests <n>] [--preload <keys>] [--seed <n>] [--keep]
+#
+# The exit code is 1 if any iteration lost or duplicated an update.
+
+set ::root [file dirname [file dirname [file normalize [info script]]]]
+source $::root/tests/support/redis.tcl
+
+set ::iterations 10
+set ::points {batch gc fsync}
+set ::port 30100
+set ::witnesses 2
+set ::clients 10
+set ::window 8
+set ::requests 50000
+set ::preload 0
+set ::seed [clock seconds]
+set ::keep 0
+set ::workdir /tmp/curp-recovery
+
+# Range of the crash point count: the crash happens the Nth time the point
+# is reached, N picked at random in the range.
+array set ::crashrange {batch {1 25000} gc {1 20} fsync {1 20}}
+
+proc usage {} {
+    puts stderr "Usage: tclsh utils/curp-recovery.tcl \[--iterations <n>\] \[--points <list>\] \[--port <port>\] \[--witnesses <n>\] \[--clients <n>\] \[--window <n>\] \[--requests <n>\] \[--preload <keys>\] \[--seed <n>\] \[--keep\]"
+    exit 2
+}
+
+for {set j 0} {$j < [llength $argv]} {incr j} {
+    set opt [lindex $argv $j]
+    set arg [lindex $argv [expr {$j+1}]]
+    switch -- $opt {
+        --iterations {set ::iterations $arg; incr j}
+        --points {set ::points $arg; incr j}
+        --port {set ::port $arg; incr j}
+        --witnesses {set ::witnesses $arg; incr j}
+        --clients {set ::clients $arg; incr j}
+        --window {set ::window $arg; incr j}
+        --requests {set ::requests $arg; incr j}
+        --preload {set ::preload $arg; incr j}
+        --seed {set ::seed $arg; incr j}
+        --keep {set ::keep 1}
+        default usage
+    }
+}
+foreach p $::points {
+    if {![info exists ::crashrange($p)]} usage
+}
+expr {srand($::seed)}
+
+proc witness_ip {i} {
+    return 127.0.0.[expr {$i+2}]
+}
+
+proc start_server_no_wait {name ip args} {
+    set dir $::iterdir/$name
+    file mkdir $dir
+    exec $::root/src/redis-server --bind $ip --port $::port \
+        --dir $dir --logfile $dir/log --save "" {*}$args >>& $dir/stdout &
+}
+
+# A server without witnesses of its own (a witness, or a master with an
+# empty witness list) waits for replaying clients until the replay timeout,
+# which takes several seconds: start them all first.
+proc start_servers {servers} {
+    set pids {}
+    foreach {name ip args} $servers {
+        set pid [start_server_no_wait $name $ip {*}$args]
+        lappend ::pids $pid
+        lappend pids $pid
+    }
+    foreach {name ip args} $servers pid $pids {
+        if {[wait_for_server $ip $pid 30000] eq {}} {
+            puts stderr "Could not start $name ($::lasterror), see\
+                $::iterdir/$name"
+            kill_all
+            exit 2
+        }
+    }
+    return $pids
+}
+
+# Return INFO once the server at 'ip' takes normal requests, or {} after
+# 'timeout' ms, polling every 'interval' ms. Make sure it is process 'pid':
+# a server left over by an earlier run would hold the address.
+proc wait_for_server {ip pid timeout {interval 100}} {
+    set deadline [expr {[clock milliseconds]+$timeout}]
+    while {[clock milliseconds] < $deadline} {
+        if {[catch {probe $ip info} info]} {
+            set ::lasterror $info
+        } else {
+            if {[info_field $info process_id] != $pid} {
+                puts stderr "Another server is running on $ip:$::port"
+                kill_all
+                exit 2
+            }
+            if {[info_field $info recovery_state] ne {replay}} {
+                return $info
+            }
+        }
+        after $interval
+    }
+    return {}
+}
+
+# Send one command on a new connection, which is closed even on errors:
+# the servers close the connections they get while replaying.
+proc probe {ip args} {
+    set r [redis $ip $::port]
+    set err [catch {$r {*}$args} reply]
+    $r close
+    if {$err} {error $reply}
+    return $reply
+}
+
+proc master_args {} {
+    set ips {}
+    for {set i 0} {$i < $::witnesses} {incr i} {lappend ips [witness_ip $i]}
+    return [list --appendonly yes --witnessIp {*}$ips]
+}
+
+proc info_field {info field} {
+    if {[regexp "\r\n$field:(.*?)\r\n" $info -> value]} {
+        return $value
+    }
+    return {}
+}
+
+proc read_file {path} {
+    if {![file exists $path]} {return {}}
+    set fd [open $path]
+    set data [read $fd]
+    close $fd
+    return $data
+}
+
+# The listening socket is released once the process is a zombie, not
+# when it stops answering.
+proc wait_for_exit {pid} {
+    while {[file exists /proc/$pid] &&
+           ![string match {* Z *} [read_file /proc/$pid/stat]]} {
+        after 1
+    }
+}
+
+proc kill_all {} {
+    foreach pid $::pids {catch {exec kill -9 $pid}}
+    set ::pids {}
+}
+
+proc run_iteration {point iter} {
+    set ::iterdir $::workdir/$point-$iter
+    file delete -force $::iterdir
+    file mkdir $::iterdir
+    set ::pids {}
+
+    set servers {}
+    for {set i 0} {$i < $::witnesses} {incr i} {
+        lappend servers w$i [witness_ip $i] {}
+    }
+    start_servers $servers
+    set master [start_servers [list master 127.0.0.1 [master_args]]]
+    set r [redis 127.0.0.1 $::port]
+    if {$::preload > 0} {
+        # DEBUG POPULATE bypasses the AOF: rewrite it so the keys get loaded.
+        $r debug populate $::preload preload
+        $r bgrewriteaof
+        while {[info_field [$r info persistence] aof_rewrite_in_progress] ||
+               [info_field [$r info persistence] aof_rewrite_scheduled]} {
+            after 10
+        }
+    }
+    lassign $::crashrange($point) min max
+    set count [expr {$min+int(rand()*($max-$min+1))}]
+    $r debug crash-at $point $count
+    $r close
+
+    # Run the driver, and wait for either the crash or the end of the load.
+    set out $::iterdir/load.out
+    set witnessopts {}
+    for {set i 0} {$i < $::witnesses} {incr i} {
+        lappend witnessopts --witness [witness_ip $i]:$::port
+    }
+    exec sh -c "$::root/src/redis-curp-load -p $::port $witnessopts \
+        -c $::clients -P $::window -n $::requests --recovery-timeout 60 \
+        > $out 2>&1; echo status:\$? >> $out" &
+    set crashed 0
+    while 1 {
+        if {[catch {probe 127.0.0.1 ping}]} {
+            set crashed 1
+            break
+        }
+        if {[string match {*status:*} [read_file $out]]} break
+        after 10
+    }
+
+    set result [dict create point $point count $count crashed $crashed]
+    if {$crashed} {
+        wait_for_exit $master
+        set restart [clock milliseconds]
+        set master [start_server_no_wait master 127.0.0.1 {*}[master_args]]
+        lappend ::pids $master
+        set info [wait_for_server 127.0.0.1 $master 60000 1]
+        if {$info eq {}} {
+            puts stderr "$point #$iter: the master did not recover, see\
+                $::iterdir/master"
+            kill_all
+            exit 2
+        }
+        dict set result restart_ms [expr {[clock milliseconds]-$restart}]
+        foreach phase {load witness replay total} {
+            dict set result $phase [info_field $info recovery_${phase}_ms]
+        }
+        dict set result end_reason [info_field $info recovery_end_reason]
+    }
+
+    # The driver checks the keys once the master is back.
+    while {![string match {*status:*} [set output [read_file $out]]]} {
+        after 10
+    }
+    foreach line [split $output "\n"] {
+        if {[regexp {^([a-z_0-9]+):(.*?)\r?$} $line -> field value]} {
+            dict set result $field $value
+        }
+    }
+    kill_all
+    if {!$::keep} {file delete -force $::iterdir}
+    return $result
+}
+
+proc percentile {values p} {
+    set values [lsort -real $values]
+    set n [llength $values]
+    if {$n == 0} {return -}
+    set idx [expr {int(ceil($p/100.0*$n))-1}]
+    if {$idx < 0} {set idx 0}
+    lindex $values $idx
+}
+
+proc report {point results} {
+    set crashed {}
+    set failures 0
+    foreach res $results {
+        if {[dict get $res crashed]} {lappend crashed $res}
+        if {[dict exists $res status] && [dict get $res status] != 0} {
+            incr failures
+        }
+    }
+    puts ""
+    puts "=== $point: [llength $results] iterations,\
+        [llength $crashed] crashed, $failures failed"
+    puts [format "  %-22s %8s %8s %8s %8s" phase p50 p90 p99 max]
+    foreach {field label} {
+        load {AOF load (ms)}
+        witness {witness (ms)}
+        replay {client replay (ms)}
+        total {total (ms)}
+        restart_ms {restart->normal (ms)}
+        unavailable_ms {client outage (ms)}
+    } {
+        set values {}
+        foreach res $crashed {
+            if {[dict exists $res $field] && [dict get $res $field] ne {}} {
+                lappend values [dict get $res $field]
+            }
+        }
+        puts [format "  %-22s %8s %8s %8s %8s" $label \
+            [percentile $values 50] [percentile $values 90] \
+            [percentile $values 99] [percentile $values 100]]
+    }
+    set lost 0; set dup 0; set unacked 0; set applied 0
+    foreach res $crashed {
+        foreach {field var} {lost lost duplicated dup unacked unacked
+                             unacked_applied applied} {
+            if {[dict exists $res $field]} {
+                incr $var [dict get $res $field]
+            }
+        }
+    }
+    puts "  updates: lost $lost, duplicated $dup, in flight $unacked\
+        (applied $applied)"
+    return $failures
+}
+
+puts "CURP crash recovery: $::witnesses witnesses, $::clients clients,\
+    window $::window, $::requests updates, $::preload preloaded keys,\
+    seed $::seed"
+set failures 0
+foreach point $::points {
+    set results {}
+    for {set iter 0} {$iter < $::iterations} {incr iter} {
+        set res [run_iteration $point $iter]
+        lappend results $res
+        if {[dict get $res crashed]} {
+            puts [format "%s #%d: crash at %d, total %s ms, restart->normal\
+                %s ms, lost %s, duplicated %s" $point $iter \
+                [dict get $res count] [dict get $res total] \
+                [dict get $res restart_ms] [dict get $res lost] \
+                [dict get $res duplicated]]
+        } else {
+            puts "$point #$iter: the load ended before crash point\
+                [dict get $res count]"
+        }
+    }
+    incr failures [report $point $results]
+}
+exit [expr {$failures > 0}]